@@ -124,15 +124,22 @@ paddr_t ram_getfirstfree(void);
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ *
+ * A shootdown names the address space the mapping belongs to, so a
+ * cpu that has since switched to another address space (and thus
+ * already flushed its TLB) can ignore it. A ts_vaddr of
+ * TLBSHOOTDOWN_ALL asks for the whole TLB to be flushed; a ts_as of
+ * NULL matches whatever address space the target has loaded.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space of the mapping */
+	vaddr_t ts_vaddr;		/* page to invalidate */
 };
 
+#define TLBSHOOTDOWN_ALL ((vaddr_t)0)
 #define TLBSHOOTDOWN_MAX 16
 
 
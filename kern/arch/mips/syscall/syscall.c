@@ -37,6 +37,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -113,6 +114,11 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
 
 	    /* process calls */
 
@@ -142,6 +148,14 @@ syscall(struct trapframe *tf)
 		err = sys_getpid(&retval);
 		break;
 
+	    case SYS_getpriority:
+		err = sys_getpriority(tf->tf_a0, tf->tf_a1, &retval);
+		break;
+
+	    case SYS_setpriority:
+		err = sys_setpriority(tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+
 
 	    /* file calls */
 
@@ -261,6 +275,36 @@ syscall(struct trapframe *tf)
 		}
 		break;
 
+#if !OPT_DUMBVM
+	    /* memory calls */
+
+	    case SYS_madvise:
+		err = sys_madvise((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+
+	    case SYS_mprotect:
+		err = sys_mprotect((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+
+	    case SYS_futex_wait:
+		err = sys_futex_wait((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_futex_wake:
+		err = sys_futex_wake((userptr_t)tf->tf_a0, tf->tf_a1, &retval);
+		break;
+
+	    /* checkpoint/restore */
+
+	    case SYS_checkpoint:
+		err = sys_checkpoint(tf, (userptr_t)tf->tf_a0, &retval);
+		break;
+
+	    case SYS_restore:
+		err = sys_restore(tf, (userptr_t)tf->tf_a0, &retval);
+		break;
+#endif
+
 
 
 	    default:
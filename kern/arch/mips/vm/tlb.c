@@ -50,7 +50,7 @@ void tlb_invalid_by_vaddr(vaddr_t vaddr)
 	int spl = splhigh();
 
 	int index = tlb_probe(vaddr, 0);
-	if(index>0)
+	if(index>=0)
 	{
 		tlb_write(TLBHI_INVALID(index), TLBLO_INVALID(),index);
 	}
@@ -96,6 +96,16 @@ void tlb_flush()
 void tlb_force_write(uint32_t hi, uint32_t lo)
 {
     int spl = splhigh();
-    tlb_random(hi, lo);
+    // replace an existing entry for the page (e.g. upgrading it to writable),
+    // a duplicate would be a machine check
+    int index = tlb_probe(hi, 0);
+    if (index >= 0)
+    {
+        tlb_write(hi, lo, index);
+    }
+    else
+    {
+        tlb_random(hi, lo);
+    }
     splx(spl);
 }
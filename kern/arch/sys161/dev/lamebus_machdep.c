@@ -58,7 +58,9 @@
  *
  * The c0_count register increments on every cycle; when the value
  * matches the c0_compare register, the timer interrupt line is
- * asserted. Writing to c0_compare again clears the interrupt.
+ * asserted. Writing to c0_compare again clears the interrupt, and
+ * System/161 restarts c0_count from 0, so the value written is the
+ * number of cycles until the next interrupt.
  */
 static
 void
@@ -76,6 +78,49 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read c0_count ($9): cycles since the timer was last set.
+ */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+/* Most hardclock periods the timer can be set for without overflowing */
+#define MIPS_TIMER_MAXTICKS	(0xffffffffU / (CPU_FREQUENCY / HZ))
+
+/*
+ * Set this cpu's next hardclock NTICKS periods away.
+ */
+void
+mainbus_timer_defer(unsigned nticks)
+{
+	KASSERT(nticks > 0);
+	if (nticks > MIPS_TIMER_MAXTICKS) {
+		nticks = MIPS_TIMER_MAXTICKS;
+	}
+	mips_timer_set(CPU_FREQUENCY / HZ * nticks);
+}
+
+/*
+ * Whole hardclock periods since this cpu's timer was last set.
+ */
+unsigned
+mainbus_timer_elapsed(void)
+{
+	return mips_timer_get() / (CPU_FREQUENCY / HZ);
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
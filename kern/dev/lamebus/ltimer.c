@@ -49,8 +49,6 @@
 /* Granularity of countdown timer (usec) */
 #define LT_GRANULARITY   1000000
 
-static bool havetimerclock;
-
 /*
  * Setup routine called by autoconf stuff when an ltimer is found.
  */
@@ -84,18 +82,9 @@ config_ltimer(struct ltimer_softc *lt, int ltimerno)
 	lt->lt_hardclock = 0;
 
 	/*
-	 * We do, however, use ltimer for the timer clock, since the
-	 * on-chip timer can't do that.
+	 * Timed sleeps are done with the timers in timer.c, off
+	 * hardclock, so the countdown timer isn't used either.
 	 */
-	if (!havetimerclock) {
-		havetimerclock = true;
-		lt->lt_timerclock = 1;
-
-		/* Wire it to go off once every second. */
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_ROE, 1);
-		bus_write_register(lt->lt_bus, lt->lt_buspos, LT_REG_COUNT,
-				   LT_GRANULARITY);
-	}
 
 	return 0;
 }
@@ -118,12 +107,6 @@ ltimer_irq(void *vlt)
 		if (lt->lt_hardclock) {
 			hardclock();
 		}
-		/*
-		 * Likewise for timerclock.
-		 */
-		if (lt->lt_timerclock) {
-			timerclock();
-		}
 	}
 }
 
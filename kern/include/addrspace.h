@@ -37,6 +37,7 @@
 
 #include <vm.h>
 #include <list.h>
+#include <kern/unistd.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
@@ -55,6 +56,11 @@ enum region_type {
     OTHER
 };
 
+// by default a process may keep all but this fraction of user memory resident
+#define AS_RSS_RESERVE_DIVISOR 4
+// an instruction can need its code page, a data page and the stack at once
+#define AS_RSS_LIMIT_MIN 4
+
 struct as_region_metadata {
     vaddr_t region_vaddr;
     size_t npages;
@@ -65,8 +71,22 @@ struct as_region_metadata {
     char rwxflag;
 
     enum region_type type;
+
+    // madvise hint for the region, MADV_NORMAL/RANDOM/SEQUENTIAL
+    int advice;
+
+    // read-ahead state, see readahead.c: the last page faulted on, the stride
+    // (in pages) to the one before it, the window and how much of it is queued
+    vaddr_t ra_last;
+    int ra_stride;
+    unsigned ra_window;
+    unsigned ra_ahead;
+
     // Advanced part for demand loading
+    // pages never touched are read from here, at region_offset, rather than
+    // zero filled; used for restoring checkpoints
     struct vnode *region_vnode;
+    off_t region_offset;
 
     // Link to the next data struct
     struct list_head link;
@@ -87,6 +107,24 @@ struct addrspace {
     // struct as_region_metadata *list;
     struct list *list;
     char is_loading;
+
+    // page table backend's own data, e.g. the two-level directory
+    void *pt_data;
+
+    // resident pages (valid ptes, counted by the page table) and pages in regions
+    unsigned rss;
+    unsigned vsize;
+    // limits on those in pages, 0 for none; inherited over fork and exec
+    unsigned rss_limit;
+    unsigned vsize_limit;
+
+    // while exec loads into this address space its frames are taken from the
+    // image it replaces (see as_recycle_frame): that one, how far through it
+    // we are, and how many of its pages are gone
+    struct addrspace *recycle_from;
+    struct as_region_metadata *recycle_region;
+    size_t recycle_page;
+    unsigned recycle_taken;
 #endif
 };
 
@@ -148,6 +186,23 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 // Additions
 void as_destroy_region(struct addrspace *as, struct as_region_metadata *to_del);
+int as_advise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice);
+int as_protect(struct addrspace *as, vaddr_t vaddr, size_t len, int prot);
+int as_define_backed_region(struct addrspace *as, vaddr_t vaddr, size_t npages, char rwxflag,
+                            enum region_type type, int advice, struct vnode *vn, off_t offset);
+
+int as_map_frames(struct addrspace *as, vaddr_t vaddr, paddr_t *frames, unsigned nframes);
+
+// Frame recycling over exec, see addrspace.c
+void as_recycle_begin(struct addrspace *as, struct addrspace *old);
+bool as_recycle_end(struct addrspace *as);
+paddr_t as_get_frame(struct addrspace *as, bool *recycled);
+
+// Per process memory limits, see addrspace.c
+bool as_rss_full(struct addrspace *as);
+void as_bootstrap_limits(unsigned nframes);
+void as_get_default_limits(unsigned *rss, unsigned *vsize);
+int as_set_default_limits(unsigned rss, unsigned vsize);
 /*
  * Functions in loadelf.c
  *    load_elf - load an ELF user program executable into the current
@@ -38,8 +38,9 @@
 
 
 /*
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, for
+ * scheduling; less often when the CPU is idle or has only one thread
+ * to run, when the scheduler defers it and resumes it again.
  */
 
 /* hardclocks per second */
@@ -47,12 +48,8 @@
 
 void hardclock_bootstrap(void);
 void hardclock(void);
-
-/*
- * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
- */
-void timerclock(void);
+void hardclock_defer(bool idle);
+void hardclock_resume(void);
 
 /*
  * gettime() may be used to fetch the current time of day.
@@ -69,5 +69,8 @@ int copyout(const void *src, userptr_t userdest, size_t len);
 int copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *got);
 int copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *got);
 
+/* Turn the page table shortcut in vm/copyinout.c on or off in this thread, for benchmarks */
+bool copy_set_direct(bool direct);
+
 
 #endif /* _COPYINOUT_H_ */
@@ -1,35 +1,48 @@
-// #include <
 #ifndef _CORE_SWAP_H_
 #define _CORE_SWAP_H_
 
 #include <vm.h>
-
-#define SWAP_FILE ".os161_coreswap"
-// #define SWAP_PAGE_COUNT
-
-enum E_SWAP_STATUS
-{
-    SWAP_VACANCY = 0,
-    SWAP_ALLOCATING = 1,
-    SWAP_INUSE = 2,
-
-};
-
-struct swap_page
-{
-
-    pagetable_entry* owner; // owned by user prog , if user prog, pointing to the the leaf entry of pagetable. the kernel page should not be swapped out
-
-    off_t offset; // which location of the swap file stored in core swap, start from 0
-
-    int swap_status; // E_SWAP_STATUS
-
-};
-
-void init_coreswap();
-void destroy_coreswap();
-
-int swapout_corepage(struct core_page* page);
-int swapin_corepage(struct core_page* page);
+#include <clock.h>
+
+// backing store for evicted user pages, a raw disk so no filesystem is needed
+#define SWAP_FILE "lhd0raw:"
+
+// a swapped out pte has SWAPMASK set, VALIDMASK clear, and the slot number
+// where the frame number normally goes
+#define SWAP_SLOT_TO_PTE(slot) ((paddr_t)(slot) << 12)
+#define PTE_TO_SWAP_SLOT(paddr) ((unsigned)((paddr) >> 12))
+
+// default watermarks, as a fraction of the frames available at boot
+#define RECLAIM_LOW_DIVISOR  32
+#define RECLAIM_HIGH_DIVISOR 16
+
+// reference sampling defaults, every quarter second clear the bit on 32 pages
+#define REFSAMPLE_INTERVAL (HZ / 4)
+#define REFSAMPLE_BATCH    32
+
+struct addrspace;
+
+// the big vm lock, serializes eviction, swap in and address space teardown/copy
+// never wait for a free frame while holding it, the reclaim daemon needs it
+extern struct lock *vm_lock;
+
+void init_coreswap(void);
+
+// move one page between a frame and a swap slot, caller holds vm_lock
+int swapout_corepage(paddr_t paddr, unsigned slot);
+int swapin_corepage(paddr_t paddr, unsigned slot);
+void free_swap_slot(unsigned slot);
+int swap_write_page(void* buf, unsigned* slot);
+
+// reclaim daemon interface, see coreswap.c
+void reclaim_check(void);
+int reclaim_self(struct addrspace* as);
+bool reclaim_memory_low(void);
+int reclaim_wait(void);
+void reclaim_get_watermarks(int *low, int *high);
+int reclaim_set_watermarks(int low, int high);
+void refsample_get_rate(unsigned *interval, unsigned *batch);
+int refsample_set_rate(unsigned interval, unsigned batch);
+void coreswap_printstats(void);
 
 #endif
@@ -61,6 +61,12 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_tickcredit;		/* Ticks not yet seen by hardclock() */
+
+	/* Load balancing statistics (thread_printstats) */
+	uint64_t c_runqsum;		/* Run queue length, summed per tick */
+	unsigned c_idleclocks;		/* hardclock() calls while idle */
+	unsigned c_steals;		/* Threads taken from other cpus */
 
 	/*
 	 * Accessed by other cpus.
@@ -69,6 +75,8 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	unsigned c_stolen;		/* Threads taken by other cpus */
+	unsigned c_tickdefer;		/* Periods until the next hardclock */
 
 	/*
 	 * Accessed by other cpus.
@@ -88,6 +96,19 @@ struct cpu {
 	unsigned c_numshootdown;
 	struct spinlock c_ipi_lock;
 
+	/*
+	 * Also protected by the IPI lock.
+	 *
+	 * c_tlbas is the address space whose translations may be in
+	 * this cpu's TLB; it is set by as_activate(), which flushes
+	 * the TLB at the same time. Shootdowns for any other address
+	 * space need not be sent here. c_shootdown_serial is bumped
+	 * every time this cpu finishes a batch of shootdowns, so a
+	 * sender can wait for its requests to have been carried out.
+	 */
+	struct addrspace *c_tlbas;
+	volatile unsigned c_shootdown_serial;
+
 	/*
 	 * Accessed by other cpus. Protected inside hangman.c.
 	 */
@@ -155,6 +176,9 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_as sends a batch of shootdowns to every other CPU
+ * that has the given address space loaded, and waits until they have
+ * all been processed. It returns the number of CPUs interrupted.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -169,6 +193,9 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_as(struct addrspace *as,
+			     const struct tlbshootdown *mappings,
+			     unsigned num);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,16 @@
+#ifndef _FUTEX_H_
+#define _FUTEX_H_
+
+#include <vm.h>
+
+// wait queues, hashed by the physical address of the futex word
+#define FUTEX_NBUCKETS 64
+
+void futex_bootstrap(void);
+
+// sleep if the int at UADDR still holds VAL (EAGAIN if it doesn't)
+int futex_wait(userptr_t uaddr, int val);
+// wake up to NWAKE threads sleeping on UADDR, the number woken in *WOKEN
+int futex_wake(userptr_t uaddr, int nwake, int* woken);
+
+#endif
@@ -64,10 +64,11 @@
 
 /* Max bytes for an exec function (should be at least 16K) */
 /*
- * UNSW Note: We use max 4K to avoid the frametable allocator needing
- * to deal with greater than 4K allocations
+ * UNSW Note: exec gathers the arguments a page at a time straight into
+ * the new stack (see argbuf in runprogram.c), so this is not limited by
+ * the 4K kmalloc limit and only costs what is actually passed.
  */
-#define __ARG_MAX       (4 * 1024)
+#define __ARG_MAX       (64 * 1024)
 
 /*
  * Important for system behavior, but not a big part of the API.
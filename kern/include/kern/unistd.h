@@ -35,5 +35,18 @@
 #define STDOUT_FILENO 1      /* Standard output */
 #define STDERR_FILENO 2      /* Standard error */
 
+/* Page protections for mmap() and mprotect() */
+#define PROT_NONE  0         /* No access */
+#define PROT_READ  1         /* Readable */
+#define PROT_WRITE 2         /* Writable */
+#define PROT_EXEC  4         /* Executable */
+
+/* Advice for madvise() */
+#define MADV_NORMAL     0    /* No special treatment */
+#define MADV_RANDOM     1    /* Expect random access, no fault-around */
+#define MADV_SEQUENTIAL 2    /* Expect sequential access, fault ahead */
+#define MADV_WILLNEED   3    /* Will need these pages, fault them in now */
+#define MADV_DONTNEED   4    /* Don't need these pages, free them now */
+
 
 #endif /* _KERN_UNISTD_H_ */
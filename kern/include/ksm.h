@@ -0,0 +1,27 @@
+#ifndef _KSM_H_
+#define _KSM_H_
+
+#include <vm.h>
+
+struct addrspace;
+
+// the scanner wakes this often (seconds) to look at its batch of frames
+#define KSM_INTERVAL 1
+// candidate and merged frames remembered, by content hash
+#define KSM_UNSTABLE 256
+#define KSM_STABLE   512
+
+void ksm_bootstrap(void);
+
+// write fault on a merged page (SHAREDMASK in the pte), give it its own frame
+int ksm_unshare(struct addrspace* as, vaddr_t vaddr);
+// a pte mapping frame PADDR is gone, caller holds vm_lock
+void ksm_free_frame(paddr_t paddr);
+
+// frames hashed per KSM_INTERVAL, 0 is off (the default)
+unsigned ksm_get_rate(void);
+void ksm_set_rate(unsigned pages);
+
+void ksm_printstats(void);
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef LOCKSTAT_H
+#define LOCKSTAT_H
+
+/*
+ * Lock contention profiling. Enable with "options lockstat" in the
+ * kernel config; the lockstat menu command prints and resets the
+ * counts.
+ *
+ * Counts are kept per lock name, so all the locks made with the same
+ * name are added up together. Spinlocks have no names and are counted
+ * by the place they're acquired from instead. Condition variables
+ * count the time spent waiting on them; they're never "held".
+ */
+
+#include "opt-lockstat.h"
+
+#if OPT_LOCKSTAT
+
+/* Kinds of thing counted */
+#define LOCKSTAT_SPINLOCK	0
+#define LOCKSTAT_LOCK		1
+#define LOCKSTAT_CV		2
+
+struct lockstat;
+
+/* Per lock state: what to charge it to, and when it was acquired. */
+struct lockstat_hold {
+	struct lockstat *h_stat;
+	uint64_t h_start;		/* in ns; 0 if not being timed */
+};
+
+void lockstat_bootstrap(void);
+void lockstat_init(struct lockstat_hold *h, int kind, const char *name);
+uint64_t lockstat_now(void);
+void lockstat_acquired(struct lockstat_hold *h, uint64_t waitstart);
+void lockstat_spinlock_acquired(struct lockstat_hold *h, const void *site,
+				uint64_t waitstart);
+void lockstat_released(struct lockstat_hold *h);
+void lockstat_cv_waited(struct lockstat_hold *h, uint64_t waitstart);
+void lockstat_print(void);
+void lockstat_reset(void);
+
+#define LOCKSTAT_HOLD(sym)	struct lockstat_hold sym
+#define LOCKSTAT_HOLD_INITIALIZER	{ NULL, 0 },
+
+#define LOCKSTAT_INIT(h, kind, name)	lockstat_init(h, kind, name)
+#define LOCKSTAT_SPINLOCK_INIT(h)	((h)->h_stat = NULL, (h)->h_start = 0)
+
+/* When a wait started, or 0 if there wasn't one */
+#define LOCKSTAT_TIMER(t)	uint64_t t = 0
+#define LOCKSTAT_START(t)	do { if ((t) == 0) (t) = lockstat_now(); } while (0)
+
+#define LOCKSTAT_ACQUIRED(h, t)	lockstat_acquired(h, t)
+#define LOCKSTAT_SPINLOCK_ACQUIRED(h, t) \
+	lockstat_spinlock_acquired(h, __builtin_return_address(0), t)
+#define LOCKSTAT_RELEASED(h)	lockstat_released(h)
+#define LOCKSTAT_CV_WAITED(h, t) lockstat_cv_waited(h, t)
+
+#else
+
+#define LOCKSTAT_HOLD(sym)
+#define LOCKSTAT_HOLD_INITIALIZER
+
+#define LOCKSTAT_INIT(h, kind, name)
+#define LOCKSTAT_SPINLOCK_INIT(h)
+
+#define LOCKSTAT_TIMER(t)
+#define LOCKSTAT_START(t)
+
+#define LOCKSTAT_ACQUIRED(h, t)
+#define LOCKSTAT_SPINLOCK_ACQUIRED(h, t)
+#define LOCKSTAT_RELEASED(h)
+#define LOCKSTAT_CV_WAITED(h, t)
+
+#endif
+
+#endif /* LOCKSTAT_H */
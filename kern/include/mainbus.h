@@ -48,6 +48,14 @@ void mainbus_start_cpus(void);
 /* Bus-level interrupt handler, called from cpu-level trap/interrupt code */
 void mainbus_interrupt(struct trapframe *);
 
+/*
+ * Make this cpu's next hardclock come NTICKS hardclock periods from
+ * now rather than one, and find how many whole periods have passed
+ * since it was last set. (For tickless operation; see clock.c.)
+ */
+void mainbus_timer_defer(unsigned nticks);
+unsigned mainbus_timer_elapsed(void);
+
 /* Find the size of main memory. */
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
@@ -51,6 +51,8 @@
 struct openfile {
 	struct vnode *of_vnode;
 	int of_accmode;	/* from open: O_RDONLY, O_WRONLY, or O_RDWR */
+	int of_openflags;	/* all the flags from open, for checkpoints */
+	char *of_path;	/* absolute name it was opened by, for checkpoints */
 
 	struct lock *of_offsetlock;	/* lock for of_offset */
 	off_t of_offset;
@@ -11,6 +11,8 @@
 #define ENTRYMASK 0xfffff000
 #define OFFSETMASK 0x00000fff
 
+#define SHAREDMASK  (1<<7)
+#define REFMASK     (1<<6)
 #define SWAPMASK    (1<<5)
 #define READWRITE   (1<<4)
 #define NCACHEMASK  (TLBLO_NOCACHE >> 8)
@@ -59,9 +61,12 @@ struct hpt_entry
 
     // bits 0 - GLOBAL
     // bits 1 - VALID
-    // bits 2 - DIRTY
+    // bits 2 - DIRTY, modified since it was last in swap; the TLB is only writable once set
     // bits 3 - NCACHE
-    // bits 4 - READ/WRITE for advanced
+    // bits 4 - READ/WRITE, the page may be written (first write sets DIRTY)
+    // bits 5 - SWAP, paged out, paddr holds the swap slot (VALID is clear)
+    // bits 6 - REF, loaded into a TLB since the reference sampler last cleared it;
+    //          never set means no TLB holds it, the TLB is refilled in software
 
     char control;
 
@@ -69,6 +74,66 @@ struct hpt_entry
     struct hpt_entry *next;
 };
 
+/*
+    Page table backends
+
+    The calls below are the same whatever the page table looks like underneath;
+    they go through the backend chosen at boot (pt_select, the "vmpt" menu command):
+        hpt      - the global hashed page table above, keyed by (vaddr, pid)
+        2level   - a two-level table per address space, 4MB per leaf page
+   */
+
+// One entry as the backends hand it over; paddr is the frame, or the swap slot
+// (see SWAP_SLOT_TO_PTE) when SWAPMASK is set, upper 20 bits only
+struct pt_pte
+{
+    paddr_t paddr;
+    char control;
+};
+
+// What the page table itself costs, for vmstat and the ptbench test
+struct pt_stats
+{
+    unsigned entries;       // mappings held
+    unsigned tables;        // hash chain nodes (hpt), or leaf pages (2level)
+    unsigned long bytes;    // memory used, fixed part included
+};
+
+struct addrspace;
+
+struct pt_backend
+{
+    const char *name;
+    // once at boot, whichever backend is used
+    void (*bootstrap)( void );
+    // per address space set up and tear down, all entries are gone before destroy
+    int (*as_create)( struct addrspace *as );
+    void (*as_destroy)( struct addrspace *as );
+    // the lock covering the entries of pid (one global lock, or one per address space)
+    void (*lock)( pid_t pid );
+    void (*unlock)( pid_t pid );
+    // these need the lock held; insert may drop it for a moment to allocate
+    // all return 0, or -1 if there is no entry (insert: no memory, or already there)
+    int (*get)( vaddr_t vaddr, pid_t pid, struct pt_pte *pte );
+    int (*set)( vaddr_t vaddr, pid_t pid, const struct pt_pte *pte );
+    int (*insert)( vaddr_t vaddr, pid_t pid, const struct pt_pte *pte );
+    int (*remove)( vaddr_t vaddr, pid_t pid, struct pt_pte *old );
+    void (*stats)( struct pt_stats *st );
+};
+
+extern const struct pt_backend pt_hashed_backend;
+extern const struct pt_backend pt_twolevel_backend;
+
+// Choose the backend by name, only while no user address space exists (EBUSY)
+int pt_select( const char *name );
+const char *pt_name( void );
+const char *pt_backend_name( int index );
+void pt_getstats( struct pt_stats *st );
+
+// Called from as_create/as_destroy
+int pt_as_create( struct addrspace *as );
+void pt_as_destroy( struct addrspace *as );
+
 // this initialises the page table
 void init_page_table( void );
 
@@ -107,8 +172,11 @@ void reset_mask( vaddr_t vaddr , pid_t pid , uint32_t mask);
 // Should return error code if not successfuld
 int get_tlb_entry(  vaddr_t vaddr , pid_t pid, uint32_t* tlb_hi, uint32_t* tlb_lo );
 
-// Initialise the hash table and set the fields to the initial values
-int init_hashtable( void );
+// Raw access for paging, paddr holds the swap slot when SWAPMASK is set
+int get_page_entry( vaddr_t vaddr, pid_t pid, paddr_t* paddr, char* control );
+int update_page_entry( vaddr_t vaddr, pid_t pid, paddr_t paddr, char control );
+int mark_entry_dirty( vaddr_t vaddr, pid_t pid );
+int mark_entry_writable( vaddr_t vaddr, pid_t pid );
 
 void test_pagetable( void );
 #endif
@@ -65,6 +65,9 @@ struct proc {
 	struct vnode *p_cwd;		/* current working directory */
 	struct filetable *p_filetable;	/* table of open files */
 
+	/* scheduling */
+	int p_nice;			/* setpriority() value */
+
 	/* add more material here as needed */
 };
 
@@ -101,6 +104,9 @@ int proc_addthread(struct proc *proc, struct thread *t);
 /* Detach a thread from its process. */
 void proc_remthread(struct thread *t);
 
+/* Set the nice value of a process and all its threads. */
+void proc_setnice(struct proc *proc, int nice);
+
 /* Fetch the address space of the current process. */
 struct addrspace *proc_getas(void);
 
@@ -0,0 +1,28 @@
+#ifndef _READAHEAD_H_
+#define _READAHEAD_H_
+
+#include <vm.h>
+
+struct addrspace;
+struct as_region_metadata;
+
+// read-ahead window in pages: starts at the minimum once a fault pattern shows up,
+// doubles on every fault that keeps to it and drops to nothing on one that doesn't
+#define READAHEAD_MIN    2
+#define READAHEAD_MAX    32
+// strides (in pages) further apart than this aren't worth following
+#define READAHEAD_STRIDE_MAX 16
+// requests waiting for the read-ahead thread, more are dropped
+#define READAHEAD_QUEUE  16
+
+void readahead_bootstrap(void);
+
+// called by vm_fault after every fault it handled
+void readahead_fault(struct addrspace* as, struct as_region_metadata* region, vaddr_t vaddr);
+
+// forget (and wait out) any read-ahead for an address space going away
+void readahead_cancel(struct addrspace* as);
+
+void readahead_printstats(void);
+
+#endif
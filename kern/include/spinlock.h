@@ -37,6 +37,7 @@
 
 #include <cdefs.h>
 #include <hangman.h>
+#include <lockstat.h>
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -51,30 +52,52 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * A spinlock is either a test-and-set lock, the default, or a ticket
+ * lock. A ticket lock hands itself out in the order cpus asked for
+ * it, so none can be starved, and its waiters only read while they
+ * spin; it costs an atomic increment even when uncontended. Use it
+ * for locks that see a lot of contention between cpus.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+	volatile spinlock_data_t splk_lock; /* Memory word where we spin,
+					       or next ticket. */
+	volatile spinlock_data_t splk_serving; /* Ticket now served. */
+	bool splk_ticket;		    /* Ticket lock? */
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	LOCKSTAT_HOLD(splk_stat);	    /* Contention profiling. */
 	HANGMAN_LOCKABLE(splk_hangman);     /* Deadlock detector hook. */
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or global.
  */
 #ifdef OPT_HANGMAN
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL, \
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, false, NULL, \
+				  LOCKSTAT_HOLD_INITIALIZER \
+				  HANGMAN_LOCKABLE_INITIALIZER }
+#define SPINLOCK_TICKET_INITIALIZER { SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, true, NULL, \
+				  LOCKSTAT_HOLD_INITIALIZER \
 				  HANGMAN_LOCKABLE_INITIALIZER }
 #else
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, false, NULL, \
+				  LOCKSTAT_HOLD_INITIALIZER }
+#define SPINLOCK_TICKET_INITIALIZER { SPINLOCK_DATA_INITIALIZER, \
+				  SPINLOCK_DATA_INITIALIZER, true, NULL, \
+				  LOCKSTAT_HOLD_INITIALIZER }
 #endif
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_ticket	Same, making it a ticket lock.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
@@ -84,6 +107,7 @@ struct spinlock {
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_ticket(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include <thread.h>
 
 /*
  * Dijkstra-style semaphore.
@@ -71,6 +72,11 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * A thread waiting for a lock spins while the holder is running on
+ * another cpu, and sleeps otherwise. While threads sleep waiting for
+ * a lock the holder runs at the best of their levels, if that's better
+ * than its own (priority inheritance). See synch.c.
  */
 struct lock {
         char *lk_name;
@@ -78,6 +84,10 @@ struct lock {
         struct wchan *lk_wchan;
         struct spinlock lk_lock;
         struct thread *volatile lk_holder;
+        struct lock *lk_nextheld;       /* Holder's other locks */
+        unsigned lk_nwaiters;           /* Threads asleep waiting */
+        unsigned short lk_waiters[SCHED_NLEVELS]; /* ... at each level */
+        LOCKSTAT_HOLD(lk_stat);         /* Contention profiling. */
 };
 
 struct lock *lock_create(const char *name);
@@ -117,6 +127,7 @@ struct cv {
         char *cv_name;
         struct wchan *cv_wchan;
         struct spinlock cv_wchanlock;
+        LOCKSTAT_HOLD(cv_stat);         /* Contention profiling. */
 };
 
 struct cv *cv_create(const char *name);
@@ -140,4 +151,62 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers can hold the lock at once, or one writer.
+ * Writers are preferred: once a writer is waiting no new readers get
+ * in, so a steady stream of readers can't hold writers off. (This
+ * means a thread that already holds the lock for reading mustn't try
+ * to get it for reading again.)
+ *
+ * A lock made with rwlock_create_percpu counts its readers on the cpu
+ * they get it on, so readers on different cpus don't touch the same
+ * counter; in exchange a writer has to visit every cpu's count. Use
+ * it for data that's read very often and hardly ever written.
+ *
+ * The name field is for easier debugging. A copy of the name is
+ * made internally.
+ */
+
+#define RWLOCK_NSLOTS	32	/* per-cpu reader counts */
+
+struct rwlock_slot {
+        struct spinlock rws_lock;
+        int rws_readers;        /* can go negative; only the sum counts */
+};
+
+struct rwlock {
+        char *rwlock_name;
+        struct spinlock rw_lock;
+        struct wchan *rw_readwchan;     /* readers waiting */
+        struct wchan *rw_writewchan;    /* writers waiting */
+        unsigned rw_readers;            /* readers counted here */
+        unsigned rw_waitwriters;        /* writers waiting */
+        struct thread *rw_writer;       /* writer holding the lock */
+        struct rwlock_slot *rw_slots;   /* per-cpu readers, or NULL */
+        volatile bool rw_blockreaders;  /* per-cpu readers must wait */
+};
+
+struct rwlock *rwlock_create(const char *);
+struct rwlock *rwlock_create_percpu(const char *);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading. Many threads can
+ *                           hold it for reading at once.
+ *    rwlock_release_read  - Free a read hold of the lock.
+ *    rwlock_acquire_write - Get the lock for writing. Only one thread
+ *                           can hold it for writing, and then no
+ *                           thread holds it for reading.
+ *    rwlock_release_write - Free the write hold. Only the thread
+ *                           holding the lock for writing may do this.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
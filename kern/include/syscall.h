@@ -64,12 +64,15 @@ void exec_bootstrap(void);
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t req, userptr_t rem);
 
 int sys_fork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t prog, userptr_t args);
 __DEAD void sys__exit(int code);
 int sys_waitpid(pid_t pid, userptr_t returncode, int flags, pid_t *retval);
 int sys_getpid(pid_t *retval);
+int sys_getpriority(int which, pid_t who, int *retval);
+int sys_setpriority(int which, pid_t who, int prio);
 
 int sys_open(const_userptr_t filename, int flags, mode_t mode, int *retval);
 int sys_dup2(int oldfd, int newfd, int *retval);
@@ -92,4 +95,12 @@ int sys_fstat(int fd, userptr_t statptr);
 int sys_fsync(int fd);
 int sys_ftruncate(int fd, off_t len);
 
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_mprotect(userptr_t addr, size_t len, int prot);
+int sys_futex_wait(userptr_t addr, int val);
+int sys_futex_wake(userptr_t addr, int nwake, int32_t *retval);
+
+int sys_checkpoint(struct trapframe *tf, userptr_t path, int32_t *retval);
+int sys_restore(struct trapframe *tf, userptr_t path, int32_t *retval);
+
 #endif /* _SYSCALL_H_ */
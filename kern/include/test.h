@@ -43,6 +43,18 @@
 /* For testing the wait implementation. */
 int waittest(int, char **);
 
+/* page table backend benchmark */
+int ptbench(int, char **);
+
+/* copyin/copyout benchmark */
+int copybench(int, char **);
+
+/* reader-writer lock benchmark */
+int rwbench(int, char **);
+
+/* spinlock contention benchmark */
+int spinbench(int, char **);
+
 /* data structure tests */
 int arraytest(int, char **);
 int arraytest2(int, char **);
@@ -57,6 +69,8 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int pitest(int, char **);
 
 /* semaphore unit tests */
 int semu1(int, char **);
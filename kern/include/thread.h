@@ -55,6 +55,15 @@ struct cpu;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+/*
+ * Scheduler priority levels; see schedule() in thread.c. Level 0 is
+ * the highest. Nice values (PRIO_MIN..PRIO_MAX) pick a thread's base
+ * level among the first SCHED_NBASE; CPU use moves it down from there.
+ */
+#define SCHED_NLEVELS		8
+#define SCHED_NBASE		4
+#define SCHED_AGE_ROUNDS	8	/* schedule() calls before aging up */
+
 
 /* States a thread can be in. */
 typedef enum {
@@ -64,6 +73,8 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+struct lock;
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -85,6 +96,26 @@ struct thread {
 	struct proc *t_proc;		/* Process thread belongs to */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduling fields. Only changed by the thread itself or with
+	 * the thread off cpu and its run queue locked (or on no queue);
+	 * except t_basepri, which thread_setnice just stores.
+	 */
+	int t_priority;			/* Current level, 0 is highest */
+	int t_basepri;			/* Best level it gets, from nice */
+	unsigned t_slice;		/* Hardclocks left at this level */
+	unsigned t_agerounds;		/* schedule() calls spent waiting */
+	unsigned t_lastran;		/* c_hardclocks when last switched out */
+
+	/*
+	 * Priority inheritance; see synch.c. t_heldlocks belongs to the
+	 * thread itself, the rest is under the lock code's pi_lock.
+	 */
+	int t_inherit;			/* Level lent by lock waiters */
+	struct lock *t_waitlock;	/* Lock we're asleep waiting for */
+	int t_waitlevel;		/* Level we're waiting at */
+	struct lock *t_heldlocks;	/* Locks we hold */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -106,6 +137,9 @@ struct thread {
 	 * Public fields
 	 */
 
+	bool t_copyslow;		/* copyin/out skip the page table
+					   shortcut (copybench) */
+
 	/* add more here as needed */
 };
 
@@ -158,16 +192,38 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for TICKS hardclock periods. Returns true
+ * if it should give up the cpu. Called from the timer interrupt.
+ */
+bool thread_tick(unsigned ticks);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
+ * Set the base priority of a thread from a nice value.
+ */
+void thread_setnice(struct thread *t, int nice);
+
+/*
+ * The level a thread is scheduled at: its own, or a better one lent
+ * to it by threads waiting for locks it holds.
+ */
+int thread_schedlevel(const struct thread *t);
+
+/*
+ * Potentially take ready threads from other CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
 
+/*
+ * Print per-CPU load balancing statistics.
+ */
+void thread_printstats(void);
+
 
 #endif /* _THREAD_H_ */
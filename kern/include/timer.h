@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _TIMER_H_
+#define _TIMER_H_
+
+/*
+ * Kernel timers, with hardclock resolution; see timer.c.
+ *
+ * A timer calls its function once, some number of hardclock periods
+ * after it's armed. The function runs in the timer interrupt on the
+ * cpu that runs the timers, with no locks held; it must not sleep.
+ *
+ * The struct timer belongs to the caller, who must keep it around
+ * until it has fired or been cancelled.
+ */
+
+struct timespec;
+
+struct timer {
+	struct timer *tm_next;		/* Link in the timer wheel */
+	struct timer **tm_prevp;	/* What points at us */
+	uint64_t tm_expires;		/* Hardclock count to fire at */
+	void (*tm_func)(void *);	/* Function to call */
+	void *tm_data;			/* Argument for it */
+	bool tm_pending;		/* Armed and not yet fired */
+};
+
+/* Call once during system startup, on the boot cpu. */
+void timer_bootstrap(void);
+
+/* Set up a timer to call FUNC(DATA). */
+void timer_init(struct timer *t, void (*func)(void *), void *data);
+
+/*
+ * Arm a timer to go off TICKS hardclock periods from now: at the
+ * TICKS'th period boundary, so after between TICKS-1 and TICKS
+ * periods. Rearming a pending timer moves it.
+ */
+void timer_arm(struct timer *t, unsigned ticks);
+
+/*
+ * Disarm a timer. Returns true if it was pending. If it returns
+ * false the function may still be running on another cpu.
+ */
+bool timer_cancel(struct timer *t);
+
+/*
+ * Sleep for at least TICKS whole hardclock periods (the one part way
+ * through when called doesn't count). Returns ENOMEM or 0.
+ */
+int timer_sleep(unsigned ticks);
+
+/* Hardclock periods at least as long as TS. */
+unsigned timer_ticks(const struct timespec *ts);
+
+/*
+ * For clock.c: run the timers that are due (on the timer cpu only),
+ * and clip a tickless stretch on that cpu to the next one due.
+ */
+void timer_hardclock(void);
+unsigned timer_defer(unsigned nticks);
+
+#endif /* _TIMER_H_ */
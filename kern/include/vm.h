@@ -39,12 +39,16 @@
 #include <machine/vm.h>
 #include <types.h>
 #include <pagetable.h>
+#include "opt-dumbvm.h"
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
+/* Pages mapped ahead of a fault in an MADV_SEQUENTIAL region */
+#define FAULTAROUND_SEQUENTIAL 8
+
 // the underlying frame table status, the meta data of physical mem,
 enum E_FRAME_STATUS
 {
@@ -58,7 +62,9 @@ struct frame_entry
 {
     paddr_t p_addr; // physical memory
 
-    void* owner; // same as the owner in the swap_page, if frame_entry belong to KERNEL, owner is set to be  NULL.
+    void* owner; // the addrspace mapping this user frame, NULL for kernel frames and user frames not mapped yet
+    vaddr_t vaddr; // the page of owner that maps this frame, reverse map for eviction
+    int swap_slot; // swap slot holding a copy of this frame, -1 if none; valid while the pte is clean
     int frame_status;
 
     volatile int locked; // when the corepage is allocating, this flag set to be true
@@ -66,7 +72,9 @@ struct frame_entry
     struct frame_entry* next_free;
 
     // K's additions
-    bool pinned;
+    unsigned pinned; // users that need the frame to stay put, see set_frame_pinned; the clock hands pass it over
+
+    int sharers; // ptes mapping a frame merged by ksm.c, 0 if it isn't; merged frames have no owner
 };
 
 
@@ -95,9 +103,46 @@ void free_upages(paddr_t addr);
 bool check_user_frame(paddr_t paddr);
 paddr_t get_free_frame(void);
 
+// Reverse map and victim selection for the reclaim daemon
+void set_frame_owner(paddr_t paddr, void* owner, vaddr_t vaddr);
+void* get_frame_owner(paddr_t paddr, vaddr_t* vaddr);
+void set_frame_sharers(paddr_t paddr, int sharers);
+int get_frame_sharers(paddr_t paddr);
+void set_frame_swap_slot(paddr_t paddr, int slot);
+int get_frame_swap_slot(paddr_t paddr);
+void set_frame_pinned(paddr_t paddr, bool pin);
+paddr_t next_user_frame(int* hand, void** owner, vaddr_t* vaddr);
+int frame_free_count(void);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Invalidate a range of pages of an address space in every TLB */
+void vm_tlbshootdown_range(struct addrspace *as, vaddr_t vaddr, unsigned npages);
+
+/* madvise(MADV_WILLNEED) */
+void vm_prefault_range(struct addrspace *as, vaddr_t vaddr, unsigned npages);
+
+/* Read-ahead from swap, see readahead.c */
+int vm_page_prefetch(struct addrspace *as, vaddr_t vaddr);
+
+/* copyin/copyout straight to resident user pages, see copyinout.c */
+bool vm_user_page_hold(vaddr_t vaddr, bool write, vaddr_t *kvaddr);
+void vm_user_page_release(vaddr_t kvaddr);
+
+/* Copy a page wherever it is, for checkpoints */
+struct as_region_metadata;
+int vm_copy_page(struct addrspace *as, struct as_region_metadata *region, vaddr_t vaddr, paddr_t bounce);
+
+#if !OPT_DUMBVM
+/* Print VM counters (menu command); vm.c isn't built with dumbvm */
+void vm_printstats(void);
+void vm_count_recycled(void);
+#endif
+
+/* Reference bit sampling, called from hardclock */
+void vm_hardclock(unsigned ticks);
+
 void init_frametable(void);
 
 #endif /* _VM_H_ */
@@ -0,0 +1,28 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+#include <vm.h>
+
+struct addrspace;
+
+// swap slots from here up are pages held compressed in memory rather than on disk;
+// the disk slots stay below it, and a pte has room for 20 bits of slot
+#define ZSWAP_SLOT_BASE (1U << 19)
+#define SWAP_SLOT_IS_COMPRESSED(slot) ((slot) >= ZSWAP_SLOT_BASE)
+
+// the pool takes this fraction of the frames free at boot, up to ZSWAP_POOL_MAX pages
+#define ZSWAP_POOL_DIVISOR 8
+#define ZSWAP_POOL_MAX     256
+// pages that don't compress to this much go straight to disk
+#define ZSWAP_MAX_SIZE     (PAGE_SIZE * 3 / 4)
+
+void zswap_bootstrap(unsigned nframes);
+
+// all of these with vm_lock held, see zswap.c
+int zswap_store(paddr_t paddr, struct addrspace* as, vaddr_t vaddr, unsigned* slot);
+int zswap_load(paddr_t paddr, unsigned slot);
+void zswap_free(unsigned slot);
+
+void zswap_printstats(unsigned disk_pageins);
+
+#endif
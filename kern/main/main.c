@@ -50,7 +50,9 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <lockstat.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-lockstat.h"
 
 extern uint32_t dbflags;
 
@@ -125,6 +127,10 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+#if OPT_LOCKSTAT
+	/* Lock timing needs the clock probed above. */
+	lockstat_bootstrap();
+#endif
 	kheap_nextgeneration();
 
 	/* Late phase of initialization. */
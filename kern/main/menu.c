@@ -41,12 +41,19 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <coreswap.h>
+#include <ksm.h>
 #include <sfs.h>
 #include <pid.h>
 #include <syscall.h>
 #include <test.h>
+#include <lockstat.h>
+#include "opt-dumbvm.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -483,6 +490,215 @@ cmd_kheapgeneration(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for per-cpu load balancing statistics.
+ */
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+
+/*
+ * Command to print or reset the lock contention counts.
+ */
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockstat_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+	}
+	else {
+		kprintf("Usage: lockstat [reset]\n");
+	}
+
+	return 0;
+}
+
+#endif /* OPT_LOCKSTAT */
+
+#if !OPT_DUMBVM
+
+static
+int
+cmd_vmstat(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command to show or set the free frame watermarks the page reclaim
+ * daemon works between.
+ */
+static
+int
+cmd_vmwatermarks(int nargs, char **args)
+{
+	int low, high, result;
+
+	if (nargs == 3) {
+		result = reclaim_set_watermarks(atoi(args[1]), atoi(args[2]));
+		if (result) {
+			kprintf("vmwm: %s\n", strerror(result));
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmwm [low high]\n");
+		return EINVAL;
+	}
+
+	reclaim_get_watermarks(&low, &high);
+	kprintf("Reclaim watermarks: low %d, high %d free frames\n",
+		low, high);
+	return 0;
+}
+
+/*
+ * Command to show or set how fast reference bits are sampled:
+ * every INTERVAL hardclocks, BATCH pages. An interval of 0 turns
+ * sampling off.
+ */
+static
+int
+cmd_vmrefsample(int nargs, char **args)
+{
+	unsigned interval, batch;
+	int result;
+
+	if (nargs == 3) {
+		result = refsample_set_rate(atoi(args[1]), atoi(args[2]));
+		if (result) {
+			kprintf("vmref: %s\n", strerror(result));
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmref [interval batch]\n");
+		return EINVAL;
+	}
+
+	refsample_get_rate(&interval, &batch);
+	if (interval == 0) {
+		kprintf("Reference sampling off\n");
+	}
+	else {
+		kprintf("Reference sampling: %u pages every %u ticks (HZ %d)\n",
+			batch, interval, HZ);
+	}
+	return 0;
+}
+
+/*
+ * Command to show or set the resident and virtual size limits, in
+ * pages, that processes started from the menu get (0 for no limit).
+ * Forked and exec'd processes inherit their parent's limits.
+ */
+static
+int
+cmd_vmlimit(int nargs, char **args)
+{
+	unsigned rss, vsize;
+	int result;
+
+	if (nargs == 3) {
+		result = as_set_default_limits(atoi(args[1]), atoi(args[2]));
+		if (result) {
+			kprintf("vmlimit: %s\n", strerror(result));
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmlimit [rss vsize]\n");
+		return EINVAL;
+	}
+
+	as_get_default_limits(&rss, &vsize);
+	kprintf("Process limits: rss %u, vsize %u pages (0 is none)\n",
+		rss, vsize);
+	return 0;
+}
+
+/*
+ * Command to show or choose the page table backend. It can only be
+ * changed before any user program has been run, so put it first in
+ * the boot arguments, e.g. "vmpt 2level; p /testbin/...".
+ */
+static
+int
+cmd_vmpt(int nargs, char **args)
+{
+	const char *name;
+	int i, result;
+
+	if (nargs == 2) {
+		result = pt_select(args[1]);
+		if (result) {
+			kprintf("vmpt: %s: %s\n", args[1], strerror(result));
+			return result;
+		}
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmpt [backend]\n");
+		return EINVAL;
+	}
+
+	kprintf("Page table: %s (available:", pt_name());
+	for (i=0; (name = pt_backend_name(i)) != NULL; i++) {
+		kprintf(" %s", name);
+	}
+	kprintf(")\n");
+	return 0;
+}
+
+/*
+ * Command to show or set how many frames a second the same page
+ * merging scanner looks at. 0, the default, turns it off.
+ */
+static
+int
+cmd_vmksm(int nargs, char **args)
+{
+	unsigned rate;
+
+	if (nargs == 2) {
+		ksm_set_rate(atoi(args[1]));
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: vmksm [pages]\n");
+		return EINVAL;
+	}
+
+	rate = ksm_get_rate();
+	if (rate == 0) {
+		kprintf("Page merging off\n");
+	}
+	else {
+		kprintf("Page merging: %u pages every %d seconds\n",
+			rate, KSM_INTERVAL);
+	}
+	return 0;
+}
+
+#endif /* !OPT_DUMBVM */
+
 static
 int
 cmd_kheapdump(int nargs, char **args)
@@ -576,6 +792,10 @@ static const char *testmenu[] = {
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
 	"[sy4] CV test #2                    ",
+	"[sy5] Rwlock test                   ",
+	"[sy6] Priority inheritance test     ",
+	"[rwb] Rwlock benchmark              ",
+	"[spb] Spinlock benchmark            ",
 	"[semu1-22] Semaphore unit tests     ",
 	"[wt]  waitpid test                  ",
 	"[fs1] Filesystem test               ",
@@ -584,6 +804,10 @@ static const char *testmenu[] = {
 	"[fs4] FS write stress 2             ",
 	"[fs5] FS long stress                ",
 	"[fs6] FS create stress              ",
+#if !OPT_DUMBVM
+	"[ptb] Page table benchmark          ",
+	"[cpb] User copy benchmark           ",
+#endif
 	NULL
 };
 
@@ -606,6 +830,18 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[sched] Scheduler statistics        ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock statistics          ",
+#endif
+#if !OPT_DUMBVM
+	"[vmstat] VM statistics              ",
+	"[vmwm] Reclaim watermarks           ",
+	"[vmref] Reference sampling rate     ",
+	"[vmlimit] Process memory limits     ",
+	"[vmpt] Page table backend           ",
+	"[vmksm] Same page merging           ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -657,6 +893,18 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "sched",      cmd_schedstats },
+#if OPT_LOCKSTAT
+	{ "lockstat",   cmd_lockstat },
+#endif
+#if !OPT_DUMBVM
+	{ "vmstat",     cmd_vmstat },
+	{ "vmwm",       cmd_vmwatermarks },
+	{ "vmref",      cmd_vmrefsample },
+	{ "vmlimit",    cmd_vmlimit },
+	{ "vmpt",       cmd_vmpt },
+	{ "vmksm",      cmd_vmksm },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -679,6 +927,10 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
+	{ "sy6",	pitest },
+	{ "rwb",	rwbench },
+	{ "spb",	spinbench },
 
 	/* semaphore unit tests */
 	{ "semu1",	semu1 },
@@ -715,6 +967,10 @@ static struct {
 	{ "fs4",	writestress2 },
 	{ "fs5",	longstress },
 	{ "fs6",	createstress },
+#if !OPT_DUMBVM
+	{ "ptb",	ptbench },
+	{ "cpb",	copybench },
+#endif
 
 	{ NULL, NULL }
 };
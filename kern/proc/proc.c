@@ -95,6 +95,9 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 	proc->p_filetable = NULL;
 
+	/* scheduling */
+	proc->p_nice = 0;
+
 	return proc;
 }
 
@@ -327,6 +330,7 @@ proc_fork(struct proc **ret)
 		VOP_INCREF(curproc->p_cwd);
 		newproc->p_cwd = curproc->p_cwd;
 	}
+	newproc->p_nice = curproc->p_nice;
 	spinlock_release(&curproc->p_lock);
 
 	*ret = newproc;
@@ -403,6 +407,27 @@ proc_addthread(struct proc *proc, struct thread *t)
 	return 0;
 }
 
+/*
+ * Set the nice value of a process. Its threads pick up the new base
+ * priority right away; new threads inherit it from whoever forks them.
+ */
+void
+proc_setnice(struct proc *proc, int nice)
+{
+	unsigned num, i;
+
+	lock_acquire(proc->p_threadslock);
+	spinlock_acquire(&proc->p_lock);
+	proc->p_nice = nice;
+	spinlock_release(&proc->p_lock);
+
+	num = threadarray_num(&proc->p_threads);
+	for (i=0; i<num; i++) {
+		thread_setnice(threadarray_get(&proc->p_threads, i), nice);
+	}
+	lock_release(proc->p_threadslock);
+}
+
 /*
  * Remove a thread from its process. Either the thread or the process
  * might or might not be current.
@@ -0,0 +1,609 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Process checkpoint and restore.
+ *
+ * checkpoint() writes the calling process out to a file: its regions,
+ * the contents of every page that has any, its registers, and the
+ * name, open flags and offset of each open file. restore() replaces
+ * the calling process with one read back from such a file, like execv
+ * does with a program. The pages aren't read in then; the new regions
+ * are backed by the checkpoint file and each page is read from it when
+ * first touched (see vm_page_in). Files are saved by the absolute name
+ * they were opened by (see openfile_open), so they reopen the same
+ * wherever the restoring process's current directory is.
+ *
+ * The file is a header, then the regions, then the open files, each
+ * followed by its path; page data starts at the next page boundary,
+ * region after region. Pages that were never touched or are all zero
+ * are skipped and left as holes.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <copyinout.h>
+#include <current.h>
+#include <thread.h>
+#include <proc.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <mips/trapframe.h>
+#include <syscall.h>
+
+#define CKPT_MAGIC	0x434b5054	/* "CKPT" */
+#define CKPT_VERSION	2
+#define CKPT_NAMELEN	32
+
+struct ckpt_header {
+	uint32_t ch_magic;
+	uint32_t ch_version;
+	uint32_t ch_nregions;
+	uint32_t ch_nfiles;
+	uint32_t ch_rss_limit;		/* resident/virtual size limits */
+	uint32_t ch_vsize_limit;
+	char ch_name[CKPT_NAMELEN];	/* thread name, i.e. the program */
+	struct trapframe ch_tf;		/* registers at the checkpoint call */
+};
+
+struct ckpt_region {
+	uint32_t cr_vaddr;
+	uint32_t cr_npages;
+	uint32_t cr_rwxflag;
+	uint32_t cr_type;
+	uint32_t cr_advice;
+	uint32_t cr_offset;		/* of its pages in the file */
+};
+
+struct ckpt_file {
+	int32_t cf_fd;
+	int32_t cf_openflags;		/* as opened, less O_CREAT etc. */
+	int32_t cf_dupof;		/* lower fd sharing the openfile, or -1 */
+	uint32_t cf_pathlen;		/* path follows, without the null */
+	off_t cf_offset;
+};
+
+/*
+ * Read or write LEN bytes at *POS in V and advance *POS. Running into
+ * the end of the file on a read means the checkpoint is damaged.
+ */
+static
+int
+ckpt_io(struct vnode *v, void *buf, size_t len, off_t *pos, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, len, *pos, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(v, &ku);
+	}
+	else {
+		result = VOP_WRITE(v, &ku);
+	}
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return rw == UIO_READ ? EINVAL : ENOSPC;
+	}
+	*pos += len;
+	return 0;
+}
+
+/*
+ * Is the page at KVADDR all zeros?
+ */
+static
+bool
+ckpt_zeropage(vaddr_t kvaddr)
+{
+	const uint32_t *words = (const uint32_t *)kvaddr;
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+		if (words[i] != 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Write the open file table out at *POS.
+ */
+static
+int
+ckpt_save_files(struct vnode *v, struct filetable *ft, off_t *pos)
+{
+	struct ckpt_file cf;
+	struct openfile *file;
+	int fd, i, result;
+
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		file = ft->ft_openfiles[fd];
+		if (file == NULL || file->of_path == NULL) {
+			continue;
+		}
+		cf.cf_fd = fd;
+		cf.cf_openflags = file->of_openflags;
+		cf.cf_dupof = -1;
+		for (i = 0; i < fd; i++) {
+			if (ft->ft_openfiles[i] == file) {
+				cf.cf_dupof = i;
+				break;
+			}
+		}
+		cf.cf_pathlen = strlen(file->of_path);
+		cf.cf_offset = file->of_offset;
+
+		result = ckpt_io(v, &cf, sizeof(cf), pos, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		result = ckpt_io(v, file->of_path, cf.cf_pathlen, pos,
+				 UIO_WRITE);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the whole checkpoint of the current process to V.
+ */
+static
+int
+ckpt_save(struct vnode *v, struct trapframe *tf, struct addrspace *as)
+{
+	struct ckpt_header hdr;
+	struct ckpt_region cr;
+	struct as_region_metadata *region;
+	struct filetable *ft = curproc->p_filetable;
+	struct openfile *file;
+	vaddr_t bounce;
+	off_t pos, datapos, pagepos;
+	unsigned i;
+	int fd, result;
+
+	bzero(&hdr, sizeof(hdr));
+	hdr.ch_magic = CKPT_MAGIC;
+	hdr.ch_version = CKPT_VERSION;
+	hdr.ch_rss_limit = as->rss_limit;
+	hdr.ch_vsize_limit = as->vsize_limit;
+	snprintf(hdr.ch_name, CKPT_NAMELEN, "%s", curthread->t_name);
+	hdr.ch_tf = *tf;
+
+	/* size up the metadata to find where the pages go */
+	datapos = sizeof(hdr);
+	list_for_each_entry(region, &as->list->head, link) {
+		hdr.ch_nregions++;
+		datapos += sizeof(cr);
+	}
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		file = ft->ft_openfiles[fd];
+		if (file != NULL && file->of_path != NULL) {
+			hdr.ch_nfiles++;
+			datapos += sizeof(struct ckpt_file)
+				+ strlen(file->of_path);
+		}
+	}
+	datapos = ROUNDUP(datapos, PAGE_SIZE);
+
+	pos = 0;
+	result = ckpt_io(v, &hdr, sizeof(hdr), &pos, UIO_WRITE);
+	if (result) {
+		return result;
+	}
+	cr.cr_offset = datapos;
+	list_for_each_entry(region, &as->list->head, link) {
+		cr.cr_vaddr = region->region_vaddr;
+		cr.cr_npages = region->npages;
+		cr.cr_rwxflag = region->rwxflag;
+		cr.cr_type = region->type;
+		cr.cr_advice = region->advice;
+		result = ckpt_io(v, &cr, sizeof(cr), &pos, UIO_WRITE);
+		if (result) {
+			return result;
+		}
+		cr.cr_offset += region->npages * PAGE_SIZE;
+	}
+	result = ckpt_save_files(v, ft, &pos);
+	if (result) {
+		return result;
+	}
+
+	/* the pages, through a bounce page so swapped ones can come too */
+	bounce = alloc_kpages(1);
+	if (bounce == 0) {
+		return ENOMEM;
+	}
+	pos = datapos;
+	list_for_each_entry(region, &as->list->head, link) {
+		for (i = 0; i < region->npages; i++) {
+			result = vm_copy_page(as, region,
+					      region->region_vaddr + i * PAGE_SIZE,
+					      KVADDR_TO_PADDR(bounce));
+			if (result == ENOENT) {
+				continue;
+			}
+			if (result) {
+				goto out;
+			}
+			if (ckpt_zeropage(bounce)) {
+				continue;
+			}
+			pagepos = pos + i * PAGE_SIZE;
+			result = ckpt_io(v, (void *)bounce, PAGE_SIZE,
+					 &pagepos, UIO_WRITE);
+			if (result) {
+				goto out;
+			}
+		}
+		pos += region->npages * PAGE_SIZE;
+	}
+	result = VOP_FSYNC(v);
+ out:
+	free_kpages(bounce);
+	return result;
+}
+
+/*
+ * checkpoint: save the current process to PATH.
+ *
+ * It is written to PATH.tmp. Once that is complete, the old
+ * checkpoint, if any, is renamed out of the way to PATH.old (rename
+ * won't replace a file), PATH.tmp is renamed to PATH, and PATH.old is
+ * removed. So at every point either PATH or, while the new one is
+ * being put in place, PATH.old holds a whole checkpoint; restore
+ * falls back to PATH.old when PATH isn't there.
+ * Returns 0; a process restored from the checkpoint returns 1.
+ */
+int
+sys_checkpoint(struct trapframe *tf, userptr_t path, int32_t *retval)
+{
+	struct addrspace *as;
+	struct vnode *v;
+	char *kpath, *work, *other;
+	bool hadold;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	kpath = kmalloc(PATH_MAX);
+	if (kpath == NULL) {
+		return ENOMEM;
+	}
+	/* the vfs calls destroy their paths, so each gets a fresh copy */
+	work = kmalloc(PATH_MAX + 4);
+	other = kmalloc(PATH_MAX + 4);
+	if (work == NULL || other == NULL) {
+		kfree(other);
+		kfree(work);
+		kfree(kpath);
+		return ENOMEM;
+	}
+
+	result = copyinstr(path, kpath, PATH_MAX, NULL);
+	if (result) {
+		goto out;
+	}
+
+	snprintf(work, PATH_MAX + 4, "%s.tmp", kpath);
+	result = vfs_open(work, O_WRONLY | O_CREAT | O_TRUNC, 0664, &v);
+	if (result) {
+		goto out;
+	}
+	result = ckpt_save(v, tf, as);
+	vfs_close(v);
+	if (result) {
+		snprintf(work, PATH_MAX + 4, "%s.tmp", kpath);
+		vfs_remove(work);
+		goto out;
+	}
+
+	/* keep the old one until the new one is in its place */
+	strcpy(work, kpath);
+	snprintf(other, PATH_MAX + 4, "%s.old", kpath);
+	result = vfs_rename(work, other);
+	if (result == EEXIST) {
+		/* left by a call that was cut off; PATH is whole, so drop it */
+		snprintf(work, PATH_MAX + 4, "%s.old", kpath);
+		vfs_remove(work);
+		strcpy(work, kpath);
+		snprintf(other, PATH_MAX + 4, "%s.old", kpath);
+		result = vfs_rename(work, other);
+	}
+	if (result && result != ENOENT) {
+		goto out;
+	}
+	hadold = (result == 0);
+
+	snprintf(work, PATH_MAX + 4, "%s.tmp", kpath);
+	strcpy(other, kpath);
+	result = vfs_rename(work, other);
+	if (result) {
+		if (hadold) {
+			snprintf(work, PATH_MAX + 4, "%s.old", kpath);
+			strcpy(other, kpath);
+			vfs_rename(work, other);
+		}
+		goto out;
+	}
+	/* also one left by a cut off call, now there's a new PATH */
+	snprintf(work, PATH_MAX + 4, "%s.old", kpath);
+	vfs_remove(work);
+
+	*retval = 0;
+ out:
+	kfree(other);
+	kfree(work);
+	kfree(kpath);
+	return result;
+}
+
+/*
+ * Build the address space of a checkpoint, backed by V.
+ */
+static
+int
+ckpt_load_as(struct vnode *v, struct ckpt_header *hdr, off_t *pos,
+	     struct addrspace **ret)
+{
+	struct ckpt_region cr;
+	struct addrspace *as;
+	unsigned i;
+	int result;
+
+	as = as_create();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	as->rss_limit = hdr->ch_rss_limit;
+	as->vsize_limit = hdr->ch_vsize_limit;
+
+	for (i = 0; i < hdr->ch_nregions; i++) {
+		result = ckpt_io(v, &cr, sizeof(cr), pos, UIO_READ);
+		if (result) {
+			goto fail;
+		}
+		if ((cr.cr_vaddr & OFFSETMASK) != 0 ||
+		    (cr.cr_offset & OFFSETMASK) != 0 ||
+		    cr.cr_npages == 0 ||
+		    cr.cr_npages > (USERSPACETOP - cr.cr_vaddr) / PAGE_SIZE ||
+		    cr.cr_type > OTHER) {
+			result = EINVAL;
+			goto fail;
+		}
+		result = as_define_backed_region(as, cr.cr_vaddr,
+						 cr.cr_npages, cr.cr_rwxflag,
+						 cr.cr_type, cr.cr_advice,
+						 v, cr.cr_offset);
+		if (result) {
+			goto fail;
+		}
+	}
+	*ret = as;
+	return 0;
+
+ fail:
+	as_destroy(as);
+	return result;
+}
+
+/*
+ * Reopen the files of a checkpoint into a new file table.
+ */
+static
+int
+ckpt_load_files(struct vnode *v, struct ckpt_header *hdr, off_t *pos,
+		struct filetable **ret)
+{
+	struct ckpt_file cf;
+	struct filetable *ft;
+	struct openfile *file, *oldfile;
+	char *kpath;
+	unsigned i;
+	int result;
+
+	if (hdr->ch_nfiles > OPEN_MAX) {
+		return EINVAL;
+	}
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+	kpath = kmalloc(PATH_MAX);
+	if (kpath == NULL) {
+		filetable_destroy(ft);
+		return ENOMEM;
+	}
+
+	for (i = 0; i < hdr->ch_nfiles; i++) {
+		result = ckpt_io(v, &cf, sizeof(cf), pos, UIO_READ);
+		if (result) {
+			goto fail;
+		}
+		if (cf.cf_fd < 0 || cf.cf_fd >= OPEN_MAX ||
+		    ft->ft_openfiles[cf.cf_fd] != NULL ||
+		    cf.cf_pathlen >= PATH_MAX) {
+			result = EINVAL;
+			goto fail;
+		}
+		result = ckpt_io(v, kpath, cf.cf_pathlen, pos, UIO_READ);
+		if (result) {
+			goto fail;
+		}
+		kpath[cf.cf_pathlen] = '\0';
+
+		if (cf.cf_dupof >= 0) {
+			/* was dup2'd, share the one already opened */
+			if (cf.cf_dupof >= cf.cf_fd ||
+			    ft->ft_openfiles[cf.cf_dupof] == NULL) {
+				result = EINVAL;
+				goto fail;
+			}
+			file = ft->ft_openfiles[cf.cf_dupof];
+			openfile_incref(file);
+		}
+		else {
+			/* not O_TRUNC again, that would lose the contents */
+			result = openfile_open(kpath, cf.cf_openflags &
+					       ~(O_CREAT | O_EXCL | O_TRUNC),
+					       0, &file);
+			if (result) {
+				goto fail;
+			}
+			file->of_offset = cf.cf_offset;
+		}
+		filetable_placeat(ft, file, cf.cf_fd, &oldfile);
+		KASSERT(oldfile == NULL);
+	}
+	kfree(kpath);
+	*ret = ft;
+	return 0;
+
+ fail:
+	kfree(kpath);
+	filetable_destroy(ft);
+	return result;
+}
+
+/*
+ * restore: replace the current process with the one checkpointed in
+ * PATH. Like execv, it doesn't return on success; the restored process
+ * carries on from its checkpoint call, which returns 1.
+ */
+int
+sys_restore(struct trapframe *tf, userptr_t path, int32_t *retval)
+{
+	struct ckpt_header hdr;
+	struct addrspace *newas, *oldas;
+	struct filetable *newft, *oldft;
+	struct vnode *v;
+	char *kpath, *work, *newname;
+	off_t pos;
+	int result;
+
+	kpath = kmalloc(PATH_MAX);
+	if (kpath == NULL) {
+		return ENOMEM;
+	}
+	work = kmalloc(PATH_MAX + 4);
+	if (work == NULL) {
+		kfree(kpath);
+		return ENOMEM;
+	}
+	result = copyinstr(path, kpath, PATH_MAX, NULL);
+	if (result) {
+		kfree(work);
+		kfree(kpath);
+		return result;
+	}
+	strcpy(work, kpath);
+	result = vfs_open(work, O_RDONLY, 0, &v);
+	if (result == ENOENT) {
+		/* a checkpoint call got cut off while replacing it */
+		snprintf(work, PATH_MAX + 4, "%s.old", kpath);
+		result = vfs_open(work, O_RDONLY, 0, &v);
+	}
+	kfree(work);
+	kfree(kpath);
+	if (result) {
+		return result;
+	}
+
+	pos = 0;
+	result = ckpt_io(v, &hdr, sizeof(hdr), &pos, UIO_READ);
+	if (result) {
+		goto fail_close;
+	}
+	if (hdr.ch_magic != CKPT_MAGIC || hdr.ch_version != CKPT_VERSION ||
+	    hdr.ch_tf.tf_epc >= USERSPACETOP) {
+		result = EINVAL;
+		goto fail_close;
+	}
+	hdr.ch_name[CKPT_NAMELEN - 1] = '\0';
+	newname = kstrdup(hdr.ch_name);
+	if (newname == NULL) {
+		result = ENOMEM;
+		goto fail_close;
+	}
+
+	result = ckpt_load_as(v, &hdr, &pos, &newas);
+	if (result) {
+		goto fail_name;
+	}
+	result = ckpt_load_files(v, &hdr, &pos, &newft);
+	if (result) {
+		as_destroy(newas);
+		goto fail_name;
+	}
+
+	/* Nothing can fail from here on; switch over. */
+	oldas = proc_setas(newas);
+	as_activate();
+	if (oldas) {
+		as_destroy(oldas);
+	}
+	oldft = curproc->p_filetable;
+	curproc->p_filetable = newft;
+	if (oldft) {
+		filetable_destroy(oldft);
+	}
+	kfree(curthread->t_name);
+	curthread->t_name = newname;
+
+	/* the regions hold their own references to the file */
+	vfs_close(v);
+
+	/* keep our own status register, the saved one can't be trusted */
+	hdr.ch_tf.tf_status = tf->tf_status;
+	*tf = hdr.ch_tf;
+	*retval = 1;
+	return 0;
+
+ fail_name:
+	kfree(newname);
+ fail_close:
+	vfs_close(v);
+	return result;
+}
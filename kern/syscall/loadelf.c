@@ -59,6 +59,7 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include <kern/stat.h>
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -155,6 +156,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 {
 	Elf_Ehdr eh;   /* Executable header */
 	Elf_Phdr ph;   /* "Program header" = segment header */
+	struct stat st;
+	size_t filesz;
 	int result, i;
 	struct iovec iov;
 	struct uio ku;
@@ -202,6 +205,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
+
 	/*
 	 * Go through the list of segments and set up the address space.
 	 *
@@ -215,6 +223,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	 * because that's the structure we know, but the file on disk
 	 * might have a larger structure, so we must use e_phentsize
 	 * to find where the phdr starts.
+	 *
+	 * Every segment is checked against the file size here, before
+	 * as_prepare_load: exec starts taking frames from the old image
+	 * then (see as_recycle_begin), and after that a bad executable
+	 * can no longer fail back to it.
 	 */
 
 	for (i=0; i<eh.e_phnum; i++) {
@@ -243,6 +256,15 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+		/* load_segment reads no more than memsz */
+		filesz = ph.p_filesz < ph.p_memsz ? ph.p_filesz : ph.p_memsz;
+		if (ph.p_offset > st.st_size ||
+		    filesz > st.st_size - ph.p_offset) {
+			kprintf("ELF: segment past end of file - "
+				"file truncated?\n");
+			return ENOEXEC;
+		}
+
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz, ph.p_filesz,
 					  ph.p_flags & PF_R,
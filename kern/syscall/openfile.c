@@ -34,7 +34,9 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <limits.h>
 #include <lib.h>
+#include <uio.h>
 #include <synch.h>
 #include <vfs.h>
 #include <openfile.h>
@@ -44,9 +46,12 @@
  */
 static
 struct openfile *
-openfile_create(struct vnode *vn, int accmode)
+openfile_create(struct vnode *vn, int openflags)
 {
 	struct openfile *file;
+	int accmode;
+
+	accmode = openflags & O_ACCMODE;
 
 	/* this should already have been checked (e.g. by vfs_open) */
 	KASSERT(accmode == O_RDONLY ||
@@ -68,6 +73,8 @@ openfile_create(struct vnode *vn, int accmode)
 
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
+	file->of_openflags = openflags;
+	file->of_path = NULL;
 	file->of_offset = 0;
 	file->of_refcount = 1;
 
@@ -87,9 +94,63 @@ openfile_destroy(struct openfile *file)
 
 	spinlock_cleanup(&file->of_reflock);
 	lock_destroy(file->of_offsetlock);
+	kfree(file->of_path);
 	kfree(file);
 }
 
+/*
+ * Make FILENAME into a name that means the same from any current
+ * directory: the device (or volume) name, a colon, and the path.
+ */
+static
+int
+openfile_abspath(const char *filename, char **ret)
+{
+	struct iovec iov;
+	struct uio ku;
+	char *buf;
+	size_t len;
+	int result;
+
+	if (strchr(filename, ':') != NULL) {
+		/* already says which device */
+		*ret = kstrdup(filename);
+		return *ret == NULL ? ENOMEM : 0;
+	}
+
+	buf = kmalloc(PATH_MAX);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	uio_kinit(&iov, &ku, buf, PATH_MAX - 1, 0, UIO_READ);
+	result = vfs_getcwd(&ku);
+	if (result) {
+		/* no current directory, so nothing to be relative to */
+		kfree(buf);
+		*ret = kstrdup(filename);
+		return *ret == NULL ? ENOMEM : 0;
+	}
+	len = PATH_MAX - 1 - ku.uio_resid;
+	buf[len] = '\0';
+
+	if (filename[0] == '/') {
+		/* from the root of the current directory's device */
+		len = strchr(buf, ':') + 1 - buf;
+	}
+	else if (buf[len - 1] != ':' && buf[len - 1] != '/') {
+		buf[len++] = '/';
+	}
+	if (len + strlen(filename) >= PATH_MAX) {
+		kfree(buf);
+		return ENAMETOOLONG;
+	}
+	strcpy(buf + len, filename);
+
+	*ret = kstrdup(buf);
+	kfree(buf);
+	return *ret == NULL ? ENOMEM : 0;
+}
+
 /*
  * Open a file (with vfs_open) and wrap it in an openfile object.
  */
@@ -99,18 +160,28 @@ openfile_open(char *filename, int openflags, mode_t mode,
 {
 	struct vnode *vn;
 	struct openfile *file;
+	char *path;
 	int result;
 
+	/* keep the name, vfs_open destroys it */
+	result = openfile_abspath(filename, &path);
+	if (result) {
+		return result;
+	}
+
 	result = vfs_open(filename, openflags, mode, &vn);
 	if (result) {
+		kfree(path);
 		return result;
 	}
 
-	file = openfile_create(vn, openflags & O_ACCMODE);
+	file = openfile_create(vn, openflags);
 	if (file == NULL) {
 		vfs_close(vn);
+		kfree(path);
 		return ENOMEM;
 	}
+	file->of_path = path;
 
 	*ret = file;
 	return 0;
@@ -33,6 +33,8 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <lib.h>
 #include <machine/trapframe.h>
@@ -58,6 +60,55 @@ sys_getpid(pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys_getpriority
+ *
+ * Only the calling process can be named, either as 0 or by its pid;
+ * there's no table to find other processes in. Note that the result
+ * can be -1 without it being an error, as in Unix.
+ */
+int
+sys_getpriority(int which, pid_t who, int *retval)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who != 0 && who != curproc->p_pid) {
+		return ESRCH;
+	}
+
+	spinlock_acquire(&curproc->p_lock);
+	*retval = curproc->p_nice;
+	spinlock_release(&curproc->p_lock);
+	return 0;
+}
+
+/*
+ * sys_setpriority
+ *
+ * Set the nice value; higher is nicer, i.e. lower priority. Out of
+ * range values are clipped to PRIO_MIN..PRIO_MAX, as in BSD.
+ */
+int
+sys_setpriority(int which, pid_t who, int prio)
+{
+	if (which != PRIO_PROCESS) {
+		return EINVAL;
+	}
+	if (who != 0 && who != curproc->p_pid) {
+		return ESRCH;
+	}
+
+	if (prio < PRIO_MIN) {
+		prio = PRIO_MIN;
+	}
+	if (prio > PRIO_MAX) {
+		prio = PRIO_MAX;
+	}
+	proc_setnice(curproc, prio);
+	return 0;
+}
+
 /*
  * sys__exit()
  *
@@ -36,6 +36,8 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <kern/unistd.h>
+#include <kern/signal.h>
+#include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
 #include <proc.h>
@@ -55,9 +57,17 @@
  *
  * This is an abstraction that holds an argv while it's being shuffled
  * through the kernel during exec.
+ *
+ * The strings are gathered straight into whole pages, laid out the way
+ * they will sit at the top of the new user stack, and those pages are
+ * then mapped into the new address space as they are (see
+ * argbuf_place) rather than copied out again. Pages are only taken as
+ * the strings need them, so a big ARG_MAX costs nothing unless it is
+ * used.
  */
 struct argbuf {
-	char *data;
+	paddr_t pages[ARG_MAX / PAGE_SIZE];	/* 0 once mapped */
+	unsigned npages;
 	size_t len;
 	size_t max;
 	int nargs;
@@ -85,15 +95,16 @@ exec_bootstrap(void)
 }
 
 /*
- * Initialize an argv buffer.
+ * Initialize an argv buffer. Without the throttle it may only grow to
+ * one page.
  */
 static
 void
 argbuf_init(struct argbuf *buf)
 {
-	buf->data = NULL;
+	buf->npages = 0;
 	buf->len = 0;
-	buf->max = 0;
+	buf->max = PAGE_SIZE;
 	buf->nargs = 0;
 	buf->tooksem = false;
 }
@@ -105,12 +116,20 @@ static
 void
 argbuf_cleanup(struct argbuf *buf)
 {
-	if (buf->data != NULL) {
-		kfree(buf->data);
-		buf->data = NULL;
+	unsigned i;
+
+	for (i = 0; i < buf->npages; i++) {
+		if (buf->pages[i] == 0) {
+			continue;
+		}
+#if OPT_DUMBVM
+		free_kpages(PADDR_TO_KVADDR(buf->pages[i]));
+#else
+		free_upages(buf->pages[i]);
+#endif
 	}
+	buf->npages = 0;
 	buf->len = 0;
-	buf->max = 0;
 	buf->nargs = 0;
 	if (buf->tooksem) {
 		V(execthrottle);
@@ -119,17 +138,62 @@ argbuf_cleanup(struct argbuf *buf)
 }
 
 /*
- * Allocate the memory for an argv buffer.
+ * Add a (zeroed) page to an argv buffer. Going past the first page
+ * waits on the throttle.
  */
 static
 int
-argbuf_allocate(struct argbuf *buf, size_t size)
+argbuf_addpage(struct argbuf *buf)
 {
-	buf->data = kmalloc(size);
-	if (buf->data == NULL) {
+	paddr_t page;
+
+	if ((buf->npages + 1) * PAGE_SIZE > buf->max) {
+		if (buf->tooksem) {
+			return E2BIG;
+		}
+		/* Wait on the semaphore, to throttle this allocation */
+		P(execthrottle);
+		buf->tooksem = true;
+		buf->max = ARG_MAX;
+	}
+
+#if OPT_DUMBVM
+	{
+		vaddr_t kva;
+
+		kva = alloc_kpages(1);
+		page = kva == 0 ? 0 : KVADDR_TO_PADDR(kva);
+	}
+#else
+	page = get_free_frame();
+#endif
+	if (page == 0) {
 		return ENOMEM;
 	}
-	buf->max = size;
+	buf->pages[buf->npages++] = page;
+	return 0;
+}
+
+/*
+ * Where the next byte of an argv buffer goes, and how much room is
+ * left in its page. Adds a page if the last one is full.
+ */
+static
+int
+argbuf_tail(struct argbuf *buf, char **ptr, size_t *room)
+{
+	size_t off;
+	int result;
+
+	if (buf->len == buf->npages * PAGE_SIZE) {
+		result = argbuf_addpage(buf);
+		if (result) {
+			return result;
+		}
+	}
+	off = buf->len % PAGE_SIZE;
+	*ptr = (char *)PADDR_TO_KVADDR(buf->pages[buf->len / PAGE_SIZE]) + off;
+	*room = PAGE_SIZE - off;
 	return 0;
 }
 
@@ -143,31 +207,39 @@ static
 int
 argbuf_fromkernel(struct argbuf *buf, const char *progname)
 {
-	size_t len;
+	size_t len, room;
+	char *ptr;
 	int result;
 
 	len = strlen(progname) + 1;
-
-	result = argbuf_allocate(buf, len);
-	if (result) {
-		return result;
+	while (len > 0) {
+		result = argbuf_tail(buf, &ptr, &room);
+		if (result) {
+			return result;
+		}
+		if (room > len) {
+			room = len;
+		}
+		memcpy(ptr, progname, room);
+		progname += room;
+		buf->len += room;
+		len -= room;
 	}
-	strcpy(buf->data, progname);
-	buf->len = len;
 	buf->nargs = 1;
 
 	return 0;
 }
 
 /*
- * Copy an argv array into kernel space, using an argvdata buffer.
+ * Get an argv from user space.
  */
 static
 int
-argbuf_copyin(struct argbuf *buf, userptr_t uargv)
+argbuf_fromuser(struct argbuf *buf, userptr_t uargv)
 {
 	userptr_t thisarg;
-	size_t thisarglen;
+	size_t thisarglen, room;
+	char *ptr;
 	int result;
 
 	/* loop through the argv, grabbing each arg string */
@@ -187,81 +259,66 @@ argbuf_copyin(struct argbuf *buf, userptr_t uargv)
 			break;
 		}
 
-		/* Use the pointer to fetch the argument string. */
-		result = copyinstr(thisarg, buf->data + buf->len,
-				   buf->max - buf->len, &thisarglen);
-		if (result == ENAMETOOLONG) {
-			return E2BIG;
-		}
-		else if (result) {
-			return result;
+		/*
+		 * Use the pointer to fetch the argument string, a page
+		 * at a time; a string can run on from one page into the
+		 * next, as it will on the user stack.
+		 */
+		while (1) {
+			result = argbuf_tail(buf, &ptr, &room);
+			if (result) {
+				return result;
+			}
+			result = copyinstr(thisarg, ptr, room, &thisarglen);
+			if (result == ENAMETOOLONG) {
+				/* filled the page, carry on in the next */
+				buf->len += room;
+				thisarg += room;
+				continue;
+			}
+			else if (result) {
+				return result;
+			}
+			/* Move ahead. Note: thisarglen includes the \0. */
+			buf->len += thisarglen;
+			break;
 		}
 
-		/* Move ahead. Note: thisarglen includes the \0. */
-		buf->len += thisarglen;
 		uargv += sizeof(userptr_t);
 		buf->nargs++;
-	}
 
-	return 0;
-}
-
-/*
- * Get an argv from user space.
- */
-static
-int
-argbuf_fromuser(struct argbuf *buf, userptr_t uargv)
-{
-	int result;
-
-	/* try with a small buffer */
-	result = argbuf_allocate(buf, PAGE_SIZE);
-	if (result) {
-		return result;
-	}
-
-	/* do the copyin */
-	result = argbuf_copyin(buf, uargv);
-	if (result == E2BIG) {
 		/*
-		 * Try again with the full-size buffer. Just start
-		 * over instead of trying to keep the page we already
-		 * did; this is a bit inefficient but it's not that
-		 * important.
+		 * ARG_MAX covers the strings so far and the argv
+		 * pointers too, with the NULL at the end.
 		 */
-		argbuf_cleanup(buf);
-		argbuf_init(buf);
-
-		/* Wait on the semaphore, to throttle this allocation */
-		P(execthrottle);
-		buf->tooksem = true;
-
-		result = argbuf_allocate(buf, ARG_MAX);
-		if (result) {
-			return result;
+		if (buf->len + (buf->nargs + 1) * sizeof(userptr_t) > ARG_MAX) {
+			return E2BIG;
 		}
-
-		result = argbuf_copyin(buf, uargv);
 	}
-	return result;
+
+	return 0;
 }
 
 /*
- * Copy an argv out of kernel space to user space.
+ * Put an argv buffer on the new user stack: the argv pointers are
+ * copied out below the top, then the pages holding the strings are
+ * mapped in above them.
  *
  * Note: ustackp is an in/out argument.
  */
+#define ARGBUF_PTRBATCH 32
+
 static
 int
-argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
-	       int *argc_ret, userptr_t *uargv_ret)
+argbuf_place(struct argbuf *buf, vaddr_t *ustackp,
+	     int *argc_ret, userptr_t *uargv_ret)
 {
 	vaddr_t ustack;
 	userptr_t ustringbase, uargvbase, uargv_i;
-	userptr_t thisarg;
-	size_t thisarglen;
+	userptr_t ptrs[ARGBUF_PTRBATCH];
+	unsigned nptrs;
 	size_t pos;
+	char *page;
 	int result;
 
 	/* Begin the stack at the passed in top. */
@@ -270,51 +327,74 @@ argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
 	/*
 	 * Allocate space.
 	 *
-	 * buf->pos is the amount of space used by the strings; put that
-	 * first, then align the stack, then make space for the argv
-	 * pointers. Allow an extra slot for the ending NULL.
+	 * The strings take their pages whole at the top, then come the
+	 * argv pointers. Allow an extra slot for the ending NULL.
 	 */
 
-	ustack -= buf->len;
-	ustack -= (ustack & (sizeof(void *) - 1));
+	ustack -= buf->npages * PAGE_SIZE;
 	ustringbase = (userptr_t)ustack;
 
 	ustack -= (buf->nargs + 1) * sizeof(userptr_t);
 	uargvbase = (userptr_t)ustack;
 
-	/* Now copy the data out. */
+	/*
+	 * Copy the argv pointers out, in batches. The user address of
+	 * each string is ustringbase + its position in the buffer.
+	 */
 	pos = 0;
+	nptrs = 0;
 	uargv_i = uargvbase;
-	while (pos < buf->len) {
-		/* The user address of the string will be ustringbase + pos. */
-		thisarg = ustringbase + pos;
-
-		/* Place it in the argv array. */
-		result = copyout(&thisarg, uargv_i, sizeof(thisarg));
-		if (result) {
-			return result;
+	while (1) {
+		if (pos < buf->len) {
+			ptrs[nptrs++] = ustringbase + pos;
+			/* skip to the start of the next string */
+			do {
+				page = (char *)PADDR_TO_KVADDR(
+					buf->pages[pos / PAGE_SIZE]);
+			} while (page[pos++ % PAGE_SIZE] != '\0');
 		}
-
-		/* Push out the string. */
-		result = copyoutstr(buf->data + pos, thisarg,
-				    buf->len - pos, &thisarglen);
-		if (result) {
-			return result;
+		else {
+			/* Add the NULL. */
+			ptrs[nptrs++] = NULL;
+		}
+		if (nptrs == ARGBUF_PTRBATCH || pos >= buf->len) {
+			result = copyout(ptrs, uargv_i,
+					 nptrs * sizeof(userptr_t));
+			if (result) {
+				return result;
+			}
+			uargv_i += nptrs * sizeof(userptr_t);
+			if (ptrs[nptrs - 1] == NULL) {
+				break;
+			}
+			nptrs = 0;
 		}
-
-		/* thisarglen includes the \0 */
-		pos += thisarglen;
-		uargv_i += sizeof(thisarg);
 	}
 	/* Should have come out even... */
 	KASSERT(pos == buf->len);
-
-	/* Add the NULL. */
-	thisarg = NULL;
-	result = copyout(&thisarg, uargv_i, sizeof(userptr_t));
+	KASSERT(uargv_i == uargvbase + (buf->nargs + 1) * sizeof(userptr_t));
+
+	/* Now hand the strings over. */
+#if OPT_DUMBVM
+	{
+		unsigned i;
+
+		for (i = 0; i < buf->npages; i++) {
+			result = copyout((void *)PADDR_TO_KVADDR(buf->pages[i]),
+					 ustringbase + i * PAGE_SIZE,
+					 PAGE_SIZE);
+			if (result) {
+				return result;
+			}
+		}
+	}
+#else
+	result = as_map_frames(proc_getas(), (vaddr_t)ustringbase,
+			       buf->pages, buf->npages);
 	if (result) {
 		return result;
 	}
+#endif
 
 	*ustackp = ustack;
 	*argc_ret = buf->nargs;
@@ -322,8 +402,39 @@ argbuf_copyout(struct argbuf *buf, vaddr_t *ustackp,
 	return 0;
 }
 
+/*
+ * Back out of a failed loadexec: put the old address space back and
+ * throw away the new one. If loading has already taken frames from
+ * the old one (see as_recycle_begin) there's nothing to go back to, so
+ * both go and the process is left without an address space.
+ */
+static
+void
+loadexec_undo(struct addrspace *newvm, struct addrspace *oldvm)
+{
+	bool lost = false;
+
+#if !OPT_DUMBVM
+	lost = as_recycle_end(newvm);
+#endif
+	if (lost) {
+		proc_setas(NULL);
+		as_activate();
+		as_destroy(oldvm);
+	}
+	else {
+		proc_setas(oldvm);
+		as_activate();
+	}
+	as_destroy(newvm);
+}
+
 /*
  * Common code for execv and runprogram: loading the executable.
+ *
+ * The new image is built out of the old one's frames as it goes, so
+ * a failure part way through may leave the process with no address
+ * space at all; the caller has to check for that.
  */
 static
 int
@@ -358,6 +469,9 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 	/* replace address spaces, and activate the new one */
 	oldvm = proc_setas(newvm);
 	as_activate();
+#if !OPT_DUMBVM
+	as_recycle_begin(newvm, oldvm);
+#endif
 
  	/*
 	 * Load the executable. If it fails, restore the old address
@@ -366,9 +480,7 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 	result = load_elf(v, entrypoint);
 	if (result) {
 		vfs_close(v);
-		proc_setas(oldvm);
-		as_activate();
-		as_destroy(newvm);
+		loadexec_undo(newvm, oldvm);
 		kfree(newname);
 		return result;
 	}
@@ -378,12 +490,13 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 	/* Define the user stack in the address space */
 	result = as_define_stack(newvm, stackptr);
 	if (result) {
-		proc_setas(oldvm);
-		as_activate();
-		as_destroy(newvm);
+		loadexec_undo(newvm, oldvm);
 		kfree(newname);
 		return result;
         }
+#if !OPT_DUMBVM
+	as_recycle_end(newvm);
+#endif
 
 	/*
 	 * Wipe out old address space.
@@ -525,10 +638,10 @@ runprogram(char *progname)
 		return result;
 	}
 
-	result = argbuf_copyout(&kargv, &stackptr, &argc, &uargv);
+	result = argbuf_place(&kargv, &stackptr, &argc, &uargv);
 	if (result) {
 		/* If copyout fails, *we* messed up, so panic */
-		panic("execv: copyout_args failed: %s\n", strerror(result));
+		panic("execv: argbuf_place failed: %s\n", strerror(result));
 	}
 
 	/* free the space */
@@ -546,9 +659,9 @@ runprogram(char *progname)
  * execv.
  *
  * 1. Copy in the program name.
- * 2. Copy in the argv with copyin_args.
+ * 2. Copy in the argv with argbuf_fromuser.
  * 3. Load the executable.
- * 4. Copy the argv out again with copyout_args.
+ * 4. Put the argv on the new stack with argbuf_place.
  * 5. Warp to usermode.
  */
 int
@@ -588,6 +701,11 @@ sys_execv(userptr_t prog, userptr_t uargv)
 	if (result) {
 		argbuf_cleanup(&kargv);
 		kfree(path);
+		if (proc_getas() == NULL) {
+			/* the old image went into the new one; nothing to return to */
+			proc_exit(_MKWAIT_SIG(SIGSEGV));
+			thread_exit();
+		}
 		return result;
 	}
 
@@ -595,10 +713,10 @@ sys_execv(userptr_t prog, userptr_t uargv)
 	kfree(path);
 
 	/* Send the argv strings to the process. */
-	result = argbuf_copyout(&kargv, &stackptr, &argc, &uargv);
+	result = argbuf_place(&kargv, &stackptr, &argc, &uargv);
 	if (result) {
 		/* if copyout fails, *we* messed up, so panic */
-		panic("execv: copyout_args failed: %s\n", strerror(result));
+		panic("execv: argbuf_place failed: %s\n", strerror(result));
 	}
 
 	/* free the argv buffer space */
@@ -28,7 +28,11 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <kern/time.h>
+#include <thread.h>
 #include <clock.h>
+#include <timer.h>
 #include <copyinout.h>
 #include <syscall.h>
 
@@ -56,3 +60,44 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * nanosleep: sleep on a timer for at least the requested time. The
+ * sleep can't be interrupted, so any remaining time is always zero.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec ts;
+	unsigned ticks;
+	int result;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	ticks = timer_ticks(&ts);
+	if (ticks == 0) {
+		thread_yield();
+	}
+	else {
+		result = timer_sleep(ticks);
+		if (result) {
+			return result;
+		}
+	}
+
+	if (user_rem != NULL) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 0;
+		result = copyout(&ts, user_rem, sizeof(ts));
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
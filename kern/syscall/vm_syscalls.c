@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Memory management system calls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <proc.h>
+#include <addrspace.h>
+#include <futex.h>
+#include <syscall.h>
+
+/*
+ * madvise: tell the VM how a range of the address space is going to
+ * be used. ADDR must be page aligned; LEN is rounded up to whole
+ * pages.
+ */
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_advise(as, (vaddr_t)addr, len, advice);
+}
+
+/*
+ * mprotect: change the protection of a range of the address space to
+ * PROT (PROT_* flags). ADDR must be page aligned; LEN is rounded up
+ * to whole pages.
+ */
+int
+sys_mprotect(userptr_t addr, size_t len, int prot)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	return as_protect(as, (vaddr_t)addr, len, prot);
+}
+
+/*
+ * futex_wait: sleep until woken by futex_wake on ADDR, unless the int
+ * there no longer holds VAL, in which case fail with EAGAIN.
+ */
+int
+sys_futex_wait(userptr_t addr, int val)
+{
+	return futex_wait(addr, val);
+}
+
+/*
+ * futex_wake: wake up to NWAKE threads waiting on ADDR; returns how
+ * many.
+ */
+int
+sys_futex_wake(userptr_t addr, int nwake, int32_t *retval)
+{
+	int woken, result;
+
+	result = futex_wake(addr, nwake, &woken);
+	if (result) {
+		return result;
+	}
+	*retval = woken;
+	return 0;
+}
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * User copy benchmark: copyin (read) and copyout (write) throughput
+ * between a kernel page and a made up user address space, in pieces
+ * of a few sizes walking through the whole space. Each is run with
+ * the page table shortcut in copyinout.c and without it, going
+ * through the user addresses and the TLB.
+ *
+ * The address space is bigger than the TLB covers, so without the
+ * shortcut every page costs a TLB miss.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/wait.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <proc.h>
+#include <pid.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <copyinout.h>
+#include <elf.h>
+#include <test.h>
+
+#define CPB_NPAGES	128
+#define CPB_PASSES	4
+#define CPB_BASE	0x10000000
+#define CPB_NSIZES	3
+
+static const size_t cpb_sizes[CPB_NSIZES] = { 64, 1024, PAGE_SIZE };
+
+struct cpb_result {
+	unsigned npages;
+	int result;
+	/* KB/s, [direct][size] */
+	uint64_t in_kbs[2][CPB_NSIZES];
+	uint64_t out_kbs[2][CPB_NSIZES];
+};
+
+/*
+ * Copy the whole address space in pieces of SIZE, CPB_PASSES times,
+ * and return the throughput in KB/s.
+ */
+static
+int
+cpb_pass(struct cpb_result *res, void *kbuf, size_t size, bool out,
+	 uint64_t *kbs)
+{
+	struct timespec start, now, diff;
+	size_t len = res->npages * PAGE_SIZE;
+	size_t off;
+	uint64_t ns;
+	unsigned pass;
+	int result;
+
+	gettime(&start);
+	for (pass=0; pass<CPB_PASSES; pass++) {
+		for (off=0; off + size <= len; off += size) {
+			userptr_t uaddr = (userptr_t)(CPB_BASE + off);
+
+			if (out) {
+				result = copyout(kbuf, uaddr, size);
+			}
+			else {
+				result = copyin(uaddr, kbuf, size);
+			}
+			if (result) {
+				return result;
+			}
+		}
+	}
+	gettime(&now);
+	timespec_sub(&now, &start, &diff);
+	ns = (uint64_t)diff.tv_sec * 1000000000ULL + diff.tv_nsec;
+	*kbs = (uint64_t)len * CPB_PASSES * 1000000ULL / (ns ? ns : 1);
+	return 0;
+}
+
+/*
+ * Runs in a process of its own, so there's an address space to copy
+ * to and from.
+ */
+static
+void
+cpb_thread(void *data, unsigned long junk)
+{
+	struct cpb_result *res = data;
+	struct addrspace *as;
+	vaddr_t kbuf;
+	unsigned d, i;
+	bool old;
+	int result;
+
+	(void)junk;
+
+	as = as_create();
+	if (as == NULL) {
+		res->result = ENOMEM;
+		proc_exit(_MKWAIT_EXIT(1));
+	}
+	proc_setas(as);
+	as_activate();
+	result = as_define_region(as, CPB_BASE, res->npages * PAGE_SIZE, 0,
+				  PF_R, PF_W, 0);
+	kbuf = alloc_kpages(1);
+	if (result == 0 && kbuf == 0) {
+		result = ENOMEM;
+	}
+	if (result == 0) {
+		/* touch every page first, so only the copying is timed */
+		result = cpb_pass(res, (void *)kbuf, PAGE_SIZE, true,
+				  &res->out_kbs[0][0]);
+	}
+
+	old = copy_set_direct(true);
+	for (d=0; d<2 && result == 0; d++) {
+		copy_set_direct(d == 0);
+		for (i=0; i<CPB_NSIZES && result == 0; i++) {
+			result = cpb_pass(res, (void *)kbuf, cpb_sizes[i],
+					  false, &res->in_kbs[d][i]);
+			if (result == 0) {
+				result = cpb_pass(res, (void *)kbuf,
+						  cpb_sizes[i], true,
+						  &res->out_kbs[d][i]);
+			}
+		}
+	}
+	copy_set_direct(old);
+
+	if (kbuf != 0) {
+		free_kpages(kbuf);
+	}
+	res->result = result;
+	/* the address space goes with the process */
+	proc_exit(_MKWAIT_EXIT(result ? 1 : 0));
+}
+
+int
+copybench(int nargs, char **args)
+{
+	struct cpb_result res;
+	struct proc *proc;
+	pid_t pid;
+	unsigned d, i;
+	int status, result;
+
+	bzero(&res, sizeof(res));
+	res.npages = CPB_NPAGES;
+	if (nargs == 2) {
+		res.npages = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: cpb [pages]\n");
+		return EINVAL;
+	}
+	if (res.npages < 1) {
+		kprintf("cpb: need at least 1 page\n");
+		return EINVAL;
+	}
+
+	result = proc_create_runprogram("copybench", &proc);
+	if (result) {
+		return result;
+	}
+	pid = proc->p_pid;
+	result = thread_fork("copybench", proc, cpb_thread, &res, 0);
+	if (result) {
+		proc_destroy(proc);
+		return result;
+	}
+	pid_wait(pid, &status, 0, NULL);
+	if (res.result) {
+		kprintf("cpb: %s\n", strerror(res.result));
+		return res.result;
+	}
+
+	kprintf("User copy benchmark: %u pages, %d passes, KB/s\n",
+		res.npages, CPB_PASSES);
+	kprintf("%-8s %6s %12s %12s\n", "path", "size", "copyin", "copyout");
+	for (d=0; d<2; d++) {
+		for (i=0; i<CPB_NSIZES; i++) {
+			kprintf("%-8s %6u %12llu %12llu\n",
+				d == 0 ? "direct" : "tlb",
+				(unsigned)cpb_sizes[i],
+				res.in_kbs[d][i], res.out_kbs[d][i]);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Page table benchmark: compares the page table backends (see
+ * pagetable.h) on the operations the VM does most, with made up
+ * address spaces so no process is involved.
+ *
+ *    fault   - look up a missing page, add it, and read it back as
+ *              a TLB entry, as vm_fault does on first touch
+ *    lookup  - look up resident pages at random
+ *    fork    - copy every entry of one address space into a new one
+ *    exit    - remove them all again and destroy the address space
+ *
+ * and what the table itself costs in memory. Each address space is
+ * laid out like a user program: code, data and a stack.
+ *
+ * Backends can only be switched with no user address spaces around,
+ * so run this before starting any programs.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <test.h>
+
+#define PTB_NPROCS	4
+#define PTB_NPAGES	256
+#define PTB_LOOKUPS	4	/* random lookups per page */
+
+#define PTB_CODE	0x00400000
+#define PTB_DATA	0x10000000
+
+struct ptb_result {
+	uint64_t fault_ns;	/* per page */
+	uint64_t lookup_ns;	/* per lookup */
+	uint64_t fork_us;	/* per address space */
+	uint64_t exit_us;
+	unsigned long fixed;	/* bytes with no address spaces */
+	unsigned long perproc;	/* bytes each address space adds */
+};
+
+/*
+ * Page I of NPAGES: a quarter code, half data, the rest stack.
+ */
+static
+vaddr_t
+ptb_vaddr(unsigned i, unsigned npages)
+{
+	unsigned ncode = npages / 4;
+	unsigned ndata = npages / 2;
+
+	if (i < ncode) {
+		return PTB_CODE + i * PAGE_SIZE;
+	}
+	if (i < ncode + ndata) {
+		return PTB_DATA + (i - ncode) * PAGE_SIZE;
+	}
+	return USERSTACK - (npages - i) * PAGE_SIZE;
+}
+
+static
+uint64_t
+ptb_elapsed_ns(const struct timespec *start)
+{
+	struct timespec now, diff;
+
+	gettime(&now);
+	timespec_sub(&now, start, &diff);
+	return (uint64_t)diff.tv_sec * 1000000000ULL + diff.tv_nsec;
+}
+
+/*
+ * Remove the first NPAGES entries of AS and destroy it.
+ */
+static
+void
+ptb_teardown(struct addrspace *as, unsigned npages)
+{
+	unsigned i;
+
+	for (i=0; i<npages; i++) {
+		remove_page_entry(ptb_vaddr(i, npages), (pid_t)as);
+	}
+	as_destroy(as);
+}
+
+static
+int
+ptb_run(unsigned npages, struct ptb_result *res)
+{
+	struct addrspace *as[PTB_NPROCS];
+	struct addrspace *child;
+	struct pt_stats before, after;
+	struct timespec start;
+	paddr_t paddr;
+	uint32_t hi, lo;
+	char control;
+	unsigned p, i, n, stored;
+	int result = 0;
+
+	pt_getstats(&before);
+	res->fixed = before.bytes;
+
+	for (p=0; p<PTB_NPROCS; p++) {
+		as[p] = as_create();
+		if (as[p] == NULL) {
+			while (p-- > 0) {
+				as_destroy(as[p]);
+			}
+			return ENOMEM;
+		}
+	}
+
+	/* first touch of every page */
+	stored = 0;
+	gettime(&start);
+	for (p=0; p<PTB_NPROCS && result == 0; p++) {
+		for (i=0; i<npages; i++) {
+			vaddr_t va = ptb_vaddr(i, npages);
+			pid_t pid = (pid_t)as[p];
+
+			if (get_page_entry(va, pid, &paddr, &control) == 0) {
+				panic("ptbench: page there before it was added\n");
+			}
+			/* frames are made up, nothing ever maps them */
+			if (!store_entry(va, pid, (i + 1) * PAGE_SIZE,
+					 VALIDMASK | READWRITE)) {
+				result = ENOMEM;
+				break;
+			}
+			stored++;
+			if (get_tlb_entry(va, pid, &hi, &lo) != 0) {
+				panic("ptbench: page lost after adding it\n");
+			}
+		}
+	}
+	res->fault_ns = ptb_elapsed_ns(&start) / (stored ? stored : 1);
+	if (result) {
+		goto out;
+	}
+
+	pt_getstats(&after);
+	res->perproc = (after.bytes - before.bytes) / PTB_NPROCS;
+
+	/* random lookups */
+	n = PTB_NPROCS * npages * PTB_LOOKUPS;
+	gettime(&start);
+	for (i=0; i<n; i++) {
+		unsigned r = random();
+		if (get_page_entry(ptb_vaddr(r % npages, npages),
+				   (pid_t)as[(r / npages) % PTB_NPROCS],
+				   &paddr, &control) != 0) {
+			panic("ptbench: page missing\n");
+		}
+	}
+	res->lookup_ns = ptb_elapsed_ns(&start) / n;
+
+	/* fork and exit of each address space */
+	res->fork_us = res->exit_us = 0;
+	for (p=0; p<PTB_NPROCS; p++) {
+		gettime(&start);
+		child = as_create();
+		if (child == NULL) {
+			result = ENOMEM;
+			goto out;
+		}
+		for (i=0; i<npages; i++) {
+			vaddr_t va = ptb_vaddr(i, npages);
+
+			get_page_entry(va, (pid_t)as[p], &paddr, &control);
+			if (!store_entry(va, (pid_t)child, paddr, control)) {
+				/* remove what was copied, the rest is missing */
+				ptb_teardown(child, i);
+				result = ENOMEM;
+				goto out;
+			}
+		}
+		res->fork_us += ptb_elapsed_ns(&start) / 1000;
+
+		gettime(&start);
+		ptb_teardown(child, npages);
+		res->exit_us += ptb_elapsed_ns(&start) / 1000;
+	}
+	res->fork_us /= PTB_NPROCS;
+	res->exit_us /= PTB_NPROCS;
+
+ out:
+	/* the last address space may only be partly filled in */
+	for (p=0; p<PTB_NPROCS; p++) {
+		n = stored < npages ? stored : npages;
+		stored -= n;
+		ptb_teardown(as[p], n);
+	}
+	return result;
+}
+
+int
+ptbench(int nargs, char **args)
+{
+	struct ptb_result res;
+	const char *orig, *name;
+	unsigned npages = PTB_NPAGES;
+	int i, result;
+
+	if (nargs == 2) {
+		npages = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: ptb [pages per address space]\n");
+		return EINVAL;
+	}
+	if (npages < 4) {
+		kprintf("ptb: need at least 4 pages\n");
+		return EINVAL;
+	}
+
+	orig = pt_name();
+	kprintf("Page table benchmark: %d address spaces of %u pages\n",
+		PTB_NPROCS, npages);
+	kprintf("%-8s %10s %10s %9s %9s %11s %11s\n", "backend",
+		"fault(ns)", "lookup(ns)", "fork(us)", "exit(us)",
+		"bytes/as", "fixed");
+
+	result = 0;
+	for (i=0; (name = pt_backend_name(i)) != NULL; i++) {
+		result = pt_select(name);
+		if (result) {
+			kprintf("ptb: can't switch to %s: %s "
+				"(user programs running?)\n",
+				name, strerror(result));
+			break;
+		}
+		result = ptb_run(npages, &res);
+		if (result) {
+			kprintf("ptb: %s: %s\n", name, strerror(result));
+			break;
+		}
+		kprintf("%-8s %10llu %10llu %9llu %9llu %11lu %11lu\n", name,
+			res.fault_ns, res.lookup_ns, res.fork_us,
+			res.exit_us, res.perproc, res.fixed);
+	}
+
+	pt_select(orig);
+	return result;
+}
@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Reader-writer lock benchmark: threads each doing a run of short
+ * critical sections, mostly reads, on one shared counter table,
+ * protected in turn by a lock, a plain rwlock, and a per-cpu rwlock.
+ * Prints the total throughput for a few mixes of reads and writes.
+ *
+ * On one cpu the three come out about the same; the rwlocks are for
+ * letting readers on several cpus in at once.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define RWB_NTHREADS	8
+#define RWB_OPS		2000	/* per thread */
+#define RWB_WORK	50	/* table entries looked at per op */
+#define RWB_NMIXES	3
+#define RWB_NKINDS	3
+
+static const unsigned rwb_writepct[RWB_NMIXES] = { 0, 1, 10 };
+static const char *const rwb_kinds[RWB_NKINDS] = {
+	"lock", "rwlock", "percpu",
+};
+
+static struct lock *rwb_lock;
+static struct rwlock *rwb_rw;
+static struct semaphore *rwb_done;
+static volatile unsigned rwb_table[RWB_WORK];
+static unsigned rwb_kind, rwb_pct;
+
+static
+void
+rwb_op(bool write)
+{
+	unsigned i, sum;
+
+	if (rwb_kind == 0) {
+		lock_acquire(rwb_lock);
+	}
+	else if (write) {
+		rwlock_acquire_write(rwb_rw);
+	}
+	else {
+		rwlock_acquire_read(rwb_rw);
+	}
+
+	sum = 0;
+	for (i=0; i<RWB_WORK; i++) {
+		sum += rwb_table[i];
+		if (write) {
+			rwb_table[i] = sum;
+		}
+	}
+
+	if (rwb_kind == 0) {
+		lock_release(rwb_lock);
+	}
+	else if (write) {
+		rwlock_release_write(rwb_rw);
+	}
+	else {
+		rwlock_release_read(rwb_rw);
+	}
+}
+
+static
+void
+rwb_thread(void *junk, unsigned long num)
+{
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<RWB_OPS; i++) {
+		rwb_op(random() % 100 < rwb_pct);
+	}
+	V(rwb_done);
+}
+
+/*
+ * Run one kind of lock with one mix; returns thousands of ops per
+ * second.
+ */
+static
+uint64_t
+rwb_run(unsigned kind, unsigned pct, unsigned nthreads)
+{
+	struct timespec start, end;
+	uint64_t ns;
+	unsigned i;
+	int result;
+
+	rwb_kind = kind;
+	rwb_pct = pct;
+	rwb_lock = NULL;
+	rwb_rw = NULL;
+	switch (kind) {
+	    case 0:
+		rwb_lock = lock_create("rwbench");
+		break;
+	    case 1:
+		rwb_rw = rwlock_create("rwbench");
+		break;
+	    case 2:
+		rwb_rw = rwlock_create_percpu("rwbench");
+		break;
+	}
+	if (rwb_lock == NULL && rwb_rw == NULL) {
+		panic("rwbench: out of memory\n");
+	}
+
+	gettime(&start);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("rwbench", NULL, rwb_thread, NULL, i);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(rwb_done);
+	}
+	gettime(&end);
+	timespec_sub(&end, &start, &end);
+
+	if (rwb_lock != NULL) {
+		lock_destroy(rwb_lock);
+	}
+	if (rwb_rw != NULL) {
+		rwlock_destroy(rwb_rw);
+	}
+
+	ns = end.tv_sec * 1000000000ULL + end.tv_nsec;
+	if (ns == 0) {
+		ns = 1;
+	}
+	return (uint64_t)nthreads * RWB_OPS * 1000000ULL / ns;
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	unsigned nthreads, mix, kind;
+
+	nthreads = RWB_NTHREADS;
+	if (nargs == 2) {
+		nthreads = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: rwb [threads]\n");
+		return 1;
+	}
+	if (nthreads == 0) {
+		kprintf("rwb: need at least 1 thread\n");
+		return 1;
+	}
+
+	rwb_done = sem_create("rwbench", 0);
+	if (rwb_done == NULL) {
+		panic("rwbench: out of memory\n");
+	}
+
+	kprintf("Rwlock benchmark: %u threads, %u ops each, "
+		"thousands of ops/s\n", nthreads, RWB_OPS);
+	kprintf("%-8s", "writes");
+	for (kind=0; kind<RWB_NKINDS; kind++) {
+		kprintf(" %10s", rwb_kinds[kind]);
+	}
+	kprintf("\n");
+	for (mix=0; mix<RWB_NMIXES; mix++) {
+		kprintf("%7u%%", rwb_writepct[mix]);
+		for (kind=0; kind<RWB_NKINDS; kind++) {
+			kprintf(" %10llu",
+				rwb_run(kind, rwb_writepct[mix], nthreads));
+		}
+		kprintf("\n");
+	}
+
+	sem_destroy(rwb_done);
+	rwb_done = NULL;
+	return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Spinlock contention benchmark: threads, ideally one per cpu, each
+ * taking one shared spinlock over and over for a fixed time, with a
+ * short critical section, once with a test-and-set lock and once
+ * with a ticket lock. Prints the total acquisitions per second and
+ * the fewest and most any one thread got, which shows how fair the
+ * lock is: with test-and-set one cpu can keep winning.
+ *
+ * On one cpu there's nothing to contend.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define SPB_MAXTHREADS	32
+#define SPB_NTHREADS	4
+#define SPB_MSECS	500	/* run time */
+#define SPB_WORK	20	/* loops inside the lock */
+#define SPB_CHECK	64	/* acquisitions between looks at the clock */
+
+static struct spinlock spb_lock;
+static struct semaphore *spb_start;
+static struct semaphore *spb_done;
+static unsigned long spb_count[SPB_MAXTHREADS];
+static volatile unsigned spb_shared;
+static struct timespec spb_end;
+
+static
+bool
+spb_over(void)
+{
+	struct timespec now;
+
+	gettime(&now);
+	return now.tv_sec > spb_end.tv_sec ||
+		(now.tv_sec == spb_end.tv_sec &&
+		 now.tv_nsec >= spb_end.tv_nsec);
+}
+
+static
+void
+spb_thread(void *junk, unsigned long num)
+{
+	unsigned long count;
+	unsigned i;
+	volatile unsigned j;
+
+	(void)junk;
+
+	P(spb_start);
+	count = 0;
+	do {
+		for (i=0; i<SPB_CHECK; i++) {
+			spinlock_acquire(&spb_lock);
+			spb_shared++;
+			for (j=0; j<SPB_WORK; j++) {
+				/* nothing */
+			}
+			spinlock_release(&spb_lock);
+		}
+		count += SPB_CHECK;
+	} while (!spb_over());
+	spb_count[num] = count;
+	V(spb_done);
+}
+
+static
+void
+spb_run(const char *kind, bool ticket, unsigned nthreads)
+{
+	struct timespec duration;
+	unsigned long total, min, max;
+	unsigned i;
+	int result;
+
+	if (ticket) {
+		spinlock_init_ticket(&spb_lock);
+	}
+	else {
+		spinlock_init(&spb_lock);
+	}
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spinbench", NULL, spb_thread, NULL, i);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	/* let them spread out over the cpus before starting */
+	clocksleep(1);
+
+	duration.tv_sec = SPB_MSECS / 1000;
+	duration.tv_nsec = (SPB_MSECS % 1000) * 1000000;
+	gettime(&spb_end);
+	timespec_add(&spb_end, &duration, &spb_end);
+	for (i=0; i<nthreads; i++) {
+		V(spb_start);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(spb_done);
+	}
+	spinlock_cleanup(&spb_lock);
+
+	total = 0;
+	min = max = spb_count[0];
+	for (i=0; i<nthreads; i++) {
+		total += spb_count[i];
+		if (spb_count[i] < min) {
+			min = spb_count[i];
+		}
+		if (spb_count[i] > max) {
+			max = spb_count[i];
+		}
+	}
+	kprintf("%-8s %12lu %10lu %10lu\n", kind,
+		total * 1000 / SPB_MSECS, min, max);
+}
+
+int
+spinbench(int nargs, char **args)
+{
+	unsigned nthreads;
+
+	nthreads = SPB_NTHREADS;
+	if (nargs == 2) {
+		nthreads = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: spb [threads]\n");
+		return 1;
+	}
+	if (nthreads == 0 || nthreads > SPB_MAXTHREADS) {
+		kprintf("spb: 1 to %d threads\n", SPB_MAXTHREADS);
+		return 1;
+	}
+
+	spb_start = sem_create("spinbench", 0);
+	spb_done = sem_create("spinbench", 0);
+	if (spb_start == NULL || spb_done == NULL) {
+		panic("spinbench: out of memory\n");
+	}
+
+	kprintf("Spinlock benchmark: %u threads, %d ms\n", nthreads,
+		SPB_MSECS);
+	kprintf("%-8s %12s %10s %10s\n", "lock", "acquires/s", "min", "max");
+	spb_run("tas", false, nthreads);
+	spb_run("ticket", true, nthreads);
+
+	sem_destroy(spb_done);
+	sem_destroy(spb_start);
+	spb_start = spb_done = NULL;
+	return 0;
+}
@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
+#include <current.h>
 #include <synch.h>
 #include <test.h>
 
@@ -400,3 +401,255 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test.
+ *
+ * Each thread reads or writes testval1/testval2 under the rwlock at
+ * random, keeping count of the readers and writers inside (under a
+ * spinlock of its own) to check that a writer is always alone and
+ * that the values readers see are consistent. Runs on a plain and a
+ * per-cpu rwlock.
+ */
+
+#define NRWLOOPS	200
+#define RWWRITEPCT	10	/* percentage of writes */
+
+static struct rwlock *testrw;
+static struct spinlock rwcountlock = SPINLOCK_INITIALIZER;
+static unsigned rwreaders, rwwriters, rwmaxreaders;
+static volatile bool rwfailed;
+
+static
+void
+rwcount(int dreaders, int dwriters)
+{
+	spinlock_acquire(&rwcountlock);
+	rwreaders += dreaders;
+	rwwriters += dwriters;
+	if (rwwriters > 1 || (rwwriters > 0 && rwreaders > 0)) {
+		rwfailed = true;
+	}
+	if (rwreaders > rwmaxreaders) {
+		rwmaxreaders = rwreaders;
+	}
+	spinlock_release(&rwcountlock);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if (random() % 100 < RWWRITEPCT) {
+			rwlock_acquire_write(testrw);
+			rwcount(0, 1);
+			testval1 = num;
+			for (j=0; j<100; j++);
+			testval2 = num*num;
+			rwcount(0, -1);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			rwcount(1, 0);
+			for (j=0; j<100; j++);
+			if (testval2 != testval1*testval1) {
+				kprintf("thread %lu: Mismatch on "
+					"testval2/testval1\n", num);
+				rwfailed = true;
+			}
+			rwcount(-1, 0);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+}
+
+static
+void
+rwtestrun(const char *kind, struct rwlock *rw)
+{
+	int i, result;
+
+	testrw = rw;
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = 0;
+	rwmaxreaders = 0;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	KASSERT(rwreaders == 0 && rwwriters == 0);
+
+	kprintf("%s rwlock: up to %u readers at once\n", kind,
+		rwmaxreaders);
+	rwlock_destroy(testrw);
+	testrw = NULL;
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	rwfailed = false;
+	rwtestrun("Plain", rwlock_create("rwtest"));
+	rwtestrun("Per-cpu", rwlock_create_percpu("rwtest"));
+
+	if (rwfailed) {
+		kprintf("Test failed\n");
+	}
+	kprintf("Rwlock test done.\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Priority inheritance test.
+ *
+ * The menu thread, at the lowest level, holds lock A. A middle thread
+ * takes lock B and then waits for A; a thread at the highest level
+ * waits for B. The menu thread should be lent the high thread's
+ * level, through the chain, and give it back when it lets go of A.
+ */
+
+static struct lock *pilocka, *pilockb;
+static struct semaphore *pisem;
+
+/*
+ * Best level of a lock's waiters, once there are any.
+ */
+static
+int
+pi_waitlevel(struct lock *lock)
+{
+	int i, level;
+
+	/* the waiter may spin for a while before it sleeps */
+	for (i=0; i<100 && lock->lk_nwaiters == 0; i++) {
+		clocksleep(1);
+	}
+	if (lock->lk_nwaiters == 0) {
+		panic("pitest: %s never got a waiter\n", lock->lk_name);
+	}
+	for (level=0; lock->lk_waiters[level] == 0; level++);
+	return level;
+}
+
+static
+void
+pimiddlethread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	lock_acquire(pilockb);
+	V(pisem);
+	lock_acquire(pilocka);
+	lock_release(pilocka);
+	lock_release(pilockb);
+	V(donesem);
+}
+
+static
+void
+pihighthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	curthread->t_priority = 0;
+	lock_acquire(pilockb);
+	lock_release(pilockb);
+	V(donesem);
+}
+
+int
+pitest(int nargs, char **args)
+{
+	int result, level, oldpriority;
+	bool failed = false;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting priority inheritance test...\n");
+
+	pilocka = lock_create("pitest A");
+	pilockb = lock_create("pitest B");
+	pisem = sem_create("pitest", 0);
+	if (pilocka == NULL || pilockb == NULL || pisem == NULL) {
+		panic("pitest: out of memory\n");
+	}
+
+	/* the menu thread goes back to where it was afterwards */
+	oldpriority = curthread->t_priority;
+	curthread->t_priority = SCHED_NLEVELS - 1;
+	lock_acquire(pilocka);
+
+	result = thread_fork("pitest middle", NULL, pimiddlethread, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	P(pisem);
+	(void)pi_waitlevel(pilocka);
+
+	result = thread_fork("pitest high", NULL, pihighthread, NULL, 0);
+	if (result) {
+		panic("pitest: thread_fork failed: %s\n", strerror(result));
+	}
+	level = pi_waitlevel(pilockb);
+
+	kprintf("High thread waits at level %d; holder of A lent %d, "
+		"runs at %d\n", level, curthread->t_inherit,
+		thread_schedlevel(curthread));
+	if (curthread->t_inherit != level ||
+	    pi_waitlevel(pilocka) != level) {
+		failed = true;
+	}
+
+	lock_release(pilocka);
+	if (curthread->t_inherit != SCHED_NLEVELS) {
+		kprintf("Level not given back on release\n");
+		failed = true;
+	}
+
+	P(donesem);
+	P(donesem);
+
+	sem_destroy(pisem);
+	lock_destroy(pilockb);
+	lock_destroy(pilocka);
+	pisem = NULL;
+	pilocka = pilockb = NULL;
+
+	curthread->t_priority = oldpriority;
+
+	if (failed) {
+		kprintf("Test failed\n");
+	}
+	kprintf("Priority inheritance test done.\n");
+	return 0;
+}
@@ -30,17 +30,19 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
-#include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
+#include <timer.h>
+#include <vm.h>
+#include "opt-dumbvm.h"
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Callbacks at points in the future, with hardclock resolution, are
+ * in timer.c; hardclock() runs them.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -52,58 +54,150 @@
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
 #define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define IDLE_HARDCLOCKS		HZ	/* Longest tickless idle stretch. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
+ * Setup.
  */
-static struct wchan *lbolt;
-static struct spinlock lbolt_lock;
+void
+hardclock_bootstrap(void)
+{
+	/* the boot cpu runs the timers */
+	timer_bootstrap();
+}
 
 /*
- * Setup.
+ * Tickless operation.
+ *
+ * A cpu doesn't need a hardclock every tick when there's nothing for
+ * one to do: when it's idle, or running the only thread it has. Then
+ * the scheduler puts its next timer interrupt off (hardclock_defer):
+ * until the next migration check when busy, or IDLE_HARDCLOCKS ahead
+ * when idle. Anything that gives the cpu a thread to run also brings
+ * it back to ticking every period (hardclock_resume), either directly
+ * or with an interprocessor interrupt. On the cpu that runs the timers
+ * the next timer due also limits how long it goes (see timer.c).
+ *
+ * c_tickdefer is the number of periods the timer was last set for;
+ * the hardclock() that ends a deferral stands for all of them. Ticks
+ * that passed before a deferral was cut short are saved up in
+ * c_tickcredit for the next hardclock().
+ */
+
+/*
+ * Put this cpu's next hardclock off. IDLE is true if there's nothing
+ * to run. The caller must hold this cpu's run queue lock, so anyone
+ * adding a thread to it sees c_tickdefer and brings the tick back.
  */
 void
-hardclock_bootstrap(void)
+hardclock_defer(bool idle)
 {
-	spinlock_init(&lbolt_lock);
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
+	unsigned nticks;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_runqueue_lock));
+
+	if (idle) {
+		nticks = IDLE_HARDCLOCKS;
+	}
+	else {
+		nticks = MIGRATE_HARDCLOCKS -
+			curcpu->c_hardclocks % MIGRATE_HARDCLOCKS;
 	}
+	if (curcpu->c_number == 0) {
+		/* wake up for the next timer that's due */
+		nticks = timer_defer(nticks);
+	}
+	if (nticks <= 1 || nticks == curcpu->c_tickdefer) {
+		return;
+	}
+	curcpu->c_tickdefer = nticks;
+	mainbus_timer_defer(nticks);
 }
 
 /*
- * This is called once per second, on one processor, by the timer
- * code.
+ * Go back to a hardclock every period, if this cpu's was put off.
+ * Interrupts must be off.
  */
 void
-timerclock(void)
+hardclock_resume(void)
 {
-	/* Just broadcast on lbolt */
-	spinlock_acquire(&lbolt_lock);
-	wchan_wakeall(lbolt, &lbolt_lock);
-	spinlock_release(&lbolt_lock);
+	unsigned elapsed;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	if (curcpu->c_tickdefer == 1) {
+		return;
+	}
+	/*
+	 * ELAPSED is counted from when the timer was set, which is when
+	 * the last tick was counted or the deferral began. If the whole
+	 * deferral has gone by, its hardclock is already due (we may be
+	 * in the same interrupt, handling an IPI first) and will count
+	 * those periods itself; crediting them here as well would count
+	 * them twice.
+	 */
+	elapsed = mainbus_timer_elapsed();
+	if (elapsed >= curcpu->c_tickdefer) {
+		return;
+	}
+	mainbus_timer_defer(1);
+	curcpu->c_tickdefer = 1;
+
+	curcpu->c_tickcredit += elapsed;
+	if (curcpu->c_isidle) {
+		curcpu->c_idleclocks += elapsed;
+	}
+}
+
+/*
+ * True if a counter going from OLD to NEW passed a multiple of N.
+ */
+static
+bool
+hardclock_crossed(unsigned old, unsigned new, unsigned n)
+{
+	return old / n != new / n;
 }
 
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, or less often while the cpu is tickless (see above).
  */
 void
 hardclock(void)
 {
+	unsigned ticks, old;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+	/* The timer has been set back to one period by now */
+	ticks = curcpu->c_tickdefer;
+	curcpu->c_tickdefer = 1;
+
+	old = curcpu->c_hardclocks;
+	curcpu->c_hardclocks += ticks + curcpu->c_tickcredit;
+#if !OPT_DUMBVM
+	if (curcpu->c_number == 0) {
+		/* Reference bit sampling runs off one cpu's clock */
+		vm_hardclock(ticks + curcpu->c_tickcredit);
+	}
+#endif
+	curcpu->c_tickcredit = 0;
+	if (curcpu->c_number == 0) {
+		timer_hardclock();
+	}
+
+	if (hardclock_crossed(old, curcpu->c_hardclocks, MIGRATE_HARDCLOCKS)) {
 		thread_consider_migration();
 	}
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	if (hardclock_crossed(old, curcpu->c_hardclocks, SCHEDULE_HARDCLOCKS)) {
 		schedule();
 	}
-	thread_yield();
+	if (thread_tick(ticks)) {
+		thread_yield();
+	}
 }
 
 /*
@@ -112,10 +206,21 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-	spinlock_acquire(&lbolt_lock);
-	while (num_secs > 0) {
-		wchan_sleep(lbolt, &lbolt_lock);
-		num_secs--;
+	struct timespec now, end;
+
+	if (num_secs <= 0) {
+		return;
 	}
-	spinlock_release(&lbolt_lock);
+	if (timer_sleep(num_secs * HZ) == 0) {
+		return;
+	}
+
+	/* out of memory for the wait channel; spin on the clock */
+	gettime(&end);
+	end.tv_sec += num_secs;
+	do {
+		thread_yield();
+		gettime(&now);
+	} while (now.tv_sec < end.tv_sec ||
+		 (now.tv_sec == end.tv_sec && now.tv_nsec < end.tv_nsec));
 }
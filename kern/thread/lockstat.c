@@ -0,0 +1,411 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock contention profiling.
+ *
+ * Every lock and CV name, and every place a spinlock is acquired
+ * from, gets a record in a fixed table the first time it's seen.
+ * Locks and CVs look theirs up when they're created and keep a
+ * pointer to it; spinlocks look theirs up on each acquire.
+ *
+ * The table is protected by a bare lock word rather than a spinlock,
+ * because acquiring a spinlock comes back here.
+ *
+ * Times come from the real-time clock, so nothing is timed until
+ * the devices are probed and lockstat_bootstrap is called.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spl.h>
+#include <membar.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <lockstat.h>
+
+/* Size of the table, and of the names kept in it */
+#define LOCKSTAT_MAX		256
+#define LOCKSTAT_NAMELEN	24
+
+struct lockstat {
+	bool ls_used;
+	int ls_kind;
+	const void *ls_site;		/* spinlocks: where from */
+	char ls_name[LOCKSTAT_NAMELEN];	/* locks and CVs */
+
+	unsigned ls_acquired;		/* acquires, or CV waits */
+	unsigned ls_contended;		/* ... that had to wait */
+	uint64_t ls_waittotal;		/* ns spent waiting */
+	uint64_t ls_waitmax;
+	uint64_t ls_holdtotal;		/* ns held */
+	uint64_t ls_holdmax;
+};
+
+static struct lockstat lockstat_table[LOCKSTAT_MAX];
+static unsigned lockstat_dropped;	/* lookups that found no room */
+static volatile spinlock_data_t lockstat_lock = SPINLOCK_DATA_INITIALIZER;
+static bool lockstat_ready;
+
+static const char *const lockstat_kinds[] = { "spin", "lock", "cv" };
+
+/*
+ * Get and let go of the table. Interrupts are kept off so an
+ * interrupt handler can't come back for it on the same cpu.
+ */
+static
+int
+lockstat_enter(void)
+{
+	int s;
+
+	s = splhigh();
+	while (spinlock_data_testandset(&lockstat_lock) != 0) {
+		/* nothing */
+	}
+	membar_store_any();
+	return s;
+}
+
+static
+void
+lockstat_exit(int s)
+{
+	membar_any_store();
+	spinlock_data_set(&lockstat_lock, 0);
+	splx(s);
+}
+
+/*
+ * Check whether NAME, cut to fit, is the name kept in LS.
+ */
+static
+bool
+lockstat_samename(const struct lockstat *ls, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < LOCKSTAT_NAMELEN - 1; i++) {
+		if (ls->ls_name[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find the record for a name or a spinlock site, making one if there
+ * isn't one. Returns NULL if the table is full. Call with the table
+ * held.
+ */
+static
+struct lockstat *
+lockstat_lookup(int kind, const char *name, const void *site)
+{
+	struct lockstat *ls;
+	unsigned hash, i, n;
+
+	if (name != NULL) {
+		hash = 5381;
+		for (i = 0; name[i] != 0 && i < LOCKSTAT_NAMELEN - 1; i++) {
+			hash = hash * 33 + (unsigned char)name[i];
+		}
+	}
+	else {
+		hash = (unsigned)(uintptr_t)site >> 2;
+	}
+	hash += kind;
+
+	for (n = 0; n < LOCKSTAT_MAX; n++) {
+		ls = &lockstat_table[(hash + n) % LOCKSTAT_MAX];
+		if (!ls->ls_used) {
+			ls->ls_used = true;
+			ls->ls_kind = kind;
+			ls->ls_site = site;
+			for (i = 0; name != NULL && name[i] != 0 &&
+				     i < LOCKSTAT_NAMELEN - 1; i++) {
+				ls->ls_name[i] = name[i];
+			}
+			ls->ls_name[i] = 0;
+			return ls;
+		}
+		if (ls->ls_kind != kind || ls->ls_site != site) {
+			continue;
+		}
+		if (name == NULL || lockstat_samename(ls, name)) {
+			return ls;
+		}
+	}
+	lockstat_dropped++;
+	return NULL;
+}
+
+/*
+ * Start timing; called once the clock exists.
+ */
+void
+lockstat_bootstrap(void)
+{
+	lockstat_ready = true;
+}
+
+/*
+ * Hook a lock or CV up to the record for its name.
+ */
+void
+lockstat_init(struct lockstat_hold *h, int kind, const char *name)
+{
+	int s;
+
+	KASSERT(kind != LOCKSTAT_SPINLOCK);
+
+	s = lockstat_enter();
+	h->h_stat = lockstat_lookup(kind, name, NULL);
+	lockstat_exit(s);
+	h->h_start = 0;
+}
+
+/*
+ * The time now in ns, or 0 if we can't tell yet.
+ */
+uint64_t
+lockstat_now(void)
+{
+	struct timespec ts;
+
+	if (!lockstat_ready) {
+		return 0;
+	}
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Count an acquire. WAITSTART is when we started waiting, or 0 if
+ * the lock was free.
+ */
+static
+void
+lockstat_count(struct lockstat *ls, uint64_t waitstart, uint64_t now)
+{
+	uint64_t wait;
+
+	ls->ls_acquired++;
+	if (waitstart != 0) {
+		wait = now - waitstart;
+		ls->ls_contended++;
+		ls->ls_waittotal += wait;
+		if (wait > ls->ls_waitmax) {
+			ls->ls_waitmax = wait;
+		}
+	}
+}
+
+/*
+ * A lock has been acquired.
+ */
+void
+lockstat_acquired(struct lockstat_hold *h, uint64_t waitstart)
+{
+	uint64_t now;
+	int s;
+
+	if (h->h_stat == NULL || !lockstat_ready) {
+		return;
+	}
+
+	now = lockstat_now();
+	s = lockstat_enter();
+	lockstat_count(h->h_stat, waitstart, now);
+	lockstat_exit(s);
+	h->h_start = now;
+}
+
+/*
+ * A spinlock has been acquired, at SITE.
+ */
+void
+lockstat_spinlock_acquired(struct lockstat_hold *h, const void *site,
+			   uint64_t waitstart)
+{
+	uint64_t now;
+	int s;
+
+	if (!lockstat_ready) {
+		return;
+	}
+
+	now = lockstat_now();
+	s = lockstat_enter();
+	h->h_stat = lockstat_lookup(LOCKSTAT_SPINLOCK, NULL, site);
+	if (h->h_stat != NULL) {
+		lockstat_count(h->h_stat, waitstart, now);
+	}
+	lockstat_exit(s);
+	h->h_start = now;
+}
+
+/*
+ * A lock or spinlock is about to be released.
+ */
+void
+lockstat_released(struct lockstat_hold *h)
+{
+	struct lockstat *ls = h->h_stat;
+	uint64_t hold;
+	int s;
+
+	if (ls == NULL || h->h_start == 0) {
+		return;
+	}
+
+	hold = lockstat_now() - h->h_start;
+	h->h_start = 0;
+
+	s = lockstat_enter();
+	ls->ls_holdtotal += hold;
+	if (hold > ls->ls_holdmax) {
+		ls->ls_holdmax = hold;
+	}
+	lockstat_exit(s);
+}
+
+/*
+ * A thread has woken up from waiting on a CV.
+ */
+void
+lockstat_cv_waited(struct lockstat_hold *h, uint64_t waitstart)
+{
+	uint64_t now;
+	int s;
+
+	if (h->h_stat == NULL || waitstart == 0) {
+		return;
+	}
+
+	now = lockstat_now();
+	s = lockstat_enter();
+	lockstat_count(h->h_stat, waitstart, now);
+	lockstat_exit(s);
+}
+
+/*
+ * Print the counts, most time spent waiting first. Times are in
+ * microseconds.
+ */
+void
+lockstat_print(void)
+{
+	struct lockstat *copy, tmp;
+	unsigned i, j, n;
+	int s;
+
+	/* kmalloc takes spinlocks, so do it before getting the table */
+	copy = kmalloc(LOCKSTAT_MAX * sizeof(*copy));
+	if (copy == NULL) {
+		kprintf("lockstat: Out of memory\n");
+		return;
+	}
+
+	n = 0;
+	s = lockstat_enter();
+	for (i = 0; i < LOCKSTAT_MAX; i++) {
+		if (lockstat_table[i].ls_used &&
+		    lockstat_table[i].ls_acquired > 0) {
+			copy[n++] = lockstat_table[i];
+		}
+	}
+	lockstat_exit(s);
+
+	for (i = 1; i < n; i++) {
+		tmp = copy[i];
+		for (j = i; j > 0 &&
+			     copy[j-1].ls_waittotal < tmp.ls_waittotal; j--) {
+			copy[j] = copy[j-1];
+		}
+		copy[j] = tmp;
+	}
+
+	kprintf("kind name                      acquires  contended"
+		"  wait total    max  hold total    max\n");
+	for (i = 0; i < n; i++) {
+		if (copy[i].ls_kind == LOCKSTAT_SPINLOCK) {
+			kprintf("%-4s %-23p", lockstat_kinds[copy[i].ls_kind],
+				copy[i].ls_site);
+		}
+		else {
+			kprintf("%-4s %-23s", lockstat_kinds[copy[i].ls_kind],
+				copy[i].ls_name);
+		}
+		kprintf(" %10u %10u %11llu %6llu",
+			copy[i].ls_acquired, copy[i].ls_contended,
+			copy[i].ls_waittotal / 1000,
+			copy[i].ls_waitmax / 1000);
+		if (copy[i].ls_kind == LOCKSTAT_CV) {
+			kprintf("           -      -\n");
+		}
+		else {
+			kprintf(" %11llu %6llu\n",
+				copy[i].ls_holdtotal / 1000,
+				copy[i].ls_holdmax / 1000);
+		}
+	}
+	if (lockstat_dropped > 0) {
+		kprintf("Table full: %u lookups failed\n",
+			lockstat_dropped);
+	}
+
+	kfree(copy);
+}
+
+/*
+ * Zero the counts. The records stay, since locks point at them.
+ */
+void
+lockstat_reset(void)
+{
+	struct lockstat *ls;
+	unsigned i;
+	int s;
+
+	s = lockstat_enter();
+	for (i = 0; i < LOCKSTAT_MAX; i++) {
+		ls = &lockstat_table[i];
+		ls->ls_acquired = 0;
+		ls->ls_contended = 0;
+		ls->ls_waittotal = 0;
+		ls->ls_waitmax = 0;
+		ls->ls_holdtotal = 0;
+		ls->ls_holdmax = 0;
+	}
+	lockstat_exit(s);
+}
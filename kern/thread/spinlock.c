@@ -43,6 +43,12 @@
  * Spinlocks.
  */
 
+/*
+ * Proportional backoff for ticket locks: a waiter pauses about this
+ * many loops for each cpu ahead of it between looks at the lock.
+ */
+#define SPINLOCK_BACKOFF	16
+
 
 /*
  * Initialize spinlock.
@@ -51,10 +57,23 @@ void
 spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_serving, 0);
+	splk->splk_ticket = false;
 	splk->splk_holder = NULL;
+	LOCKSTAT_SPINLOCK_INIT(&splk->splk_stat);
 	HANGMAN_LOCKABLEINIT(&splk->splk_hangman, "spinlock");
 }
 
+/*
+ * Initialize spinlock as a ticket lock.
+ */
+void
+spinlock_init_ticket(struct spinlock *splk)
+{
+	spinlock_init(splk);
+	splk->splk_ticket = true;
+}
+
 /*
  * Clean up spinlock.
  */
@@ -62,7 +81,35 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	if (splk->splk_ticket) {
+		KASSERT(spinlock_data_get(&splk->splk_lock) ==
+			spinlock_data_get(&splk->splk_serving));
+	}
+	else {
+		KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	}
+}
+
+/*
+ * Wait for a ticket lock: spin until our ticket is served, backing
+ * off in proportion to the number of cpus in line ahead.
+ */
+static
+void
+spinlock_ticket_wait(struct spinlock *splk, spinlock_data_t ticket)
+{
+	spinlock_data_t serving;
+	volatile unsigned i;
+
+	while (1) {
+		serving = spinlock_data_get(&splk->splk_serving);
+		if (serving == ticket) {
+			break;
+		}
+		for (i = 0; i < (ticket - serving) * SPINLOCK_BACKOFF; i++) {
+			/* nothing */
+		}
+	}
 }
 
 /*
@@ -76,6 +123,8 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	LOCKSTAT_TIMER(waitstart);
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -93,28 +142,40 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
+	if (splk->splk_ticket) {
+		ticket = spinlock_data_fetchinc(&splk->splk_lock);
+		if (spinlock_data_get(&splk->splk_serving) != ticket) {
+			LOCKSTAT_START(waitstart);
+			spinlock_ticket_wait(splk, ticket);
 		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
+	}
+	else {
+		while (1) {
+			/*
+			 * Do test-test-and-set, that is, read first before
+			 * doing test-and-set, to reduce bus contention.
+			 *
+			 * Test-and-set is a machine-level atomic operation
+			 * that writes 1 into the lock word and returns the
+			 * previous value. If that value was 0, the lock was
+			 * previously unheld and we now own it. If it was 1,
+			 * we don't.
+			 */
+			if (spinlock_data_get(&splk->splk_lock) != 0) {
+				LOCKSTAT_START(waitstart);
+				continue;
+			}
+			if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+				LOCKSTAT_START(waitstart);
+				continue;
+			}
+			break;
 		}
-		break;
 	}
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+	LOCKSTAT_SPINLOCK_ACQUIRED(&splk->splk_stat, waitstart);
 
 	if (CURCPU_EXISTS()) {
 		HANGMAN_ACQUIRE(&curcpu->c_hangman, &splk->splk_hangman);
@@ -135,9 +196,17 @@ spinlock_release(struct spinlock *splk)
 		HANGMAN_RELEASE(&curcpu->c_hangman, &splk->splk_hangman);
 	}
 
+	LOCKSTAT_RELEASED(&splk->splk_stat);
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	if (splk->splk_ticket) {
+		/* only the holder writes this, so no atomic op needed */
+		spinlock_data_set(&splk->splk_serving,
+				  spinlock_data_get(&splk->splk_serving) + 1);
+	}
+	else {
+		spinlock_data_set(&splk->splk_lock, 0);
+	}
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
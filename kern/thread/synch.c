@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -138,10 +139,139 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * Locks are adaptive: a thread that finds the lock held spins for a
+ * while instead of sleeping if the holder is running on another cpu,
+ * since then it's likely to let go soon and spinning is cheaper than
+ * two context switches. If the holder is asleep or waiting to run, or
+ * the spinning goes on too long, the thread sleeps as before.
+ *
+ * LOCK_SPIN_CHECK is how many times a spinner looks at the lock
+ * between checks that the holder is still running; LOCK_SPIN_MAX
+ * bounds the spinning in one lock_acquire.
+ */
+#define LOCK_SPIN_CHECK	64
+#define LOCK_SPIN_MAX	4096
+
+/*
+ * Priority inheritance.
+ *
+ * A thread that goes to sleep waiting for a lock is counted in the
+ * lock's lk_waiters at its scheduling level, and lends that level to
+ * the holder (t_inherit) if it's better than the holder's. If the
+ * holder is itself asleep waiting for another lock, the level is
+ * passed on to that one's holder, and so on, up to LOCK_PI_DEPTH
+ * locks down the chain. When a thread lets go of a lock it goes back
+ * to the best level of the waiters on the locks it still holds, and
+ * a thread that gets a lock others are waiting for takes on theirs.
+ *
+ * The waiter counts, t_inherit and t_waitlock are all under pi_lock,
+ * as is any change of holder of a lock with waiters, so following
+ * the chain from lock to holder to lock is safe with just pi_lock.
+ * pi_lock comes after lk_lock.
+ *
+ * A boosted thread on a run queue moves up at the next schedule().
+ */
+#define LOCK_PI_DEPTH	16
+
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * True if the holder of a lock is running (on another cpu). The
+ * caller holds lk_lock, so the holder can't let go of the lock, and
+ * thus can't go away, while we look at it.
+ */
+static
+bool
+lock_holder_running(struct lock *lock)
+{
+	KASSERT(spinlock_do_i_hold(&lock->lk_lock));
+	return lock->lk_holder->t_state == S_RUN;
+}
+
+/*
+ * Best level of the threads waiting for a lock, SCHED_NLEVELS if
+ * none. pi_lock must be held.
+ */
+static
+int
+lock_waitlevel(struct lock *lock)
+{
+	int level;
+
+	if (lock->lk_nwaiters == 0) {
+		return SCHED_NLEVELS;
+	}
+	for (level = 0; lock->lk_waiters[level] == 0; level++) {
+		KASSERT(level < SCHED_NLEVELS - 1);
+	}
+	return level;
+}
+
+/*
+ * Lend LEVEL to the holder of LOCK, and on down the chain of locks
+ * holders are waiting for. pi_lock must be held.
+ */
+static
+void
+lock_lend(struct lock *lock, int level)
+{
+	struct thread *holder;
+	int depth;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	for (depth = 0; lock != NULL && depth < LOCK_PI_DEPTH; depth++) {
+		holder = lock->lk_holder;
+		if (holder == NULL || thread_schedlevel(holder) <= level) {
+			break;
+		}
+		holder->t_inherit = level;
+
+		lock = holder->t_waitlock;
+		if (lock != NULL) {
+			/* it now waits at the better level */
+			lock->lk_waiters[holder->t_waitlevel]--;
+			holder->t_waitlevel = level;
+			lock->lk_waiters[level]++;
+		}
+	}
+}
+
+/*
+ * Go to sleep waiting for a lock, and stop waiting on waking up. We
+ * hold lk_lock.
+ */
+static
+void
+lock_wait(struct lock *lock)
+{
+	struct thread *cur = curthread;
+
+	spinlock_acquire(&pi_lock);
+	cur->t_waitlock = lock;
+	cur->t_waitlevel = thread_schedlevel(cur);
+	lock->lk_waiters[cur->t_waitlevel]++;
+	lock->lk_nwaiters++;
+	lock_lend(lock, cur->t_waitlevel);
+	spinlock_release(&pi_lock);
+
+	/* As in the semaphore. */
+	wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+
+	spinlock_acquire(&pi_lock);
+	KASSERT(lock->lk_waiters[cur->t_waitlevel] > 0);
+	lock->lk_waiters[cur->t_waitlevel]--;
+	lock->lk_nwaiters--;
+	cur->t_waitlock = NULL;
+	spinlock_release(&pi_lock);
+}
+
 struct lock *
 lock_create(const char *name)
 {
 	struct lock *lock;
+	int i;
 
 	lock = kmalloc(sizeof(*lock));
 	if (lock == NULL) {
@@ -164,6 +294,12 @@ lock_create(const char *name)
 	}
 	spinlock_init(&lock->lk_lock);
 	lock->lk_holder = NULL;
+	lock->lk_nextheld = NULL;
+	lock->lk_nwaiters = 0;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		lock->lk_waiters[i] = 0;
+	}
+	LOCKSTAT_INIT(&lock->lk_stat, LOCKSTAT_LOCK, lock->lk_name);
 
 	return lock;
 }
@@ -174,6 +310,7 @@ lock_destroy(struct lock *lock)
 	KASSERT(lock != NULL);
 
 	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_nwaiters == 0);
 	spinlock_cleanup(&lock->lk_lock);
 	wchan_destroy(lock->lk_wchan);
 
@@ -184,6 +321,11 @@ lock_destroy(struct lock *lock)
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	unsigned i, spins;
+	int level;
+	LOCKSTAT_TIMER(waitstart);
+
 	DEBUGASSERT(lock != NULL);
 	KASSERT(curthread->t_in_interrupt == false);
 
@@ -193,11 +335,43 @@ lock_acquire(struct lock *lock)
 	HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
 
 	KASSERT(lock->lk_holder != curthread);
+	spins = 0;
 	while (lock->lk_holder != NULL) {
-		/* As in the semaphore. */
-		wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+		LOCKSTAT_START(waitstart);
+		if (spins < LOCK_SPIN_MAX && lock_holder_running(lock)) {
+			/*
+			 * Spin (with lk_lock released, so the holder
+			 * can release the lock) until it's let go or
+			 * changed hands, then look again.
+			 */
+			holder = lock->lk_holder;
+			spinlock_release(&lock->lk_lock);
+			for (i = 0; i < LOCK_SPIN_CHECK &&
+				     lock->lk_holder == holder; i++) {
+				/* nothing */
+			}
+			spins += i + 1;
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
+		lock_wait(lock);
+	}
+	if (lock->lk_nwaiters > 0) {
+		/* take on the level of those still waiting */
+		spinlock_acquire(&pi_lock);
+		lock->lk_holder = curthread;
+		level = lock_waitlevel(lock);
+		if (level < curthread->t_inherit) {
+			curthread->t_inherit = level;
+		}
+		spinlock_release(&pi_lock);
 	}
-	lock->lk_holder = curthread;
+	else {
+		lock->lk_holder = curthread;
+	}
+	lock->lk_nextheld = curthread->t_heldlocks;
+	curthread->t_heldlocks = lock;
+	LOCKSTAT_ACQUIRED(&lock->lk_stat, waitstart);
 
 	/* Call this (atomically) once the lock is acquired */
 	HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
@@ -208,12 +382,39 @@ lock_acquire(struct lock *lock)
 void
 lock_release(struct lock *lock)
 {
+	struct thread *cur = curthread;
+	struct lock **lp, *held;
+	int level;
+
 	DEBUGASSERT(lock != NULL);
 
 	spinlock_acquire(&lock->lk_lock);
 
-	KASSERT(lock->lk_holder == curthread);
-	lock->lk_holder = NULL;
+	KASSERT(lock->lk_holder == cur);
+	LOCKSTAT_RELEASED(&lock->lk_stat);
+	for (lp = &cur->t_heldlocks; *lp != lock; lp = &(*lp)->lk_nextheld) {
+		KASSERT(*lp != NULL);
+	}
+	*lp = lock->lk_nextheld;
+	lock->lk_nextheld = NULL;
+
+	if (lock->lk_nwaiters > 0 || cur->t_inherit < SCHED_NLEVELS) {
+		/* back to what the remaining locks' waiters lend us */
+		spinlock_acquire(&pi_lock);
+		lock->lk_holder = NULL;
+		cur->t_inherit = SCHED_NLEVELS;
+		for (held = cur->t_heldlocks; held != NULL;
+		     held = held->lk_nextheld) {
+			level = lock_waitlevel(held);
+			if (level < cur->t_inherit) {
+				cur->t_inherit = level;
+			}
+		}
+		spinlock_release(&pi_lock);
+	}
+	else {
+		lock->lk_holder = NULL;
+	}
 	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
 
 	/* Call this (atomically) when the lock is released */
@@ -265,6 +466,7 @@ cv_create(const char *name)
 	}
 
 	spinlock_init(&cv->cv_wchanlock);
+	LOCKSTAT_INIT(&cv->cv_stat, LOCKSTAT_CV, cv->cv_name);
 	return cv;
 }
 
@@ -283,6 +485,9 @@ cv_destroy(struct cv *cv)
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
+	LOCKSTAT_TIMER(waitstart);
+
+	LOCKSTAT_START(waitstart);
 	spinlock_acquire(&cv->cv_wchanlock);
 	lock_release(lock);
 	wchan_sleep(cv->cv_wchan, &cv->cv_wchanlock);
@@ -295,6 +500,7 @@ cv_wait(struct cv *cv, struct lock *lock)
 	 * logic to make that work cleanly.
 	 */
 	spinlock_release(&cv->cv_wchanlock);
+	LOCKSTAT_CV_WAITED(&cv->cv_stat, waitstart);
 	lock_acquire(lock);
 }
 
@@ -315,3 +521,271 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+/*
+ * Readers and writers wait under rw_lock, on separate wait channels.
+ * Readers are counted in rw_readers, or in a per-cpu lock in the slot
+ * of the cpu they're on. A reader of a per-cpu lock that finds no
+ * writer about only takes the slot's spinlock.
+ *
+ * To keep those readers out a writer sets rw_blockreaders and then
+ * takes and drops each slot lock: a reader that got into a slot
+ * before that is counted in the slot, and any after it sees the flag
+ * and goes the slow way, through rw_lock. A slot reader that lets go
+ * while the flag is set wakes the writers so they can count again.
+ */
+
+static
+struct rwlock *
+rwlock_create_common(const char *name, bool percpu)
+{
+	struct rwlock *rw;
+	unsigned i;
+
+	rw = kmalloc(sizeof(*rw));
+	if (rw == NULL) {
+		return NULL;
+	}
+
+	rw->rwlock_name = kstrdup(name);
+	if (rw->rwlock_name == NULL) {
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_readwchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_readwchan == NULL) {
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+	rw->rw_writewchan = wchan_create(rw->rwlock_name);
+	if (rw->rw_writewchan == NULL) {
+		wchan_destroy(rw->rw_readwchan);
+		kfree(rw->rwlock_name);
+		kfree(rw);
+		return NULL;
+	}
+
+	rw->rw_slots = NULL;
+	if (percpu) {
+		rw->rw_slots = kmalloc(RWLOCK_NSLOTS *
+				       sizeof(struct rwlock_slot));
+		if (rw->rw_slots == NULL) {
+			wchan_destroy(rw->rw_writewchan);
+			wchan_destroy(rw->rw_readwchan);
+			kfree(rw->rwlock_name);
+			kfree(rw);
+			return NULL;
+		}
+		for (i=0; i<RWLOCK_NSLOTS; i++) {
+			spinlock_init(&rw->rw_slots[i].rws_lock);
+			rw->rw_slots[i].rws_readers = 0;
+		}
+	}
+
+	spinlock_init(&rw->rw_lock);
+	rw->rw_readers = 0;
+	rw->rw_waitwriters = 0;
+	rw->rw_writer = NULL;
+	rw->rw_blockreaders = false;
+
+	return rw;
+}
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	return rwlock_create_common(name, false);
+}
+
+struct rwlock *
+rwlock_create_percpu(const char *name)
+{
+	return rwlock_create_common(name, true);
+}
+
+/*
+ * The slot for readers on the current cpu. We might move to another
+ * cpu right after looking, but that only costs some sharing; readers
+ * are only ever counted up as a total.
+ */
+static
+struct rwlock_slot *
+rwlock_myslot(struct rwlock *rw)
+{
+	return &rw->rw_slots[curcpu->c_number % RWLOCK_NSLOTS];
+}
+
+/*
+ * Number of readers holding the lock. Called with rw_lock held.
+ */
+static
+int
+rwlock_countreaders(struct rwlock *rw)
+{
+	struct rwlock_slot *slot;
+	int count;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&rw->rw_lock));
+
+	count = rw->rw_readers;
+	if (rw->rw_slots != NULL) {
+		for (i=0; i<RWLOCK_NSLOTS; i++) {
+			slot = &rw->rw_slots[i];
+			spinlock_acquire(&slot->rws_lock);
+			count += slot->rws_readers;
+			spinlock_release(&slot->rws_lock);
+		}
+	}
+	KASSERT(count >= 0);
+	return count;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+	unsigned i;
+
+	KASSERT(rw != NULL);
+	KASSERT(rw->rw_writer == NULL);
+	KASSERT(rw->rw_waitwriters == 0);
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rwlock_countreaders(rw) == 0);
+	spinlock_release(&rw->rw_lock);
+
+	if (rw->rw_slots != NULL) {
+		for (i=0; i<RWLOCK_NSLOTS; i++) {
+			spinlock_cleanup(&rw->rw_slots[i].rws_lock);
+		}
+		kfree(rw->rw_slots);
+	}
+	spinlock_cleanup(&rw->rw_lock);
+	wchan_destroy(rw->rw_writewchan);
+	wchan_destroy(rw->rw_readwchan);
+
+	kfree(rw->rwlock_name);
+	kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+	struct rwlock_slot *slot;
+
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	if (rw->rw_slots != NULL) {
+		slot = rwlock_myslot(rw);
+		spinlock_acquire(&slot->rws_lock);
+		if (!rw->rw_blockreaders) {
+			slot->rws_readers++;
+			spinlock_release(&slot->rws_lock);
+			return;
+		}
+		spinlock_release(&slot->rws_lock);
+	}
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+	while (rw->rw_writer != NULL || rw->rw_waitwriters > 0) {
+		wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+	}
+	if (rw->rw_slots != NULL) {
+		slot = rwlock_myslot(rw);
+		spinlock_acquire(&slot->rws_lock);
+		slot->rws_readers++;
+		spinlock_release(&slot->rws_lock);
+	}
+	else {
+		rw->rw_readers++;
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+	struct rwlock_slot *slot;
+	bool wake;
+
+	DEBUGASSERT(rw != NULL);
+
+	if (rw->rw_slots != NULL) {
+		slot = rwlock_myslot(rw);
+		spinlock_acquire(&slot->rws_lock);
+		slot->rws_readers--;
+		wake = rw->rw_blockreaders;
+		spinlock_release(&slot->rws_lock);
+
+		if (wake) {
+			spinlock_acquire(&rw->rw_lock);
+			wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+			spinlock_release(&rw->rw_lock);
+		}
+		return;
+	}
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_readers > 0);
+	rw->rw_readers--;
+	if (rw->rw_readers == 0 && rw->rw_waitwriters > 0) {
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+	unsigned i;
+
+	DEBUGASSERT(rw != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer != curthread);
+
+	rw->rw_waitwriters++;
+	if (rw->rw_slots != NULL && !rw->rw_blockreaders) {
+		/* close the per-cpu fast path; see above */
+		rw->rw_blockreaders = true;
+		for (i=0; i<RWLOCK_NSLOTS; i++) {
+			spinlock_acquire(&rw->rw_slots[i].rws_lock);
+			spinlock_release(&rw->rw_slots[i].rws_lock);
+		}
+	}
+	while (rw->rw_writer != NULL || rwlock_countreaders(rw) > 0) {
+		wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+	}
+	rw->rw_waitwriters--;
+	rw->rw_writer = curthread;
+
+	spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+	DEBUGASSERT(rw != NULL);
+
+	spinlock_acquire(&rw->rw_lock);
+	KASSERT(rw->rw_writer == curthread);
+	rw->rw_writer = NULL;
+
+	if (rw->rw_waitwriters > 0) {
+		/* writers first */
+		wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+	}
+	else {
+		rw->rw_blockreaders = false;
+		wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+	}
+	spinlock_release(&rw->rw_lock);
+}
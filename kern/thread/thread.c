@@ -35,10 +35,13 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
 #include <array.h>
+#include <clock.h>
 #include <cpu.h>
 #include <spl.h>
 #include <spinlock.h>
@@ -72,6 +75,13 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/* Scheduler helpers; see schedule() below. */
+static int thread_nicelevel(int nice);
+static unsigned thread_quantum(int level);
+static void runqueue_insert(struct threadlist *rq, struct thread *t);
+static bool thread_steal(unsigned mincount);
+static void thread_kick_idle(struct cpu *busy);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -145,11 +155,24 @@ thread_create(const char *name)
 	thread->t_proc = NULL;
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
+	/* Scheduling fields */
+	thread->t_basepri = thread_nicelevel(0);
+	thread->t_priority = thread->t_basepri;
+	thread->t_slice = thread_quantum(thread->t_priority);
+	thread->t_agerounds = 0;
+	thread->t_lastran = 0;
+	thread->t_inherit = SCHED_NLEVELS;
+	thread->t_waitlock = NULL;
+	thread->t_waitlevel = 0;
+	thread->t_heldlocks = NULL;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	thread->t_copyslow = false;
+
 	/* If you add to struct thread, be sure to initialize here */
 
 	return thread;
@@ -181,15 +204,23 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_tickcredit = 0;
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
-	spinlock_init(&c->c_runqueue_lock);
+	spinlock_init_ticket(&c->c_runqueue_lock);
+	c->c_runqsum = 0;
+	c->c_idleclocks = 0;
+	c->c_steals = 0;
+	c->c_stolen = 0;
+	c->c_tickdefer = 1;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
 	spinlock_init(&c->c_ipi_lock);
+	c->c_tlbas = NULL;
+	c->c_shootdown_serial = 0;
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -469,7 +500,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_insert(&targetcpu->c_runqueue, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -478,6 +509,25 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (targetcpu->c_tickdefer > 1) {
+		/*
+		 * It was running its only thread without a tick; it
+		 * needs one again to share the cpu with this one.
+		 */
+		if (targetcpu == curcpu->c_self) {
+			hardclock_resume();
+		}
+		else {
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+	}
+	else if (!targetcpu->c_isidle) {
+		/*
+		 * Idle cpus no longer tick to look for work to steal;
+		 * tell one there's some here.
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -523,6 +573,11 @@ thread_fork(const char *name,
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
 
+	/* Same nice as the parent, starting fresh at the top of it */
+	newthread->t_basepri = curthread->t_basepri;
+	newthread->t_priority = newthread->t_basepri;
+	newthread->t_slice = thread_quantum(newthread->t_priority);
+
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
 		proc = curthread->t_proc;
@@ -597,6 +652,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		return;
 	}
 
+	/* For work stealing to judge how warm its cache is */
+	cur->t_lastran = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -646,12 +704,18 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
+			/* stop ticking while idle */
+			hardclock_defer(true);
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal(1)) {
+				cpu_idle();
+			}
+			hardclock_resume();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	next->t_agerounds = 0;
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -821,139 +885,374 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each thread is at one of
+ * SCHED_NLEVELS priority levels, 0 being the highest, and each cpu's
+ * run queue is kept sorted by level (see runqueue_insert); within a
+ * level threads take turns. So the levels are one list rather than a
+ * list each, which keeps the migration code below and everything
+ * else that takes threads off the run queue unchanged.
+ *
+ *    - A thread that uses up its time slice (thread_tick) moves down
+ *      a level. Lower levels get longer slices.
+ *    - A thread woken up from a wait channel moves up a level, so
+ *      threads that mostly wait for I/O stay near the top.
+ *    - A thread left waiting on the run queue for SCHED_AGE_ROUNDS
+ *      calls of schedule() moves up a level, so nothing starves.
+ *
+ * No thread goes above its base level, which comes from the nice
+ * value of its process (setpriority).
+ */
+
+/*
+ * Base level for a nice value.
+ */
+static
+int
+thread_nicelevel(int nice)
+{
+	KASSERT(nice >= PRIO_MIN && nice <= PRIO_MAX);
+	return (nice - PRIO_MIN) * SCHED_NBASE / (PRIO_MAX - PRIO_MIN + 1);
+}
+
+/*
+ * Time slice, in hardclocks, for a level.
+ */
+static
+unsigned
+thread_quantum(int level)
+{
+	return 1U << (level / 2);
+}
+
+/*
+ * Level a thread is scheduled at.
+ */
+int
+thread_schedlevel(const struct thread *t)
+{
+	return t->t_inherit < t->t_priority ? t->t_inherit : t->t_priority;
+}
+
+/*
+ * Put a ready thread on a run queue, after everything at the same or
+ * a higher level. The run queue must be locked.
+ *
+ * Search from the back, as the CPU-bound threads that come through
+ * here most often are near it.
+ */
+static
+void
+runqueue_insert(struct threadlist *rq, struct thread *t)
+{
+	struct thread *pos;
+
+	THREADLIST_FORALL_REV(pos, *rq) {
+		if (thread_schedlevel(pos) <= thread_schedlevel(t)) {
+			threadlist_insertafter(rq, pos, t);
+			return;
+		}
+	}
+	threadlist_addhead(rq, t);
+}
+
+/*
+ * Move a thread up a level when it wakes up, with a new time slice.
+ */
+static
+void
+thread_wakeup_boost(struct thread *t)
+{
+	if (t->t_priority > t->t_basepri) {
+		t->t_priority--;
+	}
+	else {
+		t->t_priority = t->t_basepri;
+	}
+	t->t_slice = thread_quantum(t->t_priority);
+	t->t_agerounds = 0;
+}
+
+/*
+ * Called from hardclock() for the TICKS periods since the last one.
+ * Charge the current thread; if its slice is used up, move it down a
+ * level and have it yield. Otherwise it only yields to a thread at a
+ * higher level. If there's nothing else to run, there's no need for
+ * hardclocks either until migration next looks for work.
  */
+bool
+thread_tick(unsigned ticks)
+{
+	struct thread *cur = curthread;
+	struct thread *next;
+	bool expired, preempt;
 
+	/* load statistics; the unlocked read is close enough */
+	curcpu->c_runqsum += (uint64_t)curcpu->c_runqueue.tl_count * ticks;
+	if (curcpu->c_isidle) {
+		curcpu->c_idleclocks += ticks;
+		return false;
+	}
+
+	expired = cur->t_slice <= ticks;
+	if (expired) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_slice = thread_quantum(cur->t_priority);
+	}
+	else {
+		cur->t_slice -= ticks;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	next = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	if (next == NULL) {
+		hardclock_defer(false);
+		preempt = false;
+	}
+	else {
+		preempt = expired ||
+			thread_schedlevel(next) < thread_schedlevel(cur);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return preempt;
+}
+
+/*
+ * This is called periodically from hardclock(). Age the threads
+ * waiting on the current CPU's run queue and re-sort it if any of
+ * them moved, or were lent a level (see synch.c) while waiting.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlist requeue;
+	struct thread *t;
+	bool moved = false;
+	int prevlevel = 0;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	THREADLIST_FORALL(t, curcpu->c_runqueue) {
+		if (thread_schedlevel(t) < prevlevel) {
+			moved = true;
+		}
+		prevlevel = thread_schedlevel(t);
+
+		if (t->t_priority < t->t_basepri) {
+			/* reniced while waiting */
+			t->t_priority = t->t_basepri;
+		}
+		else if (t->t_priority > t->t_basepri &&
+			 ++t->t_agerounds >= SCHED_AGE_ROUNDS) {
+			t->t_priority--;
+		}
+		else {
+			continue;
+		}
+		t->t_agerounds = 0;
+		t->t_slice = thread_quantum(t->t_priority);
+		moved = true;
+	}
+
+	if (moved) {
+		threadlist_init(&requeue);
+		while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+			threadlist_addtail(&requeue, t);
+		}
+		while ((t = threadlist_remhead(&requeue)) != NULL) {
+			runqueue_insert(&curcpu->c_runqueue, t);
+		}
+		threadlist_cleanup(&requeue);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
- * Thread migration.
+ * Set a thread's base level from a nice value. If it's waiting it
+ * moves at the next schedule(); the current thread moves now.
+ */
+void
+thread_setnice(struct thread *t, int nice)
+{
+	t->t_basepri = thread_nicelevel(nice);
+	if (t == curthread && t->t_priority < t->t_basepri) {
+		t->t_priority = t->t_basepri;
+		t->t_slice = thread_quantum(t->t_priority);
+	}
+}
+
+/*
+ * Thread migration, by work stealing.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * A cpu that runs out of threads takes one from the busiest other cpu
+ * before going idle (in thread_switch). Idle cpus don't tick, so when
+ * a thread is queued on a busy cpu an idle one is woken up to try
+ * again (thread_kick_idle). That leaves cpus that are busy but have
+ * less to do than others: every MIGRATE_HARDCLOCKS each cpu also takes
+ * a thread if the busiest has at least two more waiting
+ * (thread_consider_migration).
  *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * Only one run queue is locked at a time. The victim is chosen by
+ * reading queue lengths without locks, which is good enough to pick
+ * one; then its lock is taken to remove the thread, and dropped
+ * before ours is taken to add it.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * A thread that ran in the last STEAL_HOT_HARDCLOCKS probably still
+ * has its working set in its cpu's cache, which moving it would lose,
+ * so the first STEAL_SCAN threads of the victim's queue are searched
+ * for one that hasn't; failing that the first one is taken anyway.
+ * (Well, System/161 doesn't model caches, but the principle stands.)
  */
-void
-thread_consider_migration(void)
+#define STEAL_HOT_HARDCLOCKS	2
+#define STEAL_SCAN		8
+
+/*
+ * Find the cpu other than this one with the most threads waiting.
+ */
+static
+struct cpu *
+thread_busiest_cpu(unsigned *ret_count)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct cpu *c, *busiest;
+	unsigned i, numcpus, count;
 
-	my_count = total_count = 0;
+	busiest = NULL;
+	*ret_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
 		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+			continue;
+		}
+		count = c->c_runqueue.tl_count;
+		if (count > *ret_count) {
+			busiest = c;
+			*ret_count = count;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	return busiest;
+}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
-	}
+/*
+ * Take a thread off the busiest other cpu's run queue and put it on
+ * ours, if that cpu has at least MINCOUNT waiting. Returns true if we
+ * got one. Must be called with no spinlocks held.
+ */
+static
+bool
+thread_steal(unsigned mincount)
+{
+	struct cpu *victim;
+	struct thread *t, *pick;
+	unsigned count, scanned;
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	victim = thread_busiest_cpu(&count);
+	if (victim == NULL || count < mincount || count == 0) {
+		return false;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+	pick = NULL;
+	scanned = 0;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	THREADLIST_FORALL(t, victim->c_runqueue) {
+		if (scanned++ == STEAL_SCAN) {
+			break;
+		}
+		/*
+		 * The victim's curthread can be on its own run queue:
+		 * if it went to sleep, the cpu went idle (so it stayed
+		 * curthread, and is still running in cpu_idle on its
+		 * stack), and then it was woken up. Moving it now would
+		 * have two cpus on one stack, so leave it be.
+		 */
+		if (t == victim->c_curthread) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		if (pick == NULL) {
+			pick = t;
+		}
+		if (victim->c_hardclocks - t->t_lastran >=
+		    STEAL_HOT_HARDCLOCKS) {
+			pick = t;
+			break;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+	if (pick != NULL) {
+		threadlist_remove(&victim->c_runqueue, pick);
+		victim->c_stolen++;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+	if (pick == NULL) {
+		return false;
+	}
+
+	/* It's on no queue now, so nobody else can get at it. */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	pick->t_cpu = curcpu->c_self;
+	runqueue_insert(&curcpu->c_runqueue, pick);
+	curcpu->c_steals++;
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      pick->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
+/*
+ * Wake up an idle cpu, other than BUSY, so it can steal from BUSY.
+ * The idle flags are read without locks; at worst a cpu wakes up for
+ * nothing or the thread waits for BUSY to get to it.
+ */
+static
+void
+thread_kick_idle(struct cpu *busy)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+}
+
+/*
+ * Called periodically from hardclock(): even out the load between
+ * busy cpus.
+ */
+void
+thread_consider_migration(void)
+{
+	thread_steal(curcpu->c_runqueue.tl_count + 2);
+}
+
+/*
+ * Print the load balancing counters of each cpu.
+ */
+void
+thread_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus, hardclocks;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	kprintf("cpu hardclocks  idle%%  avg runq  steals  stolen\n");
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		hardclocks = c->c_hardclocks ? c->c_hardclocks : 1;
+		kprintf("%3u %10u %6u %5llu.%02llu %7u %7u\n",
+			c->c_number, c->c_hardclocks,
+			c->c_idleclocks * 100 / hardclocks,
+			c->c_runqsum / hardclocks,
+			c->c_runqsum * 100 / hardclocks % 100,
+			c->c_steals, c->c_stolen);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1036,6 +1335,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 		/* Nobody was sleeping. */
 		return;
 	}
+	thread_wakeup_boost(target);
 
 	/*
 	 * Note that thread_make_runnable acquires a runqueue lock
@@ -1075,6 +1375,7 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wakeup_boost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1134,32 +1435,46 @@ ipi_broadcast(int code)
 }
 
 /*
- * Send a TLB shootdown IPI to the specified CPU.
+ * Queue a TLB shootdown on the specified CPU. The target's IPI lock
+ * must be held.
+ *
+ * If the queue is full, rather than panicking, collapse it into a
+ * single request to flush the whole TLB; any further requests are
+ * then already covered by that and are dropped.
  */
+static
 void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+tlbshootdown_queue(struct cpu *target, const struct tlbshootdown *mapping)
 {
 	unsigned n;
 
-	spinlock_acquire(&target->c_ipi_lock);
+	KASSERT(spinlock_do_i_hold(&target->c_ipi_lock));
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+	if (n > 0 && target->c_shootdown[0].ts_vaddr == TLBSHOOTDOWN_ALL) {
+		/* already flushing everything */
+		return;
+	}
+	if (n == TLBSHOOTDOWN_MAX || mapping->ts_vaddr == TLBSHOOTDOWN_ALL) {
+		target->c_shootdown[0].ts_as = NULL;
+		target->c_shootdown[0].ts_vaddr = TLBSHOOTDOWN_ALL;
+		target->c_numshootdown = 1;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
 		target->c_numshootdown = n+1;
 	}
+}
+
+/*
+ * Send a TLB shootdown IPI to the specified CPU.
+ */
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	spinlock_acquire(&target->c_ipi_lock);
+
+	tlbshootdown_queue(target, mapping);
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
@@ -1167,6 +1482,61 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send a batch of TLB shootdowns for address space AS to every other
+ * CPU that might have AS in its TLB, then wait until each of them has
+ * processed its queue.
+ *
+ * A CPU that has switched to another address space since we looked
+ * flushed its TLB when it did, so it isn't sent anything. Each target
+ * gets the whole batch with a single interrupt.
+ *
+ * We wait for the CPUs one at a time; the caller must not hold any
+ * spinlocks, as the target may need to take them before it gets
+ * around to handling the interrupt, and must have interrupts on, or
+ * two CPUs shooting down at each other would both spin forever
+ * without taking the other's interrupt.
+ */
+unsigned
+ipi_tlbshootdown_as(struct addrspace *as, const struct tlbshootdown *mappings,
+		    unsigned num)
+{
+	unsigned i, j, serial, sent;
+	struct cpu *c;
+
+	KASSERT(as != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(curthread->t_curspl == 0);
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	sent = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+
+		spinlock_acquire(&c->c_ipi_lock);
+		if (c->c_tlbas != as) {
+			spinlock_release(&c->c_ipi_lock);
+			continue;
+		}
+		for (j=0; j<num; j++) {
+			tlbshootdown_queue(c, &mappings[j]);
+		}
+		serial = c->c_shootdown_serial;
+		c->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(c);
+		spinlock_release(&c->c_ipi_lock);
+
+		while (c->c_shootdown_serial == serial) {
+			/* spin until the target gets to it */
+		}
+		sent++;
+	}
+	return sent;
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -1199,8 +1569,10 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt; it only needs its tick back if it was
+		 * running without one.
 		 */
+		hardclock_resume();
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		/*
@@ -1212,6 +1584,8 @@ interprocessor_interrupt(void)
 			vm_tlbshootdown(&curcpu->c_shootdown[i]);
 		}
 		curcpu->c_numshootdown = 0;
+		/* Let anyone waiting in ipi_tlbshootdown_as go */
+		curcpu->c_shootdown_serial++;
 	}
 
 	curcpu->c_ipi_pending = 0;
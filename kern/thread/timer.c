@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Kernel timers.
+ *
+ * Pending timers live in a hierarchical timer wheel: TIMER_LEVELS
+ * levels of TIMER_SLOTS lists each. Level 0 has a slot for each of
+ * the next TIMER_SLOTS ticks; each slot of level 1 covers TIMER_SLOTS
+ * ticks, and so on. A timer goes in the lowest level whose range
+ * reaches its expiry time. Each tick runs the level 0 slot for that
+ * tick, and each time a level's slots wrap around the next slot up is
+ * emptied and its timers put back in, lower down ("cascading"). So
+ * arming, cancelling and firing are constant time, and a tick only
+ * looks at timers that are due or being cascaded.
+ *
+ * Timers further off than the wheel reaches go in the top level and
+ * are put back there until they get within range.
+ *
+ * Time is counted in hardclock periods, read off the real time clock
+ * (timer_clock) rather than by counting hardclocks, since cpus skip
+ * hardclocks while tickless. The wheel is run by one cpu, the boot
+ * cpu, from its hardclock; timer_now is the tick it has got up to.
+ * When that cpu goes tickless it stops at the next tick something is
+ * due (timer_defer), and arming an earlier timer brings it back.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <clock.h>
+#include <current.h>
+#include <timer.h>
+
+#define TIMER_LEVELS	4
+#define TIMER_BITS	6
+#define TIMER_SLOTS	(1 << TIMER_BITS)
+#define TIMER_MASK	(TIMER_SLOTS - 1)
+
+/* Furthest ahead the wheel can place a timer */
+#define TIMER_RANGE	((uint64_t)1 << (TIMER_BITS * TIMER_LEVELS))
+
+/* Nanoseconds per hardclock */
+#define TIMER_NSEC	(1000000000 / HZ)
+
+static struct spinlock timer_lock = SPINLOCK_INITIALIZER;
+static struct timer *timer_wheel[TIMER_LEVELS][TIMER_SLOTS];
+static uint64_t timer_now;		/* tick the wheel has run to */
+static unsigned timer_count;		/* number of timers pending */
+static uint64_t timer_wakeup;		/* tick the timer cpu next runs it */
+static struct cpu *timer_cpu;		/* cpu that runs the wheel */
+
+/*
+ * Setup.
+ */
+void
+timer_bootstrap(void)
+{
+	timer_cpu = curcpu->c_self;
+}
+
+/*
+ * The current time in hardclock periods.
+ */
+static
+uint64_t
+timer_clock(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * HZ + ts.tv_nsec / TIMER_NSEC;
+}
+
+/*
+ * Hardclock periods at least as long as TS.
+ */
+unsigned
+timer_ticks(const struct timespec *ts)
+{
+	uint64_t ticks;
+
+	ticks = (uint64_t)ts->tv_sec * HZ +
+		(ts->tv_nsec + TIMER_NSEC - 1) / TIMER_NSEC;
+	if (ticks > 0xffffffff) {
+		ticks = 0xffffffff;
+	}
+	return ticks;
+}
+
+/*
+ * Put a timer in its slot of the wheel. The wheel must be locked.
+ */
+static
+void
+timer_insert(struct timer *t)
+{
+	uint64_t expires, delta;
+	struct timer **slot;
+	unsigned level;
+
+	expires = t->tm_expires;
+	if (expires < timer_now) {
+		/* late; the slot for now is run next */
+		expires = timer_now;
+	}
+	delta = expires - timer_now;
+	if (delta >= TIMER_RANGE) {
+		expires = timer_now + TIMER_RANGE - 1;
+		delta = TIMER_RANGE - 1;
+	}
+
+	for (level = 0; level < TIMER_LEVELS - 1; level++) {
+		if (delta < (uint64_t)1 << (TIMER_BITS * (level + 1))) {
+			break;
+		}
+	}
+	slot = &timer_wheel[level][(expires >> (TIMER_BITS * level)) &
+				   TIMER_MASK];
+
+	t->tm_next = *slot;
+	if (t->tm_next != NULL) {
+		t->tm_next->tm_prevp = &t->tm_next;
+	}
+	t->tm_prevp = slot;
+	*slot = t;
+}
+
+/*
+ * Take a timer out of the wheel. The wheel must be locked.
+ */
+static
+void
+timer_remove(struct timer *t)
+{
+	*t->tm_prevp = t->tm_next;
+	if (t->tm_next != NULL) {
+		t->tm_next->tm_prevp = t->tm_prevp;
+	}
+	t->tm_next = NULL;
+	t->tm_prevp = NULL;
+}
+
+/*
+ * Empty a slot of the wheel, returning what was in it.
+ */
+static
+struct timer *
+timer_takeslot(unsigned level, unsigned index)
+{
+	struct timer *list;
+
+	list = timer_wheel[level][index];
+	timer_wheel[level][index] = NULL;
+	return list;
+}
+
+/*
+ * Move the wheel on one tick and return the timers that are due,
+ * linked through tm_next. The wheel must be locked.
+ */
+static
+struct timer *
+timer_advance(void)
+{
+	struct timer *t, *list, *due;
+	unsigned level;
+
+	timer_now++;
+
+	/* cascade each level whose lower neighbour wrapped around */
+	for (level = 1; level < TIMER_LEVELS; level++) {
+		if ((timer_now >> (TIMER_BITS * (level - 1)) & TIMER_MASK)
+		    != 0) {
+			break;
+		}
+		list = timer_takeslot(level, (timer_now >>
+					      (TIMER_BITS * level)) &
+				      TIMER_MASK);
+		while ((t = list) != NULL) {
+			list = t->tm_next;
+			timer_insert(t);
+		}
+	}
+
+	due = timer_takeslot(0, timer_now & TIMER_MASK);
+	for (t = due; t != NULL; t = t->tm_next) {
+		KASSERT(t->tm_expires <= timer_now);
+		t->tm_pending = false;
+		t->tm_prevp = NULL;
+		timer_count--;
+	}
+	return due;
+}
+
+/*
+ * Called from hardclock() on the timer cpu: run the wheel up to the
+ * current time, calling the functions of the timers that are due
+ * with the wheel unlocked.
+ */
+void
+timer_hardclock(void)
+{
+	struct timer *due, *next;
+	uint64_t now;
+
+	KASSERT(curcpu->c_self == timer_cpu);
+
+	spinlock_acquire(&timer_lock);
+	if (timer_count == 0) {
+		/* nothing to do; the wheel catches up in timer_arm */
+		spinlock_release(&timer_lock);
+		return;
+	}
+	now = timer_clock();
+	while (timer_now < now && timer_count > 0) {
+		due = timer_advance();
+		if (due == NULL) {
+			continue;
+		}
+		spinlock_release(&timer_lock);
+		for (; due != NULL; due = next) {
+			next = due->tm_next;
+			due->tm_next = NULL;
+			due->tm_func(due->tm_data);
+		}
+		spinlock_acquire(&timer_lock);
+	}
+	if (timer_count == 0) {
+		timer_now = now;
+	}
+	timer_wakeup = timer_now + 1;
+	spinlock_release(&timer_lock);
+}
+
+/*
+ * Called by hardclock_defer on the timer cpu when it wants to skip
+ * NTICKS hardclocks: returns how many it can, up to the next tick a
+ * timer is due or a slot has to be cascaded.
+ */
+unsigned
+timer_defer(unsigned nticks)
+{
+	unsigned i, wrap, lag;
+
+	KASSERT(curcpu->c_self == timer_cpu);
+
+	spinlock_acquire(&timer_lock);
+	if (timer_count > 0) {
+		/* level 0 wrapping around means cascading */
+		wrap = TIMER_SLOTS - (timer_now & TIMER_MASK);
+		for (i = 1; i < wrap && i < nticks; i++) {
+			if (timer_wheel[0][(timer_now + i) & TIMER_MASK]
+			    != NULL) {
+				break;
+			}
+		}
+		if (i < nticks) {
+			nticks = i;
+		}
+		/* the wheel may be a little behind the clock */
+		lag = timer_clock() - timer_now;
+		nticks = nticks > lag + 1 ? nticks - lag : 1;
+	}
+	timer_wakeup = timer_now + nticks;
+	spinlock_release(&timer_lock);
+	return nticks;
+}
+
+/*
+ * Set up a timer.
+ */
+void
+timer_init(struct timer *t, void (*func)(void *), void *data)
+{
+	t->tm_next = NULL;
+	t->tm_prevp = NULL;
+	t->tm_expires = 0;
+	t->tm_func = func;
+	t->tm_data = data;
+	t->tm_pending = false;
+}
+
+/*
+ * Arm a timer.
+ */
+void
+timer_arm(struct timer *t, unsigned ticks)
+{
+	uint64_t now;
+	bool kick;
+	int spl;
+
+	KASSERT(ticks > 0);
+
+	spinlock_acquire(&timer_lock);
+	now = timer_clock();
+	if (timer_count == 0 && timer_now < now) {
+		/* empty wheel; just move it up to date */
+		timer_now = now;
+	}
+	if (t->tm_pending) {
+		timer_remove(t);
+		timer_count--;
+	}
+	t->tm_expires = now + ticks;
+	t->tm_pending = true;
+	timer_insert(t);
+	timer_count++;
+
+	/* if the timer cpu is tickless past this, wake it up */
+	kick = timer_cpu != NULL && t->tm_expires < timer_wakeup;
+	if (kick) {
+		timer_wakeup = timer_now + 1;
+	}
+	spinlock_release(&timer_lock);
+
+	if (kick) {
+		if (curcpu->c_self == timer_cpu) {
+			spl = splhigh();
+			hardclock_resume();
+			splx(spl);
+		}
+		else {
+			ipi_send(timer_cpu, IPI_UNIDLE);
+		}
+	}
+}
+
+/*
+ * Disarm a timer.
+ */
+bool
+timer_cancel(struct timer *t)
+{
+	bool pending;
+
+	spinlock_acquire(&timer_lock);
+	pending = t->tm_pending;
+	if (pending) {
+		timer_remove(t);
+		t->tm_pending = false;
+		timer_count--;
+	}
+	spinlock_release(&timer_lock);
+	return pending;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Sleeping on a timer.
+ *
+ * Each sleeper has a wait channel of its own, so the timer wakes
+ * only the thread whose time is up.
+ */
+
+struct timer_sleeper {
+	struct wchan *ts_wchan;
+	struct spinlock ts_lock;
+	bool ts_done;
+};
+
+static
+void
+timer_wakeup_sleeper(void *data)
+{
+	struct timer_sleeper *ts = data;
+
+	spinlock_acquire(&ts->ts_lock);
+	ts->ts_done = true;
+	wchan_wakeone(ts->ts_wchan, &ts->ts_lock);
+	spinlock_release(&ts->ts_lock);
+}
+
+int
+timer_sleep(unsigned ticks)
+{
+	struct timer_sleeper ts;
+	struct timer t;
+
+	if (ticks == 0) {
+		return 0;
+	}
+
+	ts.ts_wchan = wchan_create("timer");
+	if (ts.ts_wchan == NULL) {
+		return ENOMEM;
+	}
+	spinlock_init(&ts.ts_lock);
+	ts.ts_done = false;
+	timer_init(&t, timer_wakeup_sleeper, &ts);
+
+	spinlock_acquire(&ts.ts_lock);
+	/* the tick we're part way through doesn't count */
+	timer_arm(&t, ticks < 0xffffffff ? ticks + 1 : ticks);
+	while (!ts.ts_done) {
+		wchan_sleep(ts.ts_wchan, &ts.ts_lock);
+	}
+	/* the timer function is done with ts once we have the lock */
+	spinlock_release(&ts.ts_lock);
+
+	spinlock_cleanup(&ts.ts_lock);
+	wchan_destroy(ts.ts_wchan);
+	return 0;
+}
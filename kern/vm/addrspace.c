@@ -33,15 +33,23 @@
 #include <spl.h>
 #include <spinlock.h>
 #include <current.h>
+#include <cpu.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
+#include <synch.h>
+#include <coreswap.h>
+#include <readahead.h>
+#include <ksm.h>
+#include <vnode.h>
+#include <limits.h>
 
 #include <elf.h>
 #include <list.h>
 
-#define APPLICATION_STACK_SIZE 18*PAGE_SIZE
+// room for the program's own stack on top of an argv block of ARG_MAX
+#define APPLICATION_STACK_SIZE (16*PAGE_SIZE + ARG_MAX)
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -52,9 +60,15 @@
  *
  */
 
+// Limits for address spaces with nothing to inherit them from, in pages; 0 is no limit
+static unsigned default_rss_limit = 0;
+static unsigned default_vsize_limit = 0;
+static struct spinlock limit_lock = SPINLOCK_INITIALIZER;
+
 static int convert_to_pages(size_t memsize);
 static struct as_region_metadata* as_create_region(void);
-static int build_pagetable_link(pid_t pid, vaddr_t vaddr, size_t filepages, int writeable);
+static int build_pagetable_link(pid_t pid, vaddr_t vaddr, size_t filepages, int writeable,
+                                vaddr_t data_start, size_t data_len);
 static void loop_through_region(struct addrspace *as);
 static void copy_region(struct as_region_metadata *old, struct as_region_metadata *new)
 {
@@ -63,13 +77,39 @@ static void copy_region(struct as_region_metadata *old, struct as_region_metadat
     new->npages = old->npages;
     new->rwxflag = old->rwxflag;
     new->type = old->type;
+    new->advice = old->advice;
+    new->ra_last = old->ra_last;
+    new->ra_stride = old->ra_stride;
+    new->ra_window = old->ra_window;
+    new->ra_ahead = old->ra_ahead;
+    new->region_vnode = old->region_vnode;
+    new->region_offset = old->region_offset;
+    if (new->region_vnode != NULL)
+    {
+        VOP_INCREF(new->region_vnode);
+    }
     // The new link is created in the as_add_region_to_list function
 }
+static void as_free_region(struct as_region_metadata *region)
+{
+    if (region->region_vnode != NULL)
+    {
+        VOP_DECREF(region->region_vnode);
+    }
+    kfree(region);
+}
 static void as_set_region(struct as_region_metadata *region, vaddr_t vaddr, size_t memsize, char perm)
 {
     region->region_vaddr = vaddr;
     region->npages = convert_to_pages(memsize);
     region->rwxflag = perm;
+    region->advice = MADV_NORMAL;
+    region->ra_last = 0;
+    region->ra_stride = 0;
+    region->ra_window = 0;
+    region->ra_ahead = 0;
+    region->region_vnode = NULL;
+    region->region_offset = 0;
 
     if ( (perm & PF_R) != 0 && (perm & PF_W) != 0 && (perm & PF_X) == 0 )
     {
@@ -88,18 +128,19 @@ static void as_set_region(struct as_region_metadata *region, vaddr_t vaddr, size
 }
 static void as_add_region_to_list(struct addrspace *as,struct as_region_metadata *temp)
 {
-    // Add region entry into the data structure
-    /* if (as->list == NULL) */
-    /* { */
-    /*     // If first region then init temp to point to itself */
-    /*     INIT_LIST_HEAD(&(temp->link)); */
-    /*     as->list = temp; */
-    /* } */
-    /* else */
+    // Add region entry into the data structure, keeping the list sorted by vaddr;
+    // as_advise, as_protect and as_merge_regions walk neighbouring regions in list order
+    struct as_region_metadata *cur = NULL;
+    list_for_each_entry(cur, &(as->list->head), link)
     {
-        // If not the first entry then add to the queue
-        list_add_tail( &(temp->link), &(as->list->head) );
+        if (cur->region_vaddr > temp->region_vaddr)
+        {
+            // goes in just before cur
+            list_add_tail( &(temp->link), &(cur->link) );
+            return;
+        }
     }
+    list_add_tail( &(temp->link), &(as->list->head) );
 }
 
 struct addrspace *
@@ -112,27 +153,56 @@ as_create(void)
         return NULL;
     }
     as->list = kmalloc(sizeof(struct list));
+    if (as->list == NULL) {
+        kfree(as);
+        return NULL;
+    }
     INIT_LIST_HEAD(&(as->list->head));
+    as->pt_data = NULL;
+    if (pt_as_create(as) != 0) {
+        kfree(as->list);
+        kfree(as);
+        return NULL;
+    }
+    as->is_loading = 0;
+    as->rss = 0;
+    as->vsize = 0;
+    as->recycle_from = NULL;
+    as->recycle_region = NULL;
+    as->recycle_page = 0;
+    as->recycle_taken = 0;
+
+    // limits carry over from the address space being forked or exec'd over
+    struct addrspace *cur = proc_getas();
+    if (cur != NULL)
+    {
+        as->rss_limit = cur->rss_limit;
+        as->vsize_limit = cur->vsize_limit;
+    }
+    else
+    {
+        as_get_default_limits(&as->rss_limit, &as->vsize_limit);
+    }
     return as;
 }
 
 static int alloc_and_copy_frame(struct addrspace *newas, struct as_region_metadata *region, pid_t oldpid)
 {
     KASSERT(region != NULL);
-    uint32_t tlb_hi,tlb_lo;
+    paddr_t paddr;
+    char control;
     size_t i = 0;
     /* size_t j = 0; */
     for (i=0;i<region->npages;i++)
     {
         vaddr_t vaddr = region->region_vaddr + i*PAGE_SIZE;
-        int result = get_tlb_entry(vaddr,oldpid, &tlb_hi, &tlb_lo);
+        int result = get_page_entry(vaddr, oldpid, &paddr, &control);
         if ( result != 0)
         {
             // father not allocate page for that vaddr, may be in bss/data . static int a[100000]
             continue;
         }
-        tlb_lo = tlb_lo & ENTRYMASK;
-        // get a free frame
+        // get a free frame, before vm_lock as this may wait for the reclaim daemon
         paddr_t newframe = get_free_frame();
         //DEBUG(DB_VM, " Free Frame is : 0x%x\n", newframe);
         if ( newframe == 0 )
@@ -142,9 +212,31 @@ static int alloc_and_copy_frame(struct addrspace *newas, struct as_region_metada
             return -1;
         }
 
-        memcpy((void *)PADDR_TO_KVADDR(newframe), (void *)PADDR_TO_KVADDR(tlb_lo) , PAGE_SIZE);
-        // Store new entry in the Page table
-        bool retval = store_entry( vaddr, (pid_t) newas, newframe, as_region_control(region) );
+        // the father's page may have been swapped out meanwhile, look again under the lock
+        lock_acquire(vm_lock);
+        result = get_page_entry(vaddr, oldpid, &paddr, &control);
+        if (result != 0)
+        {
+            // a clean page with no swap copy was dropped while we waited, it reads as never touched
+            free_upages(newframe);
+            lock_release(vm_lock);
+            continue;
+        }
+        if (control & SWAPMASK)
+        {
+            result = swapin_corepage(newframe, PTE_TO_SWAP_SLOT(paddr));
+        }
+        else
+        {
+            memcpy((void *)PADDR_TO_KVADDR(newframe), (void *)PADDR_TO_KVADDR(paddr & ENTRYMASK) , PAGE_SIZE);
+        }
+        // Store new entry in the Page table, dirty as it has no copy in swap of its own
+        bool retval = (result == 0) && store_entry( vaddr, (pid_t) newas, newframe, as_region_control(region) | DIRTYMASK );
+        if (retval)
+        {
+            set_frame_owner(newframe, newas, vaddr);
+        }
+        lock_release(vm_lock);
         if( !retval )
         {
             free_upages(newframe);
@@ -169,6 +261,9 @@ as_copy(struct addrspace *old, struct addrspace **ret)
     if (newas==NULL) {
         return ENOMEM;
     }
+    newas->rss_limit = old->rss_limit;
+    newas->vsize_limit = old->vsize_limit;
+    newas->vsize = old->vsize;
 
     //DEBUG(DB_VM, "New addrspace created which is 0x%p\n",newas);
 
@@ -194,6 +289,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
         if (result != 0)
         {
             //DEBUG(DB_VM, "Alloc and copy failed in as_copy\n");
+            as_free_region(new_region);
             as_destroy(newas);
             return ENOMEM;
         }
@@ -215,17 +311,33 @@ as_destroy(struct addrspace *as)
     struct list_head *current = NULL;
     struct list_head *tmp_head = NULL;
 
+    // the read-ahead thread mustn't be swapping pages in behind our back
+    readahead_cancel(as);
+
     list_for_each_safe(current, tmp_head, &(as->list->head))
     {
         struct as_region_metadata* tmp = list_entry(current, struct as_region_metadata, link);
         list_del(current);
         as_destroy_region(as, tmp);
-        kfree(tmp);
+        as_free_region(tmp);
     }
     // when we get here there should be only one node left in the list
     // So free that node and then free the as struct
     /* as_destroy_region(as->list); */
     kfree(as->list);
+    pt_as_destroy(as);
+
+    // don't leave a dangling pointer for the shootdown code to match against;
+    // interrupts off first so we can't move to another cpu halfway through
+    int spl = splhigh();
+    struct cpu *c = curcpu;
+    spinlock_acquire(&c->c_ipi_lock);
+    if (c->c_tlbas == as)
+    {
+        c->c_tlbas = NULL;
+    }
+    spinlock_release(&c->c_ipi_lock);
+    splx(spl);
     kfree(as);
 }
 
@@ -233,20 +345,28 @@ void
 as_activate(void)
 {
     struct addrspace *as;
+    struct cpu *c;
+    int spl;
 
-    tlb_flush();
     as = proc_getas();
-    if (as == NULL) {
-        /*
-         * Kernel thread without an address space; leave the
-         * prior address space in place.
-         */
-        return;
-    }
 
     /*
-     * Write this.
+     * Flush and record which address space this cpu's TLB now
+     * belongs to, atomically with respect to shootdowns being
+     * queued for us. A kernel thread without an address space
+     * leaves the TLB empty, so no shootdowns are needed here
+     * until a user address space is activated again.
+     *
+     * Interrupts go off before we look at curcpu, so we can't be
+     * moved to another cpu between taking its lock and letting go.
      */
+    spl = splhigh();
+    c = curcpu;
+    spinlock_acquire(&c->c_ipi_lock);
+    tlb_flush();
+    c->c_tlbas = as;
+    spinlock_release(&c->c_ipi_lock);
+    splx(spl);
 }
 
 void
@@ -278,30 +398,38 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize, size_t fil
      * Write this.
      */
     struct as_region_metadata *temp;
+    // where the segment's file data will go, the rest of its pages is zero
+    vaddr_t data_start = vaddr;
+	/* Align the region. First, the base... */
+	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+    size_t npages = convert_to_pages(memsize);
+    if (as->vsize_limit != 0 && as->vsize + npages > as->vsize_limit)
+    {
+        return ENOMEM;
+    }
     temp = as_create_region();
     if (temp == NULL)
     {
         return ENOMEM;
     }
-	/* Align the region. First, the base... */
-	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
-	vaddr &= PAGE_FRAME;
 
     as_set_region(temp, vaddr, memsize,
                   readable | writeable | executable
                  );
     as_add_region_to_list(as,temp);
+    as->vsize += npages;
 
     // Now make the Page table mapping for the filesize bytes only
     size_t filepages = convert_to_pages(filesize);
 
     // Build page table link
-    int retval = build_pagetable_link((pid_t)as, vaddr, filepages, writeable);
+    int retval = build_pagetable_link((pid_t)as, vaddr, filepages, writeable, data_start, filesize);
 
     if ( retval != 0 )
     {
-        // Destroy address space
-        as_destroy(as);
+        // the caller destroys the address space, it is still the current one
         return ENOMEM;
     }
     return 0;
@@ -315,6 +443,14 @@ as_prepare_load(struct addrspace *as)
      */
 
     as->is_loading = 1;
+    // the executable's headers have all been checked by now, so exec can start taking the old image's frames
+    if (as->recycle_from != NULL && as->recycle_region == NULL)
+    {
+        // the read-ahead thread mustn't bring pages back in behind us
+        readahead_cancel(as->recycle_from);
+        as->recycle_region = list_entry(as->recycle_from->list->head.next, struct as_region_metadata, link);
+        as->recycle_page = 0;
+    }
     return 0;
 }
 
@@ -351,9 +487,9 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
     /* Initial user-level stack pointer */
     *stackptr = USERSTACK;
 
-    // Define the stack as a region with 16K size allocated for it
-    //   (this must be > 64K so argument blocks of size ARG_MAX will fit) */
-    int retval = as_define_region(as, *stackptr - APPLICATION_STACK_SIZE, APPLICATION_STACK_SIZE, APPLICATION_STACK_SIZE, PF_R, PF_W, 0);
+    // Define the stack as a region, its pages are only given frames as they are
+    // touched (the argv block gets its own, see argbuf_place)
+    int retval = as_define_region(as, *stackptr - APPLICATION_STACK_SIZE, APPLICATION_STACK_SIZE, 0, PF_R, PF_W, 0);
 
     if ( retval != 0 )
     {
@@ -387,76 +523,653 @@ static struct as_region_metadata* as_create_region(void)
     return temp;
 }
 
-void as_destroy_region(struct addrspace *as, struct as_region_metadata *to_del)
+// Unmap NPAGES pages from VADDR, freeing their frames and swap slots
+// Pages never touched are skipped
+static void as_unmap_range(struct addrspace *as, vaddr_t vaddr, size_t npages)
 {
-    KASSERT(as != NULL && to_del != NULL);
-    uint32_t tlb_hi, tlb_lo;
+    KASSERT(as != NULL);
+    paddr_t paddr;
+    char control;
+    // frames unmapped in the current batch, freed once no TLB can reach them
+    paddr_t frames[TLBSHOOTDOWN_MAX];
+    unsigned nframes = 0;
     size_t i = 0;
-    for (i=0;i< to_del->npages; i++)
+    size_t batch = 0;
+    // keep the reclaim daemon away from these pages while they go
+    lock_acquire(vm_lock);
+    for (batch = 0; batch < npages; batch += TLBSHOOTDOWN_MAX)
     {
-        vaddr_t vaddr_del = to_del->region_vaddr + i*PAGE_SIZE;
-        // free page table entry
-        int res = get_tlb_entry(vaddr_del,(pid_t) as, &tlb_hi, &tlb_lo);
-        if ( res != 0 )
+        size_t batch_end = batch + TLBSHOOTDOWN_MAX;
+        if (batch_end > npages)
+        {
+            batch_end = npages;
+        }
+        nframes = 0;
+        for (i = batch; i < batch_end; i++)
+        {
+            vaddr_t vaddr_del = vaddr + i*PAGE_SIZE;
+            // free page table entry
+            int res = get_page_entry(vaddr_del,(pid_t) as, &paddr, &control);
+            if ( res != 0 )
+            {
+                // never touched (bss/stack), or the program ran out of memory before getting here
+                continue;
+            }
+            // Delete PTE related to this
+            // i don't think we should handle this error, kassert it only.
+            KASSERT(0 == remove_page_entry(vaddr_del, (pid_t)as));
+            if (control & SWAPMASK)
+            {
+                free_swap_slot(PTE_TO_SWAP_SLOT(paddr));
+                continue;
+            }
+            frames[nframes++] = paddr & ENTRYMASK;
+        }
+        if (nframes == 0)
         {
-            // FIXME, maybe the stack area? the program is not running yet because of running out of memory?
-            // TODO we should handle the error case, there is no valid entry in tlb?
-            /* panic("As_destroy_region has no valid page table entry??"); */
             continue;
-            //return;
-
         }
-        tlb_lo = tlb_lo & ENTRYMASK;
-        // free the frame
-        free_upages(tlb_lo);
-        // Delete PTE related to this
-        // TODO the error case for this !!!
-        // i don't think we should handle this error, kassert it only.
-        KASSERT(0 == remove_page_entry(vaddr_del, (pid_t)as));
+        vm_tlbshootdown_range(as, vaddr + batch*PAGE_SIZE, batch_end - batch);
+        while (nframes > 0)
+        {
+            ksm_free_frame(frames[--nframes]);
+        }
     }
+    lock_release(vm_lock);
+}
+
+void as_destroy_region(struct addrspace *as, struct as_region_metadata *to_del)
+{
+    KASSERT(as != NULL && to_del != NULL);
+    as_unmap_range(as, to_del->region_vaddr, to_del->npages);
     // currently nothing in as_region_metadata is kmalloced so just kfree the datastructure
     /* kfree(to_del); */
 }
 
+// Split REGION in two at VADDR (page aligned, inside the region)
+// The new upper part goes after it in the list
+static int as_split_region(struct as_region_metadata *region, vaddr_t vaddr)
+{
+    KASSERT((vaddr & OFFSETMASK) == 0);
+    KASSERT(vaddr > region->region_vaddr);
+    KASSERT(vaddr < region->region_vaddr + region->npages * PAGE_SIZE);
+
+    struct as_region_metadata *upper = as_create_region();
+    if (upper == NULL)
+    {
+        return ENOMEM;
+    }
+    copy_region(region, upper);
+    upper->region_vaddr = vaddr;
+    upper->region_offset += vaddr - region->region_vaddr;
+    upper->npages = region->npages - (vaddr - region->region_vaddr) / PAGE_SIZE;
+    region->npages -= upper->npages;
+    list_add(&(upper->link), &(region->link));
+    return 0;
+}
+
+// Join neighbouring regions that have ended up the same again after a split
+static void as_merge_regions(struct addrspace *as)
+{
+    struct list_head *current = NULL;
+    struct list_head *tmp_head = NULL;
+    struct as_region_metadata *prev = NULL;
+
+    list_for_each_safe(current, tmp_head, &(as->list->head))
+    {
+        struct as_region_metadata* tmp = list_entry(current, struct as_region_metadata, link);
+        if (prev != NULL
+            && prev->region_vaddr + prev->npages * PAGE_SIZE == tmp->region_vaddr
+            && prev->rwxflag == tmp->rwxflag && prev->type == tmp->type
+            && prev->advice == tmp->advice && prev->region_vnode == tmp->region_vnode
+            && (prev->region_vnode == NULL
+                || prev->region_offset + prev->npages * PAGE_SIZE == tmp->region_offset))
+        {
+            prev->npages += tmp->npages;
+            list_del(current);
+            as_free_region(tmp);
+            continue;
+        }
+        prev = tmp;
+    }
+}
+
+static struct as_region_metadata* as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+    struct as_region_metadata* cur = NULL;
+    list_for_each_entry(cur, &(as->list->head), link)
+    {
+        if (cur->region_vaddr <= vaddr && cur->region_vaddr + cur->npages * PAGE_SIZE > vaddr)
+        {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief: make [vaddr, vaddr + npages) a run of whole regions, splitting at the ends
+ *
+ * @return: ENOMEM if part of the range isn't mapped (or no memory to split),
+ * otherwise 0 with *first the region starting at vaddr
+ */
+static int as_isolate_range(struct addrspace *as, vaddr_t vaddr, size_t npages,
+                            struct as_region_metadata **first)
+{
+    vaddr_t end = vaddr + npages * PAGE_SIZE;
+    vaddr_t cur = vaddr;
+    struct as_region_metadata *region = NULL;
+
+    // the whole range has to be mapped
+    while (cur < end)
+    {
+        region = as_find_region(as, cur);
+        if (region == NULL)
+        {
+            return ENOMEM;
+        }
+        cur = region->region_vaddr + region->npages * PAGE_SIZE;
+    }
+
+    region = as_find_region(as, vaddr);
+    if (region->region_vaddr < vaddr)
+    {
+        if (as_split_region(region, vaddr) != 0)
+        {
+            return ENOMEM;
+        }
+        region = as_find_region(as, vaddr);
+    }
+    *first = region;
+
+    region = as_find_region(as, end - PAGE_SIZE);
+    if (region->region_vaddr + region->npages * PAGE_SIZE > end)
+    {
+        if (as_split_region(region, end) != 0)
+        {
+            return ENOMEM;
+        }
+    }
+    return 0;
+}
+
+// Check the arguments shared by madvise and mprotect, and round LEN up to *npages
+static int as_check_range(vaddr_t vaddr, size_t len, size_t *npages)
+{
+    if ((vaddr & OFFSETMASK) != 0)
+    {
+        return EINVAL;
+    }
+    *npages = convert_to_pages(len);
+    if (*npages == 0)
+    {
+        return 0;
+    }
+    if (vaddr + *npages * PAGE_SIZE <= vaddr || vaddr + *npages * PAGE_SIZE > USERSPACETOP)
+    {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+/*
+ * madvise: apply ADVICE to [vaddr, vaddr + len).
+ *
+ * Every region in this VM is anonymous (executables are loaded in
+ * full up front), so MADV_DONTNEED pages come back zero filled.
+ */
+int as_advise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice)
+{
+    struct as_region_metadata *region = NULL;
+
+    KASSERT(as != NULL);
+    size_t npages = 0;
+    int result = as_check_range(vaddr, len, &npages);
+    if (result != 0 || npages == 0)
+    {
+        return result;
+    }
+
+    switch (advice)
+    {
+        case MADV_NORMAL:
+        case MADV_RANDOM:
+        case MADV_SEQUENTIAL:
+        {
+            result = as_isolate_range(as, vaddr, npages, &region);
+            if (result != 0)
+            {
+                as_merge_regions(as);
+                return result;
+            }
+            vaddr_t end = vaddr + npages * PAGE_SIZE;
+            while (region->region_vaddr < end)
+            {
+                region->advice = advice;
+                if (region->link.next == &(as->list->head))
+                {
+                    break;
+                }
+                region = list_entry(region->link.next, struct as_region_metadata, link);
+            }
+            as_merge_regions(as);
+            return 0;
+        }
+
+        case MADV_WILLNEED:
+        case MADV_DONTNEED:
+        {
+            // just check it is all mapped, no need to split anything
+            vaddr_t cur = vaddr;
+            while (cur < vaddr + npages * PAGE_SIZE)
+            {
+                region = as_find_region(as, cur);
+                if (region == NULL)
+                {
+                    return ENOMEM;
+                }
+                cur = region->region_vaddr + region->npages * PAGE_SIZE;
+            }
+            if (advice == MADV_WILLNEED)
+            {
+                vm_prefault_range(as, vaddr, npages);
+            }
+            else
+            {
+                as_unmap_range(as, vaddr, npages);
+            }
+            return 0;
+        }
+
+        default:
+            return EINVAL;
+    }
+}
+
+// Take access away from the pages of [vaddr, vaddr + npages) after an mprotect
+// Only write permission lives in the pte (READWRITE); read is checked against the
+// region, so for that it is enough to get the pages out of the TLBs. The ptes stay
+// valid (eviction, swap and ksm all take a clear valid bit to mean the page is on
+// its way out), so whatever hands out access through a pte rather than the TLB has
+// to check the region too (vm_region_allows).
+// A clean page is never writable in the TLB (see vm_load_tlb), so losing write only
+// needs a shootdown for dirty pages.
+static void as_revoke_range(struct addrspace *as, vaddr_t vaddr, size_t npages, bool read)
+{
+    paddr_t paddr;
+    char control;
+    size_t i = 0;
+    size_t batch = 0;
+
+    // keep the pte bits steady against eviction rewriting them
+    lock_acquire(vm_lock);
+    for (batch = 0; batch < npages; batch += TLBSHOOTDOWN_MAX)
+    {
+        size_t batch_end = batch + TLBSHOOTDOWN_MAX;
+        if (batch_end > npages)
+        {
+            batch_end = npages;
+        }
+        bool shootdown = false;
+        for (i = batch; i < batch_end; i++)
+        {
+            vaddr_t page = vaddr + i*PAGE_SIZE;
+            if (get_page_entry(page, (pid_t)as, &paddr, &control) != 0)
+            {
+                // never touched, will get the region's permissions on first touch
+                continue;
+            }
+            if (control & READWRITE)
+            {
+                // swapped out pages too, they come back with the bits they left with
+                reset_mask(page, (pid_t)as, READWRITE);
+            }
+            if ((control & VALIDMASK) && (read || (control & DIRTYMASK)))
+            {
+                shootdown = true;
+            }
+        }
+        if (shootdown)
+        {
+            vm_tlbshootdown_range(as, vaddr + batch*PAGE_SIZE, batch_end - batch);
+        }
+    }
+    lock_release(vm_lock);
+}
+
+/*
+ * mprotect: set the protection of [vaddr, vaddr + len) to PROT.
+ *
+ * Taking permissions away is done now, since a stale TLB entry would
+ * still allow the access. Giving write permission back is left to the
+ * next write fault on each page (see vm_page_in).
+ */
+int as_protect(struct addrspace *as, vaddr_t vaddr, size_t len, int prot)
+{
+    struct as_region_metadata *region = NULL;
+    bool lost_read = false;
+    bool lost_write = false;
+
+    KASSERT(as != NULL);
+    if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0)
+    {
+        return EINVAL;
+    }
+    size_t npages = 0;
+    int result = as_check_range(vaddr, len, &npages);
+    if (result != 0 || npages == 0)
+    {
+        return result;
+    }
+
+    char perm = 0;
+    if (prot & PROT_READ)
+    {
+        perm |= PF_R;
+    }
+    if (prot & PROT_WRITE)
+    {
+        perm |= PF_W;
+    }
+    if (prot & PROT_EXEC)
+    {
+        perm |= PF_X;
+    }
+
+    result = as_isolate_range(as, vaddr, npages, &region);
+    if (result != 0)
+    {
+        as_merge_regions(as);
+        return result;
+    }
+    vaddr_t end = vaddr + npages * PAGE_SIZE;
+    while (region->region_vaddr < end)
+    {
+        // the TLB can't tell read, write and execute apart for access, any one of them
+        // makes a page readable, so only PROT_NONE loses read
+        if (region->rwxflag != 0 && perm == 0)
+        {
+            lost_read = true;
+        }
+        if ((region->rwxflag & PF_W) && !(perm & PF_W))
+        {
+            lost_write = true;
+        }
+        // the type stays, a guard page in the stack is still part of the stack
+        region->rwxflag = perm;
+        if (region->link.next == &(as->list->head))
+        {
+            break;
+        }
+        region = list_entry(region->link.next, struct as_region_metadata, link);
+    }
+    as_merge_regions(as);
+
+    if (lost_read || lost_write)
+    {
+        as_revoke_range(as, vaddr, npages, lost_read);
+    }
+    return 0;
+}
+
+/*
+ * Add a region whose pages, until first touched, come from VN at OFFSET
+ * instead of being zero filled. No page table entries are made, every
+ * page is faulted in from the file on demand (see vm_page_in).
+ */
+int as_define_backed_region(struct addrspace *as, vaddr_t vaddr, size_t npages, char rwxflag,
+                            enum region_type type, int advice, struct vnode *vn, off_t offset)
+{
+    KASSERT(as != NULL && vn != NULL);
+    KASSERT((vaddr & OFFSETMASK) == 0 && (offset & OFFSETMASK) == 0);
+
+    if (as->vsize_limit != 0 && as->vsize + npages > as->vsize_limit)
+    {
+        return ENOMEM;
+    }
+    struct as_region_metadata *region = as_create_region();
+    if (region == NULL)
+    {
+        return ENOMEM;
+    }
+    as_set_region(region, vaddr, npages * PAGE_SIZE, rwxflag);
+    region->type = type;
+    region->advice = advice;
+    VOP_INCREF(vn);
+    region->region_vnode = vn;
+    region->region_offset = offset;
+    as_add_region_to_list(as, region);
+    as->vsize += npages;
+    return 0;
+}
+
+/*
+ * Map NFRAMES frames, from get_free_frame and not mapped anywhere yet, at
+ * VADDR onwards as dirty pages of the region there. Each frame taken over
+ * is zeroed in FRAMES; on failure the rest are still the caller's.
+ */
+int as_map_frames(struct addrspace *as, vaddr_t vaddr, paddr_t *frames, unsigned nframes)
+{
+    KASSERT(as != NULL && (vaddr & OFFSETMASK) == 0);
+    if (nframes == 0)
+    {
+        return 0;
+    }
+    struct as_region_metadata *region = as_find_region(as, vaddr);
+    if (region == NULL
+        || vaddr + nframes * PAGE_SIZE > region->region_vaddr + region->npages * PAGE_SIZE)
+    {
+        return EFAULT;
+    }
+    char control = as_region_control(region) | DIRTYMASK;
+    for (unsigned i = 0; i < nframes; i++)
+    {
+        vaddr_t page = vaddr + i * PAGE_SIZE;
+        if (!store_entry(page, (pid_t)as, frames[i], control))
+        {
+            return ENOMEM;
+        }
+        set_frame_owner(frames[i], as, page);
+        frames[i] = 0;
+    }
+    return 0;
+}
+
+/*
+ * Frame recycling over exec.
+ *
+ * Building the new image and only then destroying the old one would need
+ * room for both, and every frame would go through the free list and be
+ * zeroed on the way. Instead, while AS is loaded, its frames are taken
+ * straight from the image OLD it replaces, and the caller clears only what
+ * it isn't about to overwrite. Once any page has been taken the old image
+ * is gone: if the load then fails there is nothing to return to.
+ *
+ * as_recycle_begin only names the old image; nothing is taken from it until
+ * as_prepare_load, after load_elf has checked every segment of the new one.
+ */
+void as_recycle_begin(struct addrspace *as, struct addrspace *old)
+{
+    KASSERT(as != NULL && as->recycle_from == NULL);
+    if (old == NULL || list_empty(&(old->list->head)))
+    {
+        return;
+    }
+    as->recycle_from = old;
+    as->recycle_region = NULL;
+    as->recycle_page = 0;
+    as->recycle_taken = 0;
+}
+
+// Stop taking frames; true if the old image has lost any
+bool as_recycle_end(struct addrspace *as)
+{
+    KASSERT(as != NULL);
+    as->recycle_from = NULL;
+    as->recycle_region = NULL;
+    return as->recycle_taken != 0;
+}
+
+// Unmap the next resident page of the old image and hand back its frame, 0 if there's none left
+// Pages in swap and merged pages are left for as_destroy
+static paddr_t as_recycle_frame(struct addrspace *as)
+{
+    struct addrspace *old = as->recycle_from;
+    paddr_t paddr;
+    char control;
+
+    lock_acquire(vm_lock);
+    while (as->recycle_region != NULL)
+    {
+        struct as_region_metadata *region = as->recycle_region;
+        while (as->recycle_page < region->npages)
+        {
+            vaddr_t vaddr = region->region_vaddr + as->recycle_page++ * PAGE_SIZE;
+            if (get_page_entry(vaddr, (pid_t)old, &paddr, &control) != 0
+                || (control & (SWAPMASK | SHAREDMASK)) || (control & VALIDMASK) == 0)
+            {
+                continue;
+            }
+            paddr &= ENTRYMASK;
+            KASSERT(0 == remove_page_entry(vaddr, (pid_t)old));
+            vm_tlbshootdown_range(old, vaddr, 1);
+            int slot = get_frame_swap_slot(paddr);
+            if (slot >= 0)
+            {
+                free_swap_slot((unsigned)slot);
+                set_frame_swap_slot(paddr, -1);
+            }
+            // no owner until the caller maps it, so the clock hands pass it over
+            set_frame_owner(paddr, NULL, 0);
+            as->recycle_taken++;
+            lock_release(vm_lock);
+            vm_count_recycled();
+            return paddr;
+        }
+        as->recycle_page = 0;
+        as->recycle_region = region->link.next == &(old->list->head) ? NULL
+                             : list_entry(region->link.next, struct as_region_metadata, link);
+    }
+    lock_release(vm_lock);
+    return 0;
+}
+
+// A frame for a new page of AS. While exec is loading it this is one of the old
+// image's, with *RECYCLED set: it still holds the old contents. Otherwise a zeroed free one
+paddr_t as_get_frame(struct addrspace *as, bool *recycled)
+{
+    KASSERT(as != NULL && recycled != NULL);
+    if (as->recycle_from != NULL)
+    {
+        paddr_t paddr = as_recycle_frame(as);
+        if (paddr != 0)
+        {
+            *recycled = true;
+            return paddr;
+        }
+    }
+    *recycled = false;
+    return get_free_frame();
+}
+
+// Is the address space at its resident limit, so a new page has to push out one of its own?
+bool as_rss_full(struct addrspace *as)
+{
+    KASSERT(as != NULL);
+    return as->rss_limit != 0 && as->rss >= as->rss_limit;
+}
+
+// Called from vm_bootstrap with the number of frames left for user pages
+void as_bootstrap_limits(unsigned nframes)
+{
+    spinlock_acquire(&limit_lock);
+    default_rss_limit = nframes - nframes / AS_RSS_RESERVE_DIVISOR;
+    if (default_rss_limit < AS_RSS_LIMIT_MIN)
+    {
+        default_rss_limit = 0;
+    }
+    default_vsize_limit = 0;
+    spinlock_release(&limit_lock);
+}
+
+void as_get_default_limits(unsigned *rss, unsigned *vsize)
+{
+    spinlock_acquire(&limit_lock);
+    *rss = default_rss_limit;
+    *vsize = default_vsize_limit;
+    spinlock_release(&limit_lock);
+}
+
+// New limits only apply to processes started from the menu afterwards,
+// running ones keep what they inherited
+int as_set_default_limits(unsigned rss, unsigned vsize)
+{
+    if (rss != 0 && rss < AS_RSS_LIMIT_MIN)
+    {
+        return EINVAL;
+    }
+    spinlock_acquire(&limit_lock);
+    default_rss_limit = rss;
+    default_vsize_limit = vsize;
+    spinlock_release(&limit_lock);
+    return 0;
+}
+
 char as_region_control(struct as_region_metadata* region)
 {
     KASSERT(region != NULL);
     char control = 0;
+    // writable, but mapped clean; the first write marks it dirty
     if (region->rwxflag & PF_W )
     {
-        control |= DIRTYMASK;
+        control |= READWRITE;
     }
     control |= VALIDMASK;
     return control;
 
 }
 
-static int build_pagetable_link(pid_t pid, vaddr_t vaddr, size_t filepages, int writeable)
+static int build_pagetable_link(pid_t pid, vaddr_t vaddr, size_t filepages, int writeable,
+                                vaddr_t data_start, size_t data_len)
 {
     vaddr_t page_vaddr = 0;
-    //pid_t pid = (pid_t) as;
+    vaddr_t data_end = data_start + data_len;
+    bool recycled = false;
 
     size_t i = 0;
     for (i=0;i<filepages;i++)
     {
-        paddr_t paddr = get_free_frame();
+        paddr_t paddr = as_get_frame((struct addrspace*)pid, &recycled);
         if ( paddr == 0 )
         {
             return ENOMEM;
         }
+        page_vaddr = vaddr + i*PAGE_SIZE;
+        if (recycled)
+        {
+            // load_elf overwrites the file data, only clear either side of it
+            vaddr_t from = data_start > page_vaddr ? data_start : page_vaddr;
+            vaddr_t to = data_end < page_vaddr + PAGE_SIZE ? data_end : page_vaddr + PAGE_SIZE;
+            char *kva = (char*)PADDR_TO_KVADDR(paddr);
+            if (from >= to)
+            {
+                bzero(kva, PAGE_SIZE);
+            }
+            else
+            {
+                bzero(kva, from - page_vaddr);
+                bzero(kva + (to - page_vaddr), page_vaddr + PAGE_SIZE - to);
+            }
+        }
 
         // Construct the control bits for the PTE
         // Just set validmask for now, all entries are cacheable and none are global
         char control = VALIDMASK;
-        page_vaddr = vaddr + i*PAGE_SIZE;
 
+        // clean zero page for now, load_elf marks what it writes dirty
         if ( (writeable&PF_W) != 0 )
         {
-            control |= DIRTYMASK;
-        }
-        else
-        {
-            control &= (~DIRTYMASK);
+            control |= READWRITE;
         }
         bool result = store_entry(page_vaddr, pid, paddr, control);
         if (!result)
@@ -466,6 +1179,7 @@ static int build_pagetable_link(pid_t pid, vaddr_t vaddr, size_t filepages, int
             free_upages(paddr);
             return ENOMEM;
         }
+        set_frame_owner(paddr, (void*)pid, page_vaddr);
     }
     return 0;
 }
@@ -35,6 +35,7 @@
 #include <current.h>
 #include <vm.h>
 #include <copyinout.h>
+#include "opt-dumbvm.h"
 
 /*
  * User/kernel memory copying functions.
@@ -84,8 +85,19 @@
  * To make use of this code, in addition to tm_badfaultfunc the
  * thread_machdep structure should contain a jmp_buf called
  * "tm_copyjmp".
+ *
+ * With our VM the copies are done a page at a time, and a page that
+ * is already resident with the access allowed is reached through the
+ * page table at its kseg0 address instead (see vm_user_page_hold).
+ * That takes no TLB misses, which on this machine are each a trip
+ * through vm_fault; big copies otherwise take one per page and push
+ * the process's own entries out of the TLB. Small pieces aren't worth
+ * the lookup and just go through the user address.
  */
 
+/* pieces smaller than this go straight through the user address */
+#define COPY_DIRECT_MIN 512
+
 /*
  * Recovery function. If a fatal fault occurs during copyin, copyout,
  * copyinstr, or copyoutstr, execution resumes here. (This behavior is
@@ -142,12 +154,135 @@ copycheck(const_userptr_t userptr, size_t len, size_t *stoplen)
         return 0;
 }
 
+/*
+ * Use the page table shortcut or not in the current thread, for
+ * comparing the two (see copybench). Returns the old setting.
+ */
+bool
+copy_set_direct(bool direct)
+{
+        bool old = !curthread->t_copyslow;
+
+        curthread->t_copyslow = !direct;
+        return old;
+}
+
+/*
+ * Block copy: eight words (a cache line's worth) at a time when both
+ * ends are word aligned, then single words, then what's left a byte at
+ * a time. memcpy falls back to bytes for the whole thing unless the
+ * length is a multiple of the word size too.
+ */
+static
+void
+copyblock(void *dest, const void *src, size_t len)
+{
+        char *d = dest;
+        const char *s = src;
+
+        if ((((uintptr_t)d | (uintptr_t)s) & (sizeof(uint32_t) - 1)) == 0) {
+                uint32_t *dw = (uint32_t *)d;
+                const uint32_t *sw = (const uint32_t *)s;
+
+                while (len >= 8 * sizeof(uint32_t)) {
+                        dw[0] = sw[0]; dw[1] = sw[1];
+                        dw[2] = sw[2]; dw[3] = sw[3];
+                        dw[4] = sw[4]; dw[5] = sw[5];
+                        dw[6] = sw[6]; dw[7] = sw[7];
+                        dw += 8;
+                        sw += 8;
+                        len -= 8 * sizeof(uint32_t);
+                }
+                while (len >= sizeof(uint32_t)) {
+                        *dw++ = *sw++;
+                        len -= sizeof(uint32_t);
+                }
+                d = (char *)dw;
+                s = (const char *)sw;
+        }
+        while (len > 0) {
+                *d++ = *s++;
+                len--;
+        }
+}
+
+/*
+ * Get at the user page holding UADDR for copying CHUNK bytes (within
+ * the page), writing to it if WRITE. Returns where to access it, and
+ * sets *HELD if that must be let go of with copydone.
+ */
+static
+char *
+copypage(vaddr_t uaddr, size_t chunk, bool write, bool *held)
+{
+#if !OPT_DUMBVM
+        vaddr_t kvaddr;
+
+        if (!curthread->t_copyslow && chunk >= COPY_DIRECT_MIN &&
+            vm_user_page_hold(uaddr, write, &kvaddr)) {
+                *held = true;
+                return (char *)kvaddr;
+        }
+#else
+        (void)chunk;
+        (void)write;
+#endif
+        *held = false;
+        return (char *)uaddr;
+}
+
+static
+void
+copydone(char *upage, bool held)
+{
+#if !OPT_DUMBVM
+        if (held) {
+                vm_user_page_release((vaddr_t)upage);
+        }
+#else
+        (void)upage;
+        (void)held;
+#endif
+}
+
+/*
+ * Copy LEN bytes between user address UADDR and kernel address KADDR,
+ * out to user space if OUT, a page at a time. The range has been
+ * checked and the recovery set up by the caller.
+ */
+static
+void
+copyuser(vaddr_t uaddr, char *kaddr, size_t len, bool out)
+{
+        size_t chunk;
+        char *upage;
+        bool held;
+
+        while (len > 0) {
+                chunk = PAGE_SIZE - (uaddr & ~(vaddr_t)PAGE_FRAME);
+                if (chunk > len) {
+                        chunk = len;
+                }
+                upage = copypage(uaddr, chunk, out, &held);
+                if (out) {
+                        copyblock(upage, kaddr, chunk);
+                }
+                else {
+                        copyblock(kaddr, upage, chunk);
+                }
+                copydone(upage, held);
+                uaddr += chunk;
+                kaddr += chunk;
+                len -= chunk;
+        }
+}
+
 /*
  * copyin
  *
  * Copy a block of memory of length LEN from user-level address USERSRC
- * to kernel address DEST. We can use memcpy because it's protected by
- * the tm_badfaultfunc/copyfail logic.
+ * to kernel address DEST. We can copy directly because it's protected
+ * by the tm_badfaultfunc/copyfail logic.
  */
 int
 copyin(const_userptr_t usersrc, void *dest, size_t len)
@@ -172,7 +307,7 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
                 return EFAULT;
         }
 
-        memcpy(dest, (const void *)usersrc, len);
+        copyuser((vaddr_t)usersrc, dest, len, false);
 
         curthread->t_machdep.tm_badfaultfunc = NULL;
         return 0;
@@ -182,7 +317,7 @@ copyin(const_userptr_t usersrc, void *dest, size_t len)
  * copyout
  *
  * Copy a block of memory of length LEN from kernel address SRC to
- * user-level address USERDEST. We can use memcpy because it's
+ * user-level address USERDEST. We can copy directly because it's
  * protected by the tm_badfaultfunc/copyfail logic.
  */
 int
@@ -208,7 +343,7 @@ copyout(const void *src, userptr_t userdest, size_t len)
                 return EFAULT;
         }
 
-        memcpy((void *)userdest, src, len);
+        copyuser((vaddr_t)userdest, (char *)src, len, true);
 
         curthread->t_machdep.tm_badfaultfunc = NULL;
         return 0;
@@ -218,8 +353,9 @@ copyout(const void *src, userptr_t userdest, size_t len)
  * Common string copying function that behaves the way that's desired
  * for copyinstr and copyoutstr.
  *
- * Copies a null-terminated string of maximum length MAXLEN from SRC
- * to DEST. If GOTLEN is not null, store the actual length found
+ * Copies a null-terminated string of maximum length MAXLEN between
+ * user address UADDR and kernel address KADDR, out to user space if
+ * OUT, a page at a time like copyuser. If GOTLEN is not null, store the actual length found
  * there. Both lengths include the null-terminator. If the string
  * exceeds the available length, the call fails and returns
  * ENAMETOOLONG.
@@ -232,19 +368,34 @@ copyout(const void *src, userptr_t userdest, size_t len)
  */
 static
 int
-copystr(char *dest, const char *src, size_t maxlen, size_t stoplen,
-        size_t *gotlen)
+copystr(vaddr_t uaddr, char *kaddr, size_t maxlen, size_t stoplen,
+        size_t *gotlen, bool out)
 {
-        size_t i;
-
-        for (i=0; i<maxlen && i<stoplen; i++) {
-                dest[i] = src[i];
-                if (src[i] == 0) {
-                        if (gotlen != NULL) {
-                                *gotlen = i+1;
+        size_t i, done, chunk, limit;
+        const char *src;
+        char *dest, *upage;
+        bool held;
+
+        limit = maxlen < stoplen ? maxlen : stoplen;
+        for (done = 0; done < limit; done += chunk) {
+                chunk = PAGE_SIZE - ((uaddr + done) & ~(vaddr_t)PAGE_FRAME);
+                if (chunk > limit - done) {
+                        chunk = limit - done;
+                }
+                upage = copypage(uaddr + done, chunk, out, &held);
+                src = out ? kaddr + done : upage;
+                dest = out ? upage : kaddr + done;
+                for (i=0; i<chunk; i++) {
+                        dest[i] = src[i];
+                        if (src[i] == 0) {
+                                copydone(upage, held);
+                                if (gotlen != NULL) {
+                                        *gotlen = done+i+1;
+                                }
+                                return 0;
                         }
-                        return 0;
                 }
+                copydone(upage, held);
         }
         if (stoplen < maxlen) {
                 /* ran into user-kernel boundary */
@@ -281,7 +432,7 @@ copyinstr(const_userptr_t usersrc, char *dest, size_t len, size_t *actual)
                 return EFAULT;
         }
 
-        result = copystr(dest, (const char *)usersrc, len, stoplen, actual);
+        result = copystr((vaddr_t)usersrc, dest, len, stoplen, actual, false);
 
         curthread->t_machdep.tm_badfaultfunc = NULL;
         return result;
@@ -314,7 +465,8 @@ copyoutstr(const char *src, userptr_t userdest, size_t len, size_t *actual)
                 return EFAULT;
         }
 
-        result = copystr((char *)userdest, src, len, stoplen, actual);
+        result = copystr((vaddr_t)userdest, (char *)src, len, stoplen, actual,
+                         true);
 
         curthread->t_machdep.tm_badfaultfunc = NULL;
         return result;
@@ -0,0 +1,723 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <cpu.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <coreswap.h>
+#include <zswap.h>
+
+/*
+ * Paging to swap, and the page reclaim daemon.
+ *
+ * Free frames are kept ahead of demand: whenever an allocation takes
+ * the free list below the low watermark the daemon is woken, and it
+ * evicts user pages to swap until the free list is back up to the high
+ * watermark. A fault only has to wait when the free list is actually
+ * empty, and only fails when there is nothing left that can be evicted.
+ *
+ * Dirty pages are offered to the compressed pool (zswap.c) before the
+ * disk; the pool hands its oldest pages on to the disk when it fills.
+ */
+
+// swap disk, opened by the daemon the first time it needs it
+static struct vnode* swap_vnode = NULL;
+static struct bitmap* swap_map = NULL;
+static unsigned swap_slots = 0;
+static unsigned swap_used = 0;
+static bool swap_disabled = false; // couldn't open the swap disk, don't keep trying
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+// Counters reported by coreswap_printstats
+struct reclaim_stats
+{
+    unsigned wakeups;   // times the daemon was woken
+    unsigned passes;    // reclaim passes completed
+    unsigned pageouts;  // dirty pages written to swap and freed
+    unsigned clean_drops; // clean pages freed without writing, their swap copy is current
+    unsigned zero_drops;  // never written pages, just unmapped
+    unsigned pageins;   // pages read back from swap
+    unsigned stalls;    // allocations that found no free frame and had to wait
+    unsigned failures;  // passes that couldn't free anything
+    unsigned second_chances; // victims skipped because they had been referenced
+    unsigned samples;   // reference sampling passes
+    unsigned sampled;   // pages looked at by the sampler
+    unsigned ref_cleared; // ... that had been referenced, cleared and shot down
+    unsigned self_evictions; // pages pushed out by their own process, at its rss limit
+    unsigned self_failures;  // ... that found nothing to push out
+};
+
+static struct reclaim_stats rstats;
+
+// protects everything below, and rstats
+static struct spinlock reclaim_lock = SPINLOCK_INITIALIZER;
+static struct wchan* reclaim_wchan = NULL;      // the daemon sleeps here
+static struct wchan* reclaim_done_wchan = NULL; // allocators waiting for a pass to finish
+static struct thread* reclaim_thread = NULL;
+static bool reclaim_wanted = false;
+static unsigned reclaim_generation = 0; // bumped at the end of every pass
+static bool reclaim_stuck = false;      // the last pass freed nothing and there is nothing free
+static int reclaim_low = 0;
+static int reclaim_high = 0;
+static int reclaim_nframes = 0;         // frames free at boot, bounds the victim search
+static int victim_hand = 0;             // clock hands into the frame table, under vm_lock
+static int sample_hand = 0;
+static int self_hand = 0;               // victims for processes at their rss limit
+
+// reference sampling: every ref_interval ticks, clear the reference bit on the next
+// ref_batch pages; the ones touched again by the time the victim hand gets there get
+// a second chance
+static bool sample_wanted = false;
+static unsigned ref_interval = REFSAMPLE_INTERVAL; // in hardclocks, 0 is off
+static unsigned ref_batch = REFSAMPLE_BATCH;
+static unsigned ref_ticks = 0;
+
+static int swap_open(void)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    if (swap_vnode != NULL)
+    {
+        return 0;
+    }
+    if (swap_disabled)
+    {
+        return ENOSPC;
+    }
+
+    char path[] = SWAP_FILE;
+    struct vnode* vn = NULL;
+    struct stat st;
+    int result = vfs_open(path, O_RDWR, 0, &vn);
+    if (result == 0)
+    {
+        result = VOP_STAT(vn, &st);
+        if (result == 0 && st.st_size < PAGE_SIZE)
+        {
+            result = ENOSPC;
+        }
+        if (result != 0)
+        {
+            vfs_close(vn);
+        }
+    }
+    if (result != 0)
+    {
+        kprintf("swap: can't use %s: %s, paging disabled\n", SWAP_FILE, strerror(result));
+        swap_disabled = true;
+        return result;
+    }
+
+    unsigned nslots = st.st_size / PAGE_SIZE;
+    if (nslots > ZSWAP_SLOT_BASE)
+    {
+        // the slots above that are the compressed pages
+        nslots = ZSWAP_SLOT_BASE;
+    }
+    struct bitmap* map = bitmap_create(nslots);
+    if (map == NULL)
+    {
+        // try again next time
+        vfs_close(vn);
+        return ENOMEM;
+    }
+
+    spinlock_acquire(&swap_lock);
+    swap_map = map;
+    swap_slots = nslots;
+    swap_used = 0;
+    spinlock_release(&swap_lock);
+    swap_vnode = vn;
+    kprintf("swap: %u pages on %s\n", nslots, SWAP_FILE);
+    return 0;
+}
+
+static int alloc_swap_slot(unsigned* slot)
+{
+    spinlock_acquire(&swap_lock);
+    if (swap_map == NULL || bitmap_alloc(swap_map, slot) != 0)
+    {
+        spinlock_release(&swap_lock);
+        return ENOSPC;
+    }
+    swap_used++;
+    spinlock_release(&swap_lock);
+    return 0;
+}
+
+void free_swap_slot(unsigned slot)
+{
+    if (SWAP_SLOT_IS_COMPRESSED(slot))
+    {
+        zswap_free(slot);
+        return;
+    }
+    spinlock_acquire(&swap_lock);
+    KASSERT(swap_map != NULL && slot < swap_slots);
+    KASSERT(bitmap_isset(swap_map, slot));
+    bitmap_unmark(swap_map, slot);
+    swap_used--;
+    spinlock_release(&swap_lock);
+}
+
+static int swap_io(void* buf, unsigned slot, enum uio_rw rw)
+{
+    struct iovec iov;
+    struct uio ku;
+    int result = 0;
+
+    KASSERT(swap_vnode != NULL);
+    uio_kinit(&iov, &ku, buf, PAGE_SIZE,
+              (off_t)slot * PAGE_SIZE, rw);
+    if (rw == UIO_READ)
+    {
+        result = VOP_READ(swap_vnode, &ku);
+    }
+    else
+    {
+        result = VOP_WRITE(swap_vnode, &ku);
+    }
+    if (result != 0)
+    {
+        return result;
+    }
+    if (ku.uio_resid != 0)
+    {
+        return EIO;
+    }
+    return 0;
+}
+
+int swapout_corepage(paddr_t paddr, unsigned slot)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    KASSERT(!SWAP_SLOT_IS_COMPRESSED(slot));
+    return swap_io((void*)PADDR_TO_KVADDR(paddr), slot, UIO_WRITE);
+}
+
+// A compressed slot is decompressed instead, and left for the caller to free
+int swapin_corepage(paddr_t paddr, unsigned slot)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    if (SWAP_SLOT_IS_COMPRESSED(slot))
+    {
+        return zswap_load(paddr, slot);
+    }
+    int result = swap_io((void*)PADDR_TO_KVADDR(paddr), slot, UIO_READ);
+    if (result == 0)
+    {
+        spinlock_acquire(&reclaim_lock);
+        rstats.pageins++;
+        spinlock_release(&reclaim_lock);
+    }
+    return result;
+}
+
+// Write a page from a kernel buffer to a new swap slot, for the compressed pool
+int swap_write_page(void* buf, unsigned* slot)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    int result = swap_open();
+    if (result == 0)
+    {
+        result = alloc_swap_slot(slot);
+    }
+    if (result != 0)
+    {
+        return result;
+    }
+    result = swap_io(buf, *slot, UIO_WRITE);
+    if (result != 0)
+    {
+        free_swap_slot(*slot);
+        return result;
+    }
+    spinlock_acquire(&reclaim_lock);
+    rstats.pageouts++;
+    spinlock_release(&reclaim_lock);
+    return 0;
+}
+
+/**
+ * @brief: evict one user page and free its frame
+ *
+ * the pte is invalidated and shot down first, so the owner can't write the page
+ * under us (and any dirty bit it set before that is seen); if it faults on the
+ * page meanwhile it waits on vm_lock.
+ * only dirty pages are written: a clean page with a swap copy just goes back to
+ * that slot, and a clean page without one was never written so is dropped
+ * altogether, the next touch gets a fresh zero page. dirty pages are
+ * compressed into memory if they can be, which makes any swap copy stale.
+ *
+ * @param hand: clock hand to search the frame table from
+ * @param only: if not NULL, only evict pages of this address space
+ *
+ * @return: 0 on success, otherwise nothing could be evicted
+ */
+static int evict_one(int* hand, struct addrspace* only)
+{
+    void* owner = NULL;
+    vaddr_t vaddr = 0;
+    paddr_t pte_paddr = 0;
+    char control = 0;
+    unsigned slot = 0;
+    bool new_slot = false;
+
+    paddr_t paddr = 0;
+    struct addrspace* as = NULL;
+    pid_t pid = 0;
+    int result = 0;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+    // second chance clock: referenced pages have the bit cleared and are passed over,
+    // after one turn of the hand there is none left (unless they are being used hard)
+    for (int tries = 0; ; tries++)
+    {
+        paddr = next_user_frame(hand, &owner, &vaddr);
+        if (paddr == 0)
+        {
+            return ENOMEM;
+        }
+        if (only != NULL && owner != only)
+        {
+            if (tries >= 4 * reclaim_nframes)
+            {
+                return ENOMEM;
+            }
+            continue;
+        }
+        as = owner;
+        pid = (pid_t)as;
+
+        result = get_page_entry(vaddr, pid, &pte_paddr, &control);
+        KASSERT(result == 0);
+        KASSERT((control & VALIDMASK) && (pte_paddr & ENTRYMASK) == paddr);
+        if ((control & REFMASK) == 0 || tries >= 2 * reclaim_nframes)
+        {
+            break;
+        }
+        reset_mask(vaddr, pid, REFMASK);
+        vm_tlbshootdown_range(as, vaddr, 1);
+        spinlock_acquire(&reclaim_lock);
+        rstats.second_chances++;
+        spinlock_release(&reclaim_lock);
+    }
+
+    // unmap first so no tlb can pick it up, or write it, while it goes out
+    reset_mask(vaddr, pid, VALIDMASK);
+    set_mask(vaddr, pid, SWAPMASK);
+    vm_tlbshootdown_range(as, vaddr, 1);
+    get_page_entry(vaddr, pid, &pte_paddr, &control);
+
+    int frame_slot = get_frame_swap_slot(paddr);
+    if ((control & DIRTYMASK) == 0 && frame_slot < 0)
+    {
+        KASSERT(0 == remove_page_entry(vaddr, pid));
+        free_upages(paddr);
+        spinlock_acquire(&reclaim_lock);
+        rstats.zero_drops++;
+        spinlock_release(&reclaim_lock);
+        return 0;
+    }
+
+    if ((control & DIRTYMASK) && zswap_store(paddr, as, vaddr, &slot) == 0)
+    {
+        if (frame_slot >= 0)
+        {
+            free_swap_slot((unsigned)frame_slot);
+        }
+        set_frame_swap_slot(paddr, -1);
+        update_page_entry(vaddr, pid, SWAP_SLOT_TO_PTE(slot), control & ~(DIRTYMASK | REFMASK));
+        free_upages(paddr);
+        return 0;
+    }
+
+    if (frame_slot >= 0)
+    {
+        // a dirty page reuses the slot it came from
+        slot = (unsigned)frame_slot;
+    }
+    else
+    {
+        result = swap_open();
+        if (result == 0)
+        {
+            result = alloc_swap_slot(&slot);
+        }
+        if (result != 0)
+        {
+            reset_mask(vaddr, pid, SWAPMASK);
+            set_mask(vaddr, pid, VALIDMASK);
+            return result;
+        }
+        new_slot = true;
+    }
+
+    if (control & DIRTYMASK)
+    {
+        result = swapout_corepage(paddr, slot);
+        if (result != 0)
+        {
+            if (new_slot)
+            {
+                free_swap_slot(slot);
+            }
+            reset_mask(vaddr, pid, SWAPMASK);
+            set_mask(vaddr, pid, VALIDMASK);
+            return result;
+        }
+    }
+
+    spinlock_acquire(&reclaim_lock);
+    if (control & DIRTYMASK)
+    {
+        rstats.pageouts++;
+    }
+    else
+    {
+        rstats.clean_drops++;
+    }
+    spinlock_release(&reclaim_lock);
+
+    // the slot now belongs to the pte
+    set_frame_swap_slot(paddr, -1);
+    update_page_entry(vaddr, pid, SWAP_SLOT_TO_PTE(slot), control & ~(DIRTYMASK | REFMASK));
+    free_upages(paddr);
+    return 0;
+}
+
+/*
+ * Clear the reference bit on the next BATCH mapped pages. A page with
+ * the bit clear is in no TLB (it gets set whenever the page is loaded
+ * into one), so only the referenced ones need shooting down, and the
+ * next touch of those faults and sets it again.
+ */
+static void sample_refs(unsigned batch)
+{
+    void* owner = NULL;
+    vaddr_t vaddr = 0;
+    paddr_t paddr = 0;
+    char control = 0;
+    unsigned looked = 0, cleared = 0;
+
+    lock_acquire(vm_lock);
+    for (looked = 0; looked < batch; looked++)
+    {
+        if (next_user_frame(&sample_hand, &owner, &vaddr) == 0)
+        {
+            break;
+        }
+        if (get_page_entry(vaddr, (pid_t)owner, &paddr, &control) != 0
+            || (control & REFMASK) == 0)
+        {
+            continue;
+        }
+        reset_mask(vaddr, (pid_t)owner, REFMASK);
+        vm_tlbshootdown_range(owner, vaddr, 1);
+        cleared++;
+    }
+    lock_release(vm_lock);
+
+    spinlock_acquire(&reclaim_lock);
+    rstats.samples++;
+    rstats.sampled += looked;
+    rstats.ref_cleared += cleared;
+    spinlock_release(&reclaim_lock);
+}
+
+static void reclaim_daemon(void* data1, unsigned long data2)
+{
+    (void)data1;
+    (void)data2;
+    int high = 0;
+    unsigned freed = 0;
+    unsigned batch = 0;
+    bool reclaim = false;
+
+    spinlock_acquire(&reclaim_lock);
+    reclaim_thread = curthread;
+    spinlock_release(&reclaim_lock);
+
+    while (1)
+    {
+        spinlock_acquire(&reclaim_lock);
+        while (!reclaim_wanted && !sample_wanted)
+        {
+            wchan_sleep(reclaim_wchan, &reclaim_lock);
+        }
+        batch = sample_wanted ? ref_batch : 0;
+        sample_wanted = false;
+        reclaim = reclaim_wanted;
+        reclaim_wanted = false;
+        high = reclaim_high;
+        spinlock_release(&reclaim_lock);
+
+        if (batch > 0)
+        {
+            sample_refs(batch);
+        }
+        if (!reclaim)
+        {
+            continue;
+        }
+
+        // take vm_lock per page so faults needing swap in aren't held up for the whole pass
+        freed = 0;
+        while (frame_free_count() < high)
+        {
+            lock_acquire(vm_lock);
+            int result = evict_one(&victim_hand, NULL);
+            lock_release(vm_lock);
+            if (result != 0)
+            {
+                break;
+            }
+            freed++;
+        }
+
+        spinlock_acquire(&reclaim_lock);
+        rstats.passes++;
+        reclaim_stuck = (freed == 0 && frame_free_count() == 0);
+        if (reclaim_stuck)
+        {
+            rstats.failures++;
+        }
+        reclaim_generation++;
+        wchan_wakeall(reclaim_done_wchan, &reclaim_lock);
+        spinlock_release(&reclaim_lock);
+    }
+}
+
+// caller holds reclaim_lock
+static void reclaim_kick(void)
+{
+    KASSERT(spinlock_do_i_hold(&reclaim_lock));
+    if (!reclaim_wanted)
+    {
+        reclaim_wanted = true;
+        rstats.wakeups++;
+        wchan_wakeone(reclaim_wchan, &reclaim_lock);
+    }
+}
+
+// Called after every frame allocation, wakes the daemon below the low watermark
+// Never sleeps, so it is safe from alloc_kpages
+void reclaim_check(void)
+{
+    if (reclaim_wchan == NULL || frame_free_count() >= reclaim_low)
+    {
+        return;
+    }
+    spinlock_acquire(&reclaim_lock);
+    reclaim_kick();
+    spinlock_release(&reclaim_lock);
+}
+
+/**
+ * @brief: push out one of AS's own pages, for a process at its resident limit
+ *
+ * this is done by the faulting process itself rather than the daemon, so a
+ * process over its limit only slows itself down
+ *
+ * @return: 0 if a page was evicted, otherwise the fault should fail
+ */
+int reclaim_self(struct addrspace* as)
+{
+    KASSERT(as != NULL);
+    lock_acquire(vm_lock);
+    int result = evict_one(&self_hand, as);
+    lock_release(vm_lock);
+
+    spinlock_acquire(&reclaim_lock);
+    if (result == 0)
+    {
+        rstats.self_evictions++;
+    }
+    else
+    {
+        rstats.self_failures++;
+    }
+    spinlock_release(&reclaim_lock);
+    return result;
+}
+
+// Below the low watermark, optional work (prefaulting) should back off
+bool reclaim_memory_low(void)
+{
+    return reclaim_wchan != NULL && frame_free_count() < reclaim_low;
+}
+
+/**
+ * @brief: wait for the daemon to finish a reclaim pass, when the free list is empty
+ *
+ * @return: 0 if it's worth trying to allocate again, ENOMEM if nothing can be reclaimed
+ * or we are in a context that can't sleep (or would deadlock the daemon)
+ */
+int reclaim_wait(void)
+{
+    if (reclaim_wchan == NULL || curthread->t_in_interrupt
+        || curcpu->c_spinlocks > 0 || curthread == reclaim_thread
+        || lock_do_i_hold(vm_lock))
+    {
+        return ENOMEM;
+    }
+
+    spinlock_acquire(&reclaim_lock);
+    rstats.stalls++;
+    unsigned gen = reclaim_generation;
+    reclaim_kick();
+    while (reclaim_generation == gen)
+    {
+        wchan_sleep(reclaim_done_wchan, &reclaim_lock);
+    }
+    bool failed = reclaim_stuck && frame_free_count() == 0;
+    spinlock_release(&reclaim_lock);
+    return failed ? ENOMEM : 0;
+}
+
+// Called from hardclock on cpu 0 with the ticks since the last call (more than one
+// if the cpu went tickless), wakes the daemon for a sampling pass now and then
+void vm_hardclock(unsigned ticks)
+{
+    if (reclaim_wchan == NULL)
+    {
+        return;
+    }
+    spinlock_acquire(&reclaim_lock);
+    ref_ticks += ticks;
+    if (ref_interval != 0 && ref_ticks >= ref_interval)
+    {
+        ref_ticks = 0;
+        if (!sample_wanted)
+        {
+            sample_wanted = true;
+            wchan_wakeone(reclaim_wchan, &reclaim_lock);
+        }
+    }
+    spinlock_release(&reclaim_lock);
+}
+
+void refsample_get_rate(unsigned* interval, unsigned* batch)
+{
+    spinlock_acquire(&reclaim_lock);
+    *interval = ref_interval;
+    *batch = ref_batch;
+    spinlock_release(&reclaim_lock);
+}
+
+// interval in hardclocks (0 turns sampling off), batch in pages per pass
+int refsample_set_rate(unsigned interval, unsigned batch)
+{
+    if (interval != 0 && batch == 0)
+    {
+        return EINVAL;
+    }
+    spinlock_acquire(&reclaim_lock);
+    ref_interval = interval;
+    ref_batch = batch;
+    ref_ticks = 0;
+    spinlock_release(&reclaim_lock);
+    return 0;
+}
+
+void reclaim_get_watermarks(int* low, int* high)
+{
+    spinlock_acquire(&reclaim_lock);
+    *low = reclaim_low;
+    *high = reclaim_high;
+    spinlock_release(&reclaim_lock);
+}
+
+int reclaim_set_watermarks(int low, int high)
+{
+    if (low < 1 || high <= low)
+    {
+        return EINVAL;
+    }
+    spinlock_acquire(&reclaim_lock);
+    reclaim_low = low;
+    reclaim_high = high;
+    spinlock_release(&reclaim_lock);
+    reclaim_check();
+    return 0;
+}
+
+void coreswap_printstats(void)
+{
+    struct reclaim_stats snap;
+    unsigned used, slots;
+    int low, high;
+
+    spinlock_acquire(&reclaim_lock);
+    snap = rstats;
+    low = reclaim_low;
+    high = reclaim_high;
+    spinlock_release(&reclaim_lock);
+
+    spinlock_acquire(&swap_lock);
+    used = swap_used;
+    slots = swap_slots;
+    spinlock_release(&swap_lock);
+
+    kprintf("    free frames:             %d (low %d, high %d)\n",
+            frame_free_count(), low, high);
+    kprintf("    reclaim wakeups/passes:  %u/%u (nothing freed: %u)\n",
+            snap.wakeups, snap.passes, snap.failures);
+    kprintf("    pages swapped out/in:    %u/%u\n", snap.pageouts, snap.pageins);
+    kprintf("    evicted without write:   %u clean, %u zero\n",
+            snap.clean_drops, snap.zero_drops);
+    kprintf("    allocation stalls:       %u\n", snap.stalls);
+    kprintf("    second chances:          %u\n", snap.second_chances);
+    kprintf("    ref sampling passes:     %u (pages %u, referenced %u)\n",
+            snap.samples, snap.sampled, snap.ref_cleared);
+    kprintf("    rss limit evictions:     %u (nothing to evict: %u)\n",
+            snap.self_evictions, snap.self_failures);
+    kprintf("    swap slots in use:       %u/%u%s\n", used, slots,
+            swap_disabled ? " (disabled)" : "");
+    zswap_printstats(snap.pageins);
+}
+
+// Called from vm_bootstrap once the frame table is up
+void init_coreswap(void)
+{
+    KASSERT(vm_lock != NULL);
+
+    zswap_bootstrap(frame_free_count());
+    int total = frame_free_count();
+    reclaim_nframes = total;
+    reclaim_low = total / RECLAIM_LOW_DIVISOR;
+    reclaim_high = total / RECLAIM_HIGH_DIVISOR;
+    if (reclaim_low < 1)
+    {
+        reclaim_low = 1;
+    }
+    if (reclaim_high <= reclaim_low)
+    {
+        reclaim_high = reclaim_low + 1;
+    }
+
+    reclaim_wchan = wchan_create("reclaim");
+    reclaim_done_wchan = wchan_create("reclaim_done");
+    if (reclaim_wchan == NULL || reclaim_done_wchan == NULL)
+    {
+        panic("init_coreswap: out of memory\n");
+    }
+
+    int result = thread_fork("reclaimd", NULL, reclaim_daemon, NULL, 0);
+    if (result != 0)
+    {
+        panic("init_coreswap: can't start reclaim daemon: %s\n", strerror(result));
+    }
+    DEBUG(DB_VM, "reclaim daemon started, low %d high %d\n", reclaim_low, reclaim_high);
+}
@@ -6,6 +6,7 @@
 #include <clock.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coreswap.h>
 
 /* Place your frametable data-structures here
  * You probably also want to write a frametable initialisation
@@ -23,7 +24,7 @@ struct frame_entry* free_entry_list = NULL;
 int frametable_size = 0; // max index of frame_table
 
 paddr_t firstfree_addr = 0;
-static struct spinlock frame_lock = SPINLOCK_INITIALIZER;
+static struct spinlock frame_lock = SPINLOCK_TICKET_INITIALIZER;
 
 static struct spinlock free_frame_list_lock = SPINLOCK_INITIALIZER;
 
@@ -44,7 +45,6 @@ static bool is_user_frame(struct frame_entry * frame)
 {
     KASSERT(frame != NULL);
     return (frame ->frame_status == USER_FRAME
-            && frame->owner == NULL
             && frame->next_free == NULL
             &&frame-> locked == 0);
 }
@@ -63,9 +63,12 @@ static void clear_frame(struct frame_entry* frame, int frame_status)
     KASSERT(spinlock_do_i_hold(&frame_lock));
     KASSERT(frame != NULL);
     frame->owner = NULL;
+    frame->vaddr = 0;
+    frame->swap_slot = -1;
     frame->frame_status = frame_status;
     frame->locked = 0;
     frame->pinned = 0;
+    frame->sharers = 0;
     frame->next_free = NULL;
     as_zero_region(frame->p_addr, 1);
     return ;
@@ -79,8 +82,11 @@ static void free_frame_entry(struct frame_entry* entry)
     spinlock_acquire(&free_frame_list_lock);
     KASSERT(entry->next_free == NULL);
     entry->owner = NULL;
+    entry->vaddr = 0;
+    entry->swap_slot = -1;
     entry->frame_status = FREE_FRAME;
     entry->locked  = 0;
+    entry->sharers = 0;
     entry->next_free = free_entry_list;
     free_entry_list = entry;
 
@@ -163,6 +169,8 @@ vaddr_t alloc_kpages(unsigned int npages)
         clear_frame(tmp, KERNEL_FRAME);
         spinlock_release(&frame_lock);
 
+        // can't wait for reclaim here, we may be under a spinlock, but get it going
+        reclaim_check();
         /* DEBUG(DB_VM, "alloc_kpages via vm %x\n", tmp->p_addr); */
         return PADDR_TO_KVADDR(tmp->p_addr);
     }
@@ -185,25 +193,167 @@ static vaddr_t alloc_upages()
 }
 
 // Returns a free frame from the frame table
+// If there is none this waits for the reclaim daemon, so the caller must not hold
+// vm_lock or any spinlock. Returns 0 only if nothing more can be reclaimed.
 paddr_t get_free_frame(void)
 {
 
     vaddr_t addr = alloc_upages();
-    if (addr == 0)
+    while (addr == 0)
     {
-        return 0;
+        if (reclaim_wait() != 0)
+        {
+            return 0;
+        }
+        addr = alloc_upages();
     }
+    reclaim_check();
     return KVADDR_TO_PADDR(addr);
 }
 
+// Records which page maps this user frame, from now on it may be evicted
+void set_frame_owner(paddr_t paddr, void* owner, vaddr_t vaddr)
+{
+    int frametable_index = paddr_2_frametable_idx(paddr);
+    spinlock_acquire(&frame_lock);
+    struct frame_entry* frame = frame_table + frametable_index;
+    KASSERT(frame->frame_status == USER_FRAME);
+    frame->owner = owner;
+    frame->vaddr = vaddr & PAGE_FRAME;
+    spinlock_release(&frame_lock);
+}
+
+// The page mapping this user frame, NULL if none (or it is merged, see ksm.c)
+void* get_frame_owner(paddr_t paddr, vaddr_t* vaddr)
+{
+    int frametable_index = paddr_2_frametable_idx(paddr);
+    spinlock_acquire(&frame_lock);
+    struct frame_entry* frame = frame_table + frametable_index;
+    void* owner = frame->frame_status == USER_FRAME ? frame->owner : NULL;
+    *vaddr = frame->vaddr;
+    spinlock_release(&frame_lock);
+    return owner;
+}
+
+// Keep a user frame where it is (e.g. while the kernel copies to it), or let it go again;
+// pins nest, the frame can be evicted again once none are left
+void set_frame_pinned(paddr_t paddr, bool pin)
+{
+    int frametable_index = paddr_2_frametable_idx(paddr);
+    spinlock_acquire(&frame_lock);
+    struct frame_entry* frame = frame_table + frametable_index;
+    KASSERT(frame->frame_status == USER_FRAME);
+    if (pin)
+    {
+        frame->pinned++;
+    }
+    else
+    {
+        KASSERT(frame->pinned > 0);
+        frame->pinned--;
+    }
+    spinlock_release(&frame_lock);
+}
+
+// A merged frame is mapped by SHARERS ptes and belongs to none of them,
+// so the clock hands pass it over; 0 makes it an ordinary frame again
+void set_frame_sharers(paddr_t paddr, int sharers)
+{
+    int frametable_index = paddr_2_frametable_idx(paddr);
+    spinlock_acquire(&frame_lock);
+    struct frame_entry* frame = frame_table + frametable_index;
+    KASSERT(frame->frame_status == USER_FRAME && sharers >= 0);
+    frame->sharers = sharers;
+    if (sharers > 0)
+    {
+        frame->owner = NULL;
+        frame->vaddr = 0;
+    }
+    spinlock_release(&frame_lock);
+}
+
+int get_frame_sharers(paddr_t paddr)
+{
+    int frametable_index = paddr_2_frametable_idx(paddr);
+    spinlock_acquire(&frame_lock);
+    int sharers = frame_table[frametable_index].frame_status == USER_FRAME
+                  ? frame_table[frametable_index].sharers : 0;
+    spinlock_release(&frame_lock);
+    return sharers;
+}
+
+// The swap copy of a resident page, kept so a clean page can be evicted without writing it
+void set_frame_swap_slot(paddr_t paddr, int slot)
+{
+    int frametable_index = paddr_2_frametable_idx(paddr);
+    spinlock_acquire(&frame_lock);
+    KASSERT(frame_table[frametable_index].frame_status == USER_FRAME);
+    frame_table[frametable_index].swap_slot = slot;
+    spinlock_release(&frame_lock);
+}
+
+int get_frame_swap_slot(paddr_t paddr)
+{
+    int frametable_index = paddr_2_frametable_idx(paddr);
+    spinlock_acquire(&frame_lock);
+    int slot = frame_table[frametable_index].swap_slot;
+    spinlock_release(&frame_lock);
+    return slot;
+}
+
+/**
+ * @brief: step a clock hand round the frame table to the next mapped user frame
+ *
+ * used for picking eviction victims and for reference sampling, each with its own
+ * hand. the caller should hold vm_lock, so the owner can't be destroyed or the frame
+ * freed under it
+ *
+ * @param: hand  index into frame_table, advanced past the frame returned
+ *
+ * @return: 0 if there is no such frame, otherwise the frame with its owner and vaddr
+ */
+paddr_t next_user_frame(int* hand, void** owner, vaddr_t* vaddr)
+{
+    KASSERT(hand != NULL && owner != NULL && vaddr != NULL);
+    spinlock_acquire(&frame_lock);
+    for (int n = 0; n < frametable_size; n++)
+    {
+        struct frame_entry* frame = frame_table + *hand;
+        *hand = (*hand + 1) % frametable_size;
+        if (frame->frame_status != USER_FRAME || frame->owner == NULL
+            || frame->pinned || frame->locked != 0)
+        {
+            continue;
+        }
+        *owner = frame->owner;
+        *vaddr = frame->vaddr;
+        spinlock_release(&frame_lock);
+        return frame->p_addr;
+    }
+    spinlock_release(&frame_lock);
+    return 0;
+}
+
+int frame_free_count(void)
+{
+    return free_list_count;
+}
+
 void free_upages(paddr_t paddr)
 {
     int frametable_index = paddr_2_frametable_idx(paddr);
     /* DEBUG(DB_VM, "free: %x\n", paddr); */
     spinlock_acquire(&frame_lock);
     KASSERT(is_user_frame(frame_table + frametable_index));
+    int slot = frame_table[frametable_index].swap_slot;
+    frame_table[frametable_index].swap_slot = -1;
     spinlock_release(&frame_lock);
 
+    // the page is going away, so is its copy in swap
+    if (slot >= 0)
+    {
+        free_swap_slot((unsigned)slot);
+    }
     free_frame_entry(frame_table + frametable_index);
     return;
 
@@ -259,9 +409,12 @@ void init_frametable()
         {
             struct frame_entry* frame = &(frame_table[i]);
             frame->owner = NULL;
+            frame->vaddr = 0;
+            frame->swap_slot = -1;
             frame->frame_status = KERNEL_FRAME;
             frame->locked = 0;
             frame->pinned = 0;
+            frame->sharers = 0;
             frame->next_free = NULL;
         }
     }
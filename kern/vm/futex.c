@@ -0,0 +1,195 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <copyinout.h>
+#include <vm.h>
+#include <futex.h>
+
+/*
+ * Futexes: user level locks only come into the kernel to sleep when
+ * they are contended and to wake the sleepers.
+ *
+ * A futex is an aligned int in user memory, known by the physical
+ * address of its frame, looked up in the page table. Waiters go on a
+ * list in the bucket for that address, each with a wait channel of its
+ * own so a wake only wakes the threads it picked. While anyone sleeps
+ * on a frame it is pinned (vm_user_page_hold does that), so neither
+ * eviction nor ksm can move the page to another frame and leave the
+ * sleepers where no wake finds them; that also means a wake on a page
+ * that isn't resident can't have anyone to wake.
+ *
+ * futex_wait checks the value and queues itself holding the bucket
+ * lock, and futex_wake takes the same lock to look for waiters, so a
+ * wake that comes after the value was changed always sees the waiter.
+ *
+ * A wait that nothing will ever wake sleeps for good, like a P on a
+ * semfs semaphore that no one will V.
+ */
+
+struct futex_waiter
+{
+    paddr_t key;                   // physical address of the futex word
+    struct wchan* wchan;
+    bool woken;
+    struct futex_waiter* next;
+};
+
+struct futex_bucket
+{
+    struct spinlock lock;
+    struct futex_waiter* waiters;
+};
+
+static struct futex_bucket futex_table[FUTEX_NBUCKETS];
+
+// tries at faulting the futex page in before giving up
+#define FUTEX_HOLD_TRIES 4
+
+void futex_bootstrap(void)
+{
+    for (int i = 0; i < FUTEX_NBUCKETS; i++)
+    {
+        spinlock_init(&futex_table[i].lock);
+        futex_table[i].waiters = NULL;
+    }
+}
+
+static struct futex_bucket* futex_bucket(paddr_t key)
+{
+    return &futex_table[(key / sizeof(int)) % FUTEX_NBUCKETS];
+}
+
+/*
+ * Pin the page of UADDR, resident and private, and return the word's
+ * kseg0 address in KVADDR; vm_user_page_release lets it go. It's only
+ * read, so it isn't dirtied, unless it's merged by ksm: then the word
+ * is written back to give it a frame of its own (no one else can be
+ * writing it: processes have one thread and share no memory).
+ */
+static int futex_hold(userptr_t uaddr, vaddr_t* kvaddr)
+{
+    int val;
+    int result;
+
+    for (int i = 0; i < FUTEX_HOLD_TRIES; i++)
+    {
+        if (vm_user_page_hold((vaddr_t)uaddr, false, kvaddr))
+        {
+            return 0;
+        }
+        // faults it in if it isn't resident
+        result = copyin((const_userptr_t)uaddr, &val, sizeof(val));
+        if (result)
+        {
+            return result;
+        }
+        if (i > 0)
+        {
+            // resident and still not held, so merged
+            result = copyout(&val, uaddr, sizeof(val));
+            if (result)
+            {
+                return result;
+            }
+        }
+    }
+    return EFAULT;
+}
+
+int futex_wait(userptr_t uaddr, int val)
+{
+    struct futex_waiter waiter;
+    struct futex_bucket* bucket;
+    vaddr_t kvaddr;
+    int result;
+
+    if ((vaddr_t)uaddr % sizeof(int) != 0)
+    {
+        return EINVAL;
+    }
+
+    waiter.wchan = wchan_create("futex");
+    if (waiter.wchan == NULL)
+    {
+        return ENOMEM;
+    }
+
+    result = futex_hold(uaddr, &kvaddr);
+    if (result)
+    {
+        wchan_destroy(waiter.wchan);
+        return result;
+    }
+
+    waiter.key = KVADDR_TO_PADDR(kvaddr);
+    waiter.woken = false;
+
+    bucket = futex_bucket(waiter.key);
+    spinlock_acquire(&bucket->lock);
+    if (*(volatile int*)kvaddr != val)
+    {
+        spinlock_release(&bucket->lock);
+        vm_user_page_release(kvaddr);
+        wchan_destroy(waiter.wchan);
+        return EAGAIN;
+    }
+    waiter.next = bucket->waiters;
+    bucket->waiters = &waiter;
+    while (!waiter.woken)
+    {
+        wchan_sleep(waiter.wchan, &bucket->lock);
+    }
+    spinlock_release(&bucket->lock);
+
+    vm_user_page_release(kvaddr);
+    wchan_destroy(waiter.wchan);
+    return 0;
+}
+
+int futex_wake(userptr_t uaddr, int nwake, int* woken)
+{
+    struct futex_bucket* bucket;
+    struct futex_waiter** prevp;
+    struct futex_waiter* waiter;
+    vaddr_t kvaddr;
+    paddr_t key;
+    int val;
+    int n = 0;
+
+    if ((vaddr_t)uaddr % sizeof(int) != 0 || nwake < 0)
+    {
+        return EINVAL;
+    }
+
+    if (!vm_user_page_hold((vaddr_t)uaddr, false, &kvaddr))
+    {
+        // not resident (or merged), so not pinned, so no one is waiting;
+        // just check the address is good
+        *woken = 0;
+        return copyin((const_userptr_t)uaddr, &val, sizeof(val));
+    }
+    key = KVADDR_TO_PADDR(kvaddr);
+
+    bucket = futex_bucket(key);
+    spinlock_acquire(&bucket->lock);
+    prevp = &bucket->waiters;
+    while ((waiter = *prevp) != NULL && n < nwake)
+    {
+        if (waiter->key != key)
+        {
+            prevp = &waiter->next;
+            continue;
+        }
+        *prevp = waiter->next;
+        waiter->woken = true;
+        wchan_wakeone(waiter->wchan, &bucket->lock);
+        n++;
+    }
+    spinlock_release(&bucket->lock);
+    vm_user_page_release(kvaddr);
+
+    *woken = n;
+    return 0;
+}
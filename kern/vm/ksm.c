@@ -0,0 +1,432 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <clock.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <coreswap.h>
+#include <ksm.h>
+
+/*
+ * Same page merging.
+ *
+ * When turned on (vmksm), the ksmd thread walks the frame table with a
+ * clock hand of its own, a batch of frames a second, and hashes each
+ * mapped user page. A page whose hash matches an already merged frame,
+ * or a page seen earlier (the "unstable" candidates, which may since
+ * have changed), is compared byte for byte and, if it is the same,
+ * its pte is pointed at the one frame and its own frame freed.
+ *
+ * A merged frame belongs to no one: it counts its sharers instead of
+ * naming an owner, so it is never picked for eviction, and every pte
+ * mapping it has SHAREDMASK set and DIRTYMASK clear, so the TLB maps
+ * it read only. A write faults into ksm_unshare, which gives the
+ * writer a copy of its own; the last sharer just takes the frame back.
+ *
+ * Pages being compared are taken out of service the same way as a
+ * page being evicted, valid bit cleared and swap bit set, so a fault
+ * on one waits on vm_lock (in vm_swapin) until the scanner is done.
+ */
+
+struct ksm_candidate
+{
+    uint32_t hash;
+    paddr_t paddr;
+    struct addrspace* owner;
+    vaddr_t vaddr;
+};
+
+struct ksm_stable
+{
+    uint32_t hash;
+    paddr_t paddr;
+};
+
+// Counters reported by ksm_printstats
+struct ksm_stats
+{
+    unsigned scanned;   // pages hashed
+    unsigned merges;    // ptes pointed at a merged frame
+    unsigned mismatches; // hashes that matched and pages that didn't
+    unsigned unshares;  // write faults that copied a merged page
+    unsigned reclaims;  // ... that found themselves the last sharer
+    unsigned frames;    // merged frames now
+    unsigned sharers;   // ptes mapping them
+};
+
+static struct ksm_stats kstats;
+
+// protects ksm_rate and kstats
+static struct spinlock ksm_lock = SPINLOCK_INITIALIZER;
+static struct wchan* ksm_wchan = NULL; // the scanner waits here while it is off
+static unsigned ksm_rate = 0;
+
+// the rest belongs to the scanner, under vm_lock
+static int ksm_hand = 0;
+static struct ksm_candidate* unstable = NULL;
+static struct ksm_stable* stable = NULL;
+
+static uint32_t page_hash(paddr_t paddr)
+{
+    const uint32_t* words = (const uint32_t*)PADDR_TO_KVADDR(paddr);
+    uint32_t h = 2166136261U;
+
+    for (unsigned i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++)
+    {
+        h = (h ^ words[i]) * 16777619U;
+    }
+    return h;
+}
+
+static bool page_same(paddr_t a, paddr_t b)
+{
+    const uint32_t* wa = (const uint32_t*)PADDR_TO_KVADDR(a);
+    const uint32_t* wb = (const uint32_t*)PADDR_TO_KVADDR(b);
+
+    for (unsigned i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++)
+    {
+        if (wa[i] != wb[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void count(unsigned* counter, int n)
+{
+    spinlock_acquire(&ksm_lock);
+    *counter += n;
+    spinlock_release(&ksm_lock);
+}
+
+// Is VADDR of AS still an ordinary resident page in frame PADDR?
+static bool still_mapped(struct addrspace* as, vaddr_t vaddr, paddr_t paddr)
+{
+    paddr_t pte_paddr;
+    char control;
+    vaddr_t owner_vaddr;
+
+    if (get_frame_owner(paddr, &owner_vaddr) != as || owner_vaddr != vaddr)
+    {
+        return false;
+    }
+    if (get_page_entry(vaddr, (pid_t)as, &pte_paddr, &control) != 0)
+    {
+        return false;
+    }
+    return (control & VALIDMASK) && !(control & (SWAPMASK | SHAREDMASK))
+           && (pte_paddr & ENTRYMASK) == paddr;
+}
+
+// Take a page out of service while its frame is compared, as evict_one does
+static void freeze(struct addrspace* as, vaddr_t vaddr)
+{
+    reset_mask(vaddr, (pid_t)as, VALIDMASK);
+    set_mask(vaddr, (pid_t)as, SWAPMASK);
+    vm_tlbshootdown_range(as, vaddr, 1);
+}
+
+static void thaw(struct addrspace* as, vaddr_t vaddr)
+{
+    reset_mask(vaddr, (pid_t)as, SWAPMASK);
+    set_mask(vaddr, (pid_t)as, VALIDMASK);
+}
+
+// Point a frozen page's pte at merged frame SHARED; its own frame goes
+static void share(struct addrspace* as, vaddr_t vaddr, paddr_t own, paddr_t shared)
+{
+    paddr_t pte_paddr;
+    char control;
+
+    get_page_entry(vaddr, (pid_t)as, &pte_paddr, &control);
+    control = (control | VALIDMASK | SHAREDMASK) & ~(SWAPMASK | DIRTYMASK | REFMASK);
+    update_page_entry(vaddr, (pid_t)as, shared, control);
+    if (own != shared)
+    {
+        free_upages(own);
+    }
+}
+
+// Try merging the page at VADDR of AS (frame PADDR) into the merged frame SHARED
+static bool merge_stable(struct addrspace* as, vaddr_t vaddr, paddr_t paddr, paddr_t shared)
+{
+    freeze(as, vaddr);
+    if (!page_same(paddr, shared))
+    {
+        thaw(as, vaddr);
+        count(&kstats.mismatches, 1);
+        return false;
+    }
+    share(as, vaddr, paddr, shared);
+    set_frame_sharers(shared, get_frame_sharers(shared) + 1);
+
+    spinlock_acquire(&ksm_lock);
+    kstats.merges++;
+    kstats.sharers++;
+    spinlock_release(&ksm_lock);
+    return true;
+}
+
+// Try merging the page at VADDR of AS (frame PADDR) with an earlier candidate,
+// whose frame becomes the merged one
+static bool merge_unstable(struct addrspace* as, vaddr_t vaddr, paddr_t paddr,
+                           struct ksm_candidate* cand)
+{
+    freeze(cand->owner, cand->vaddr);
+    freeze(as, vaddr);
+    if (!page_same(paddr, cand->paddr))
+    {
+        thaw(as, vaddr);
+        thaw(cand->owner, cand->vaddr);
+        count(&kstats.mismatches, 1);
+        return false;
+    }
+
+    // the frame is the only copy from now on, and can't be evicted to its slot
+    int slot = get_frame_swap_slot(cand->paddr);
+    if (slot >= 0)
+    {
+        set_frame_swap_slot(cand->paddr, -1);
+        free_swap_slot((unsigned)slot);
+    }
+    set_frame_sharers(cand->paddr, 2);
+    share(cand->owner, cand->vaddr, cand->paddr, cand->paddr);
+    share(as, vaddr, paddr, cand->paddr);
+
+    spinlock_acquire(&ksm_lock);
+    kstats.merges += 2;
+    kstats.frames++;
+    kstats.sharers += 2;
+    spinlock_release(&ksm_lock);
+    return true;
+}
+
+// Hash the next mapped user frame and merge it if it can be
+static void scan_one(void)
+{
+    void* owner = NULL;
+    vaddr_t vaddr = 0;
+
+    KASSERT(lock_do_i_hold(vm_lock));
+    paddr_t paddr = next_user_frame(&ksm_hand, &owner, &vaddr);
+    if (paddr == 0)
+    {
+        return;
+    }
+    struct addrspace* as = owner;
+    if (as->is_loading || !still_mapped(as, vaddr, paddr))
+    {
+        return;
+    }
+
+    uint32_t hash = page_hash(paddr);
+    count(&kstats.scanned, 1);
+
+    struct ksm_stable* st = &stable[hash % KSM_STABLE];
+    if (st->paddr != 0 && st->hash == hash && get_frame_sharers(st->paddr) > 0
+        && merge_stable(as, vaddr, paddr, st->paddr))
+    {
+        return;
+    }
+
+    struct ksm_candidate* cand = &unstable[hash % KSM_UNSTABLE];
+    if (cand->paddr != 0 && cand->hash == hash && cand->paddr != paddr
+        && still_mapped(cand->owner, cand->vaddr, cand->paddr)
+        && !cand->owner->is_loading)
+    {
+        if (merge_unstable(as, vaddr, paddr, cand))
+        {
+            st->hash = hash;
+            st->paddr = cand->paddr;
+            cand->paddr = 0;
+            return;
+        }
+    }
+    cand->hash = hash;
+    cand->paddr = paddr;
+    cand->owner = as;
+    cand->vaddr = vaddr;
+}
+
+static void ksm_thread(void* data1, unsigned long data2)
+{
+    (void)data1;
+    (void)data2;
+
+    while (1)
+    {
+        spinlock_acquire(&ksm_lock);
+        while (ksm_rate == 0)
+        {
+            wchan_sleep(ksm_wchan, &ksm_lock);
+        }
+        unsigned batch = ksm_rate;
+        spinlock_release(&ksm_lock);
+
+        lock_acquire(vm_lock);
+        for (unsigned i = 0; i < batch; i++)
+        {
+            scan_one();
+        }
+        lock_release(vm_lock);
+
+        clocksleep(KSM_INTERVAL);
+    }
+}
+
+/**
+ * @brief: break the sharing of a merged page on a write to it
+ *
+ * the writer gets a copy in a frame of its own, marked dirty as it has no
+ * swap copy; the last sharer keeps the frame, which becomes an ordinary one.
+ *
+ * @return: 0 if the access can be retried, ENOMEM if there is no frame for the copy
+ */
+int ksm_unshare(struct addrspace* as, vaddr_t vaddr)
+{
+    paddr_t paddr;
+    char control;
+    pid_t pid = (pid_t)as;
+
+    // before vm_lock, this may wait for the reclaim daemon
+    paddr_t frame = get_free_frame();
+    if (frame == 0)
+    {
+        return ENOMEM;
+    }
+
+    lock_acquire(vm_lock);
+    int result = get_page_entry(vaddr, pid, &paddr, &control);
+    if (result != 0 || !(control & VALIDMASK) || !(control & SHAREDMASK))
+    {
+        // someone else sorted it out
+        lock_release(vm_lock);
+        free_upages(frame);
+        return 0;
+    }
+    paddr &= ENTRYMASK;
+    control = (control & ~SHAREDMASK) | DIRTYMASK;
+
+    int sharers = get_frame_sharers(paddr);
+    KASSERT(sharers > 0);
+    if (sharers == 1)
+    {
+        set_frame_sharers(paddr, 0);
+        set_frame_owner(paddr, as, vaddr);
+        update_page_entry(vaddr, pid, paddr, control);
+        lock_release(vm_lock);
+        free_upages(frame);
+
+        spinlock_acquire(&ksm_lock);
+        kstats.reclaims++;
+        kstats.frames--;
+        kstats.sharers--;
+        spinlock_release(&ksm_lock);
+        return 0;
+    }
+
+    memcpy((void*)PADDR_TO_KVADDR(frame), (void*)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+    update_page_entry(vaddr, pid, frame, control);
+    set_frame_owner(frame, as, vaddr);
+    set_frame_sharers(paddr, sharers - 1);
+    // another cpu may still have the read only mapping of the shared frame
+    vm_tlbshootdown_range(as, vaddr, 1);
+    lock_release(vm_lock);
+
+    spinlock_acquire(&ksm_lock);
+    kstats.unshares++;
+    kstats.sharers--;
+    spinlock_release(&ksm_lock);
+    return 0;
+}
+
+// Drop a pte's hold on a user frame: a merged frame goes with its last sharer
+void ksm_free_frame(paddr_t paddr)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    int sharers = get_frame_sharers(paddr);
+    if (sharers == 0)
+    {
+        free_upages(paddr);
+        return;
+    }
+
+    spinlock_acquire(&ksm_lock);
+    kstats.sharers--;
+    if (sharers == 1)
+    {
+        kstats.frames--;
+    }
+    spinlock_release(&ksm_lock);
+
+    if (sharers == 1)
+    {
+        set_frame_sharers(paddr, 0);
+        free_upages(paddr);
+    }
+    else
+    {
+        set_frame_sharers(paddr, sharers - 1);
+    }
+}
+
+unsigned ksm_get_rate(void)
+{
+    spinlock_acquire(&ksm_lock);
+    unsigned rate = ksm_rate;
+    spinlock_release(&ksm_lock);
+    return rate;
+}
+
+void ksm_set_rate(unsigned pages)
+{
+    spinlock_acquire(&ksm_lock);
+    ksm_rate = pages;
+    wchan_wakeall(ksm_wchan, &ksm_lock);
+    spinlock_release(&ksm_lock);
+}
+
+void ksm_printstats(void)
+{
+    struct ksm_stats snap;
+
+    spinlock_acquire(&ksm_lock);
+    snap = kstats;
+    spinlock_release(&ksm_lock);
+
+    kprintf("    ksm pages scanned:       %u (hash matches that differed: %u)\n",
+            snap.scanned, snap.mismatches);
+    kprintf("    ksm merged frames:       %u, mapped %u times (%u KB saved)\n",
+            snap.frames, snap.sharers, (snap.sharers - snap.frames) * PAGE_SIZE / 1024);
+    kprintf("    ksm merges/unshares:     %u/%u (last sharer: %u)\n",
+            snap.merges, snap.unshares, snap.reclaims);
+}
+
+// Called from vm_bootstrap, the scanner starts off
+void ksm_bootstrap(void)
+{
+    COMPILE_ASSERT(KSM_UNSTABLE * sizeof(struct ksm_candidate) <= PAGE_SIZE);
+    COMPILE_ASSERT(KSM_STABLE * sizeof(struct ksm_stable) <= PAGE_SIZE);
+
+    unstable = kmalloc(KSM_UNSTABLE * sizeof(struct ksm_candidate));
+    stable = kmalloc(KSM_STABLE * sizeof(struct ksm_stable));
+    ksm_wchan = wchan_create("ksm");
+    if (unstable == NULL || stable == NULL || ksm_wchan == NULL)
+    {
+        panic("ksm_bootstrap: out of memory\n");
+    }
+    bzero(unstable, KSM_UNSTABLE * sizeof(struct ksm_candidate));
+    bzero(stable, KSM_STABLE * sizeof(struct ksm_stable));
+
+    int result = thread_fork("ksmd", NULL, ksm_thread, NULL, 0);
+    if (result != 0)
+    {
+        panic("ksm_bootstrap: can't start scanner: %s\n", strerror(result));
+    }
+}
@@ -1,370 +1,197 @@
 
+#include <types.h>
+#include <kern/errno.h>
 #include <pagetable.h>
-#include <hashlib.h>
 #include <vm.h>
 #include <lib.h>
+#include <addrspace.h>
 
-#define ENOPTE 4
-#define HASHLENGTH 8
-// Global structs to define
-
-static struct hashed_page_table *hpt = NULL;
-
-// hashtable_size should be initialised in the init function
-static int hashtable_size = 0;
-static const void *emptypointer = NULL;
+/*
+    Page table front end
 
-// Prototypes defined to avoid compiler error
-static void construct_key( vaddr_t vaddr, pid_t pid , unsigned char* ptr );
-static struct hpt_entry* get_free_entry( void );
-static bool is_equal(vaddr_t vaddr ,pid_t pid , struct hpt_entry* current );
-static void store_in_table( vaddr_t vaddr, pid_t pid, paddr_t paddr, char control, struct hpt_entry* hpt_ent );
-static void set_page_zero( struct hpt_entry* current );
+    Everything here works on copies of entries (struct pt_pte) through the
+    backend's get/set under its lock, so a backend only has to find, add and
+    drop entries. See pt_hashed.c and pt_twolevel.c.
+   */
 
-/*  Hash algorithm to calculate the value pair for the given key
-    Note the hash's key is the virtual page address and the process id (which is what it acts on)
-    This function should return an integer index into the array of the hash table entries
-*/
-static int hash( vaddr_t vaddr , pid_t pid )
+static const struct pt_backend *const pt_backends[] =
 {
-    KASSERT(vaddr != 0);
-    unsigned char key[HASHLENGTH];
-
-    construct_key(vaddr, pid, key);
-    int index = calculate_hash(key, HASHLENGTH, hashtable_size);
-
-    return index;
-    // return 1;
+    &pt_hashed_backend,
+    &pt_twolevel_backend,
+    NULL
+};
+
+// The backend in use; it only changes while there are no user address spaces
+static const struct pt_backend *pt = &pt_hashed_backend;
+
+// address spaces alive, so we know when it is safe to switch backend
+static unsigned pt_live_as = 0;
+static struct spinlock pt_select_lock = SPINLOCK_INITIALIZER;
+
+// Keep the owner's resident page count in step with the valid bit
+// The pid is the owning address space, so the count lives there
+// WARNING no lock for this function, caller must have the backend lock for pid
+static void account_resident( pid_t pid, char old_control, char new_control )
+{
+    struct addrspace *as = (struct addrspace *) pid;
+    if ( !(old_control & VALIDMASK) && (new_control & VALIDMASK) )
+    {
+        as->rss++;
+    }
+    else if ( (old_control & VALIDMASK) && !(new_control & VALIDMASK) )
+    {
+        KASSERT(as->rss > 0);
+        as->rss--;
+    }
 }
 
 // this initialises the page table
 void init_page_table( void )
 {
-    // no need to lock here
-    ram_size = ram_getsize();
-    KASSERT( ram_size > 0 );
-
-    DEBUG(DB_VM, "RAM SIZE is %d\n", ram_size);
-    // allocate the memory for the hashed_page_table
-    hpt = (struct hashed_page_table *) kmalloc(sizeof(*hpt));
-    KASSERT(hpt != NULL);
-
-    // it should technically be round(ram_size/PAGE_SIZE) which is
-    // if ram_size == 4095 then number_of_frames = 1
-    int number_of_frames = ram_size/PAGE_SIZE;
-
-    // The size of hashtable is only equal to the 2 * number of frames
-    hashtable_size = 2*number_of_frames;
-
-    // Allocate for the hpt_entries array, kmalloc will call ram_stealmem if the vm bootstrap hasnt been complete
-    hpt->hpt_entry = kmalloc(hashtable_size * sizeof(struct hpt_entry));
-    KASSERT(hpt->hpt_entry != NULL);
-
-    DEBUG(DB_VM, "Hash Page Table Initialised...\n");
-    // set all values hpt_entries (vaddr and paddr) to point to global free pointer and others to 0
-    hpt->hpt_lock = kmalloc(sizeof(struct spinlock));
-    // Initialise locks
-    spinlock_init(hpt->hpt_lock);
-
     int i = 0;
-    spinlock_acquire(hpt->hpt_lock);
-    for (i = 0; i<hashtable_size; i++)
+    for (i = 0; pt_backends[i] != NULL; i++)
     {
-        set_page_zero(&(hpt->hpt_entry[i]));
+        pt_backends[i]->bootstrap();
     }
-    spinlock_release(hpt->hpt_lock);
-
-#ifdef DEBUGLOAD
-    // set load to zero
-    hpt->load = 0;
-#endif
-    DEBUG(DB_VM, "Number of Page table entries = %d\nHash table Load: %2d\n", hashtable_size, hpt->load);
-
-    DEBUG(DB_VM, "Size of hpt_entry: %2d\n", sizeof(struct hpt_entry));
-    unsigned long size_inbytes_pagetable = hashtable_size * sizeof(struct hpt_entry);
-    DEBUG(DB_VM, "Size of Page table: %2lu\n", size_inbytes_pagetable );
 }
 
-// Helper function to construct the key for the hash function
-static void construct_key( vaddr_t vaddr, pid_t pid , unsigned char* ptr )
+int pt_select( const char *name )
 {
-    int i;
-    for(i=0;i<8;i++)
+    int i = 0;
+    for (i = 0; pt_backends[i] != NULL; i++)
     {
-        if(i<4)
-            ptr[i] = ( vaddr >> (i*8) ) & 0xff;
-        else
-            ptr[i] = ( pid >> ((i-4)*8) ) & 0xff;
+        if (strcmp(pt_backends[i]->name, name) == 0)
+        {
+            break;
+        }
     }
-}
-
-// See if there are collisions with the hash index
-static bool is_colliding( vaddr_t vaddr, pid_t pid )
-{
-    int index = hash(vaddr,pid);
-    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
-
-    if (    (hpt->hpt_entry[index].vaddr == (vaddr_t)emptypointer) &&
-            (hpt->hpt_entry[index].pid == 0) &&
-            (hpt->hpt_entry[index].control == 0) &&
-            (hpt->hpt_entry[index].paddr == (paddr_t) emptypointer)
-       )
+    if (pt_backends[i] == NULL)
     {
-        return false;
+        return EINVAL;
     }
-   /* if ( hpt->hpt_entry[index].next == (struct hpt_entry *) emptypointer )
+
+    spinlock_acquire(&pt_select_lock);
+    if (pt_live_as != 0 && pt != pt_backends[i])
     {
-        return false;
-    }*/
-    return true;
+        spinlock_release(&pt_select_lock);
+        return EBUSY;
+    }
+    pt = pt_backends[i];
+    spinlock_release(&pt_select_lock);
+    return 0;
 }
 
-// WARNING no lock for this function, caller must have lock between this function
-static void store_in_table( vaddr_t vaddr, pid_t pid, paddr_t paddr, char control, struct hpt_entry* hpt_ent )
+const char *pt_name( void )
 {
-    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
-    hpt_ent->vaddr = vaddr;
-    hpt_ent->paddr = paddr;
-    hpt_ent->control = control;
-    hpt_ent->pid = pid;
-    hpt_ent->next = NULL;
+    return pt->name;
 }
 
-// WARNING no lock for this function, caller must have lock between this function
-static void set_page_zero( struct hpt_entry* current )
+// Names of the backends by index, NULL past the last one
+const char *pt_backend_name( int index )
 {
-    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
-    store_in_table( (vaddr_t) emptypointer, 0 ,(paddr_t) emptypointer, 0, current);
+    KASSERT(index >= 0);
+    int i = 0;
+    for (i = 0; i < index && pt_backends[i] != NULL; i++);
+    return pt_backends[i] == NULL ? NULL : pt_backends[i]->name;
 }
 
-// To store an entry into the page table
-bool store_entry( vaddr_t vaddr , pid_t pid, paddr_t paddr , char control )
+void pt_getstats( struct pt_stats *st )
 {
-    KASSERT(vaddr != (vaddr_t) emptypointer);
-
-    // Get the page and frame numbers (upper 20 bits only)
-    vaddr = vaddr & ENTRYMASK;
-    paddr = paddr & ENTRYMASK;
+    KASSERT(st != NULL);
+    pt->stats(st);
+}
 
-    int index = hash(vaddr,pid);
+int pt_as_create( struct addrspace *as )
+{
+    spinlock_acquire(&pt_select_lock);
+    pt_live_as++;
+    spinlock_release(&pt_select_lock);
 
-    spinlock_acquire(hpt->hpt_lock);
-    if ( !is_colliding( vaddr , pid ) )
+    int result = pt->as_create(as);
+    if (result != 0)
     {
-        store_in_table(vaddr, pid, paddr, control, &(hpt->hpt_entry[index]) );
-        #ifdef DEBUGLOAD
-        hpt->load++;
-        #endif
+        spinlock_acquire(&pt_select_lock);
+        pt_live_as--;
+        spinlock_release(&pt_select_lock);
     }
-    else
-    {
-       // kprintf("in colliding code\n");
-        //kprintf("index: %d vaddr:%x pid:%x paddr:%x\n",index,vaddr,pid,paddr);
-        // index pointer
-        struct hpt_entry *current = &(hpt->hpt_entry[index]);
-        // The chained pointer
-        struct hpt_entry *nextchained = hpt->hpt_entry[index].next;
-
-        // Get free entry from pool
-        struct hpt_entry *free = get_free_entry();
-
-        // TODO When there are no more free nodes
-        if ( free == NULL )
-        {
-            spinlock_release(hpt->hpt_lock);
-            // TODO this needs a *retval to be set to error no ENOMEM
-            return false;
-        }
-        // Store in table
-        store_in_table( vaddr, pid, paddr, control, free );
-        // link in the next chain
-        current->next = free;
-        // What if free is NULL
-        free->next = nextchained;
-    }
-    spinlock_release(hpt->hpt_lock);
-    return true;
+    return result;
 }
 
-// Gets an entry from the pool
-static struct hpt_entry* get_free_entry( void )
+void pt_as_destroy( struct addrspace *as )
 {
-    return kmalloc(sizeof(struct hpt_entry));
+    pt->as_destroy(as);
+    spinlock_acquire(&pt_select_lock);
+    KASSERT(pt_live_as > 0);
+    pt_live_as--;
+    spinlock_release(&pt_select_lock);
 }
 
-// TODO do we need to check with the permission of the page to compare before removing?
-// Remove an entry from the hash table
-int remove_page_entry( vaddr_t vaddr, pid_t pid )
+// To store an entry into the page table
+bool store_entry( vaddr_t vaddr , pid_t pid, paddr_t paddr , char control )
 {
-    KASSERT(vaddr != (vaddr_t) emptypointer);
-    // Get the page number (upper 20 bits)
-    vaddr = vaddr & ENTRYMASK;
-
-    // Get hash index
-    int index = hash(vaddr, pid);
-    spinlock_acquire(hpt->hpt_lock);
-    struct hpt_entry *current = &(hpt->hpt_entry[index]);
-    struct hpt_entry *prev;
+    KASSERT(vaddr != 0);
+    struct pt_pte pte;
 
-    //kprintf("\tIndex is:%d, vaddr: %x and pid: %x\n",index,vaddr,pid);
-    // Check if the index matches the vaddr and pid
-    if ( is_equal(vaddr,pid,current) )
-    {
-        if (current->next == NULL)
-        {
-            set_page_zero(current);
-
-#ifdef DEBUGLOAD
-            //kprintf("in here\n");
-            hpt->load--;
-#endif
-            spinlock_release(hpt->hpt_lock);
-            return 0;
-        }
-        else
-        {
+    // Get the page and frame numbers (upper 20 bits only)
+    vaddr = vaddr & ENTRYMASK;
+    pte.paddr = paddr & ENTRYMASK;
+    pte.control = control;
 
-            /* kprintf("+%x, %x\n", (unsigned int)current, (unsigned int)current->next); */
-            unsigned int tmp = (unsigned int ) current->next->next;
-            struct hpt_entry* fuck = current->next;
-            memcpy(current, current->next, sizeof(*current));
-            /* kprintf("-%x, %x\n", (unsigned int)current, (unsigned int)current->next); */
-            /* KASSERT(current->next != NULL); */
-            kfree(fuck);
-            current->next = (struct hpt_entry*) tmp;
-#ifdef DEBUGLOAD
-            hpt->load--;
-#endif
-            spinlock_release(hpt->hpt_lock);
-            return 0;
-        }
-    }
-    else
+    pt->lock(pid);
+    int result = pt->insert(vaddr, pid, &pte);
+    if (result == 0)
     {
-        prev = current;
-        current = current->next;
-        while( current != NULL )
-        {
-            // check if the vaddr and pid are the same
-            // if they are then release that node to the free pool
-            if( is_equal(vaddr,pid,current) )
-            {
-                // Redirect the pointers
-                prev->next = current->next;
-
-                // set to zeros
-                // TODO this is not really necessary
-                // If its in the free pool the data dosent matter
-                set_page_zero(current);
-
-                // Release node into free pool
-                kfree(current);
-
-                spinlock_release(hpt->hpt_lock);
-                return 0;
-            }
-            prev = current;
-            current = current->next;
-        }
-        spinlock_release(hpt->hpt_lock);
-        return -1;
+        account_resident(pid, 0, control);
     }
+    pt->unlock(pid);
+    return result == 0;
 }
 
-// TODO what about the control bits, should we check against that? I dont think so
-// Gets the physical frame address in memory
-static struct hpt_entry* get_page( vaddr_t vaddr , pid_t pid )
+// Remove an entry from the page table
+int remove_page_entry( vaddr_t vaddr, pid_t pid )
 {
-    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
-    KASSERT(vaddr != (vaddr_t) emptypointer);
+    KASSERT(vaddr != 0);
+    struct pt_pte old;
 
     // Get the page number (upper 20 bits)
     vaddr = vaddr & ENTRYMASK;
 
-    // Get hash index
-    int index = hash(vaddr, pid);
-    /* spinlock_acquire(hpt->hpt_lock); */
-    struct hpt_entry* current = &(hpt->hpt_entry[index]);
-
-    // Check if the index entry matches the vaddr and pid
-    if ( is_equal(vaddr,pid,current) )
+    pt->lock(pid);
+    int result = pt->remove(vaddr, pid, &old);
+    if (result == 0)
     {
-        /* spinlock_release(hpt->hpt_lock); */
-        return current;
+        account_resident(pid, old.control, 0);
     }
-    else
-    {
-        // Still have the lock
-        current = current->next;
-        while( current != NULL )
-        {
-            // check if the vaddr and pid are the same
-            // if they are then return current pointer
-            if( is_equal(vaddr,pid,current) )
-            {
-                /* spinlock_release(hpt->hpt_lock); */
-                return current;
-            }
-            current = current->next;
-        }
-    }
-    // if we get here then current should be NULL
-    /* spinlock_release(hpt->hpt_lock); */
-    KASSERT(current == NULL);
-    return NULL;
-    /* return current; */
-}
-
-/* // TODO */
-/* // Allocate a page and return the index */
-/* struct hpt_entry* allocate_page( void ) */
-/* { */
-/*     return NULL; */
-/* } */
-
-// WARNING this dosent have a lock the caller should have a lock around this!!!
-static bool is_equal(vaddr_t vaddr ,pid_t pid , struct hpt_entry* current )
-{
-    KASSERT(current != NULL);
-    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
-    // Fixed as vaddr is only the top 20 bits now
-    return ((vaddr == current->vaddr) && (pid == current->pid) && pid != 0);
+    pt->unlock(pid);
+    return result;
 }
 
-// Is this entry present in the hash table already?
+// Is this entry present in the page table already?
 bool is_valid_virtual( vaddr_t vaddr , pid_t pid )
 {
+    struct pt_pte pte;
 
     // Get the page numbers (upper 20 bits)
     vaddr = vaddr & ENTRYMASK;
-    KASSERT(vaddr != (vaddr_t) emptypointer);
+    KASSERT(vaddr != 0);
 
-    int index = hash(vaddr, pid);
-    spinlock_acquire(hpt->hpt_lock);
-    if ( hpt->hpt_entry[index].vaddr != (vaddr_t) emptypointer )
-    {
-        if ( hpt->hpt_entry[index].pid == pid )
-        {
-            spinlock_release(hpt->hpt_lock);
-            return true;
-        }
-        else
-        {
-            struct hpt_entry* current = hpt->hpt_entry[index].next;
-            while( current != NULL )
-            {
-                // check if the vaddr and pid are the same
-                // if they are then return true
-                if( is_equal(vaddr,pid,current) )
-                {
-                    spinlock_release(hpt->hpt_lock);
-                    return true;
-                }
-            }
-        }
-    }
-    spinlock_release(hpt->hpt_lock);
-    return false;
+    pt->lock(pid);
+    int result = pt->get(vaddr, pid, &pte);
+    pt->unlock(pid);
+    return result == 0;
+}
+
+// The control bits of an entry that has to exist
+static char get_control( vaddr_t vaddr, pid_t pid )
+{
+    struct pt_pte pte;
+
+    vaddr = vaddr & ENTRYMASK;
+    pt->lock(pid);
+    int result = pt->get(vaddr, pid, &pte);
+    pt->unlock(pid);
+    KASSERT(result == 0);
+    return pte.control;
 }
 
 /*
@@ -374,115 +201,145 @@ bool is_valid_virtual( vaddr_t vaddr , pid_t pid )
 
 bool is_valid( vaddr_t vaddr , pid_t pid )
 {
-    vaddr = vaddr & ENTRYMASK;
-    spinlock_acquire(hpt->hpt_lock);
-    struct hpt_entry *pte = get_page(vaddr, pid);
-
-    KASSERT(pte != NULL);
-    if ( (pte->control & VALIDMASK) == VALIDMASK )
-    {
-        spinlock_release(hpt->hpt_lock);
-        return true;
-    }
-    spinlock_release(hpt->hpt_lock);
-    return false;
+    return (get_control(vaddr, pid) & VALIDMASK) == VALIDMASK;
 }
 
 bool is_global( vaddr_t vaddr , pid_t pid )
 {
-    vaddr = vaddr & ENTRYMASK;
-    spinlock_acquire(hpt->hpt_lock);
-    struct hpt_entry *pte = get_page(vaddr, pid);
-
-    KASSERT(pte != NULL);
-    if ( (pte->control & GLOBALMASK) == GLOBALMASK )
-    {
-        spinlock_release(hpt->hpt_lock);
-        return true;
-    }
-    spinlock_release(hpt->hpt_lock);
-    return false;
+    return (get_control(vaddr, pid) & GLOBALMASK) == GLOBALMASK;
 }
 
 bool is_dirty( vaddr_t vaddr , pid_t pid )
 {
-    vaddr = vaddr & ENTRYMASK;
-    spinlock_acquire(hpt->hpt_lock);
-    struct hpt_entry *pte = get_page(vaddr, pid);
-
-    KASSERT(pte != NULL);
-    if ( (pte->control & DIRTYMASK) == DIRTYMASK )
-    {
-        spinlock_release(hpt->hpt_lock);
-        return true;
-    }
-    spinlock_release(hpt->hpt_lock);
-    return false;
+    return (get_control(vaddr, pid) & DIRTYMASK) == DIRTYMASK;
 }
 
 bool is_non_cacheable( vaddr_t vaddr , pid_t pid )
 {
-    vaddr = vaddr & ENTRYMASK;
-    spinlock_acquire(hpt->hpt_lock);
-    struct hpt_entry *pte = get_page(vaddr, pid);
-
-    KASSERT(pte != NULL);
-    if ( (pte->control & NCACHEMASK) == NCACHEMASK )
-    {
-        spinlock_release(hpt->hpt_lock);
-        return true;
-    }
-    spinlock_release(hpt->hpt_lock);
-    return false;
+    return (get_control(vaddr, pid) & NCACHEMASK) == NCACHEMASK;
 }
 
-void set_mask( vaddr_t vaddr , pid_t pid , uint32_t mask)
+// Sets (or with reset, clears) MASK in the control bits of an entry that has to exist
+static void change_mask( vaddr_t vaddr, pid_t pid, uint32_t mask, bool set )
 {
+    struct pt_pte pte;
+
     vaddr = vaddr & ENTRYMASK;
-    spinlock_acquire(hpt->hpt_lock);
-    struct hpt_entry *pte = get_page(vaddr, pid);
+    pt->lock(pid);
+    int result = pt->get(vaddr, pid, &pte);
+    KASSERT(result == 0);
+    char control = set ? (pte.control | mask) : (pte.control & ~mask);
+    account_resident(pid, pte.control, control);
+    pte.control = control;
+    pt->set(vaddr, pid, &pte);
+    pt->unlock(pid);
+}
 
-    KASSERT(pte != NULL);
-    pte->control |= mask;
-    spinlock_release(hpt->hpt_lock);
+void set_mask( vaddr_t vaddr , pid_t pid , uint32_t mask)
+{
+    change_mask(vaddr, pid, mask, true);
 }
 
 void reset_mask( vaddr_t vaddr , pid_t pid , uint32_t mask)
 {
-
-    vaddr = vaddr & ENTRYMASK;
-    spinlock_acquire(hpt->hpt_lock);
-    struct hpt_entry *pte = get_page(vaddr, pid);
-
-    KASSERT(pte != NULL);
-    pte->control &= (~mask);
-    spinlock_release(hpt->hpt_lock);
+    change_mask(vaddr, pid, mask, false);
 }
-// TODO
+
 // Struct to get the entries for the TLB
 // Should return error code if not successful
 int get_tlb_entry(vaddr_t vaddr, pid_t pid , uint32_t* tlb_hi, uint32_t* tlb_lo )
 {
+    struct pt_pte pte;
 
     vaddr = vaddr & ENTRYMASK;
-    /* KASSERT((vaddr & (~ENTRYMASK)) == ) */
     KASSERT(tlb_hi != NULL && tlb_lo != NULL);
-    spinlock_acquire(hpt->hpt_lock);
-    struct hpt_entry *pte = get_page(vaddr, pid);
-    if (pte == NULL)
+    pt->lock(pid);
+    int result = pt->get(vaddr, pid, &pte);
+    pt->unlock(pid);
+    if (result != 0)
     {
-        spinlock_release(hpt->hpt_lock);
         return -1;
     }
 
     // Construct the hi entry for the tlb
-    *tlb_hi = (pte->vaddr & ENTRYMASK);
+    *tlb_hi = vaddr;
     // Construct the lo entry for the tlb
-    *tlb_lo = ((pte->paddr &ENTRYMASK ) | ((pte->control & CONTROLMASK) << 8));
-    spinlock_release(hpt->hpt_lock);
+    *tlb_lo = ((pte.paddr & ENTRYMASK) | ((pte.control & CONTROLMASK) << 8));
+    return 0;
+}
+
+// Gets the raw paddr field (frame, or swap slot if swapped out) and all the control bits
+// Returns -1 if there is no entry
+int get_page_entry( vaddr_t vaddr, pid_t pid, paddr_t* paddr, char* control )
+{
+    struct pt_pte pte;
+
+    vaddr = vaddr & ENTRYMASK;
+    KASSERT(paddr != NULL && control != NULL);
+    pt->lock(pid);
+    int result = pt->get(vaddr, pid, &pte);
+    pt->unlock(pid);
+    if (result != 0)
+    {
+        return -1;
+    }
+    *paddr = pte.paddr;
+    *control = pte.control;
     return 0;
 }
 
+// Rewrites the paddr field and control bits of an existing entry (page in/out)
+// Returns -1 if there is no entry
+int update_page_entry( vaddr_t vaddr, pid_t pid, paddr_t paddr, char control )
+{
+    struct pt_pte pte;
+
+    vaddr = vaddr & ENTRYMASK;
+    pt->lock(pid);
+    if (pt->get(vaddr, pid, &pte) != 0)
+    {
+        pt->unlock(pid);
+        return -1;
+    }
+    account_resident(pid, pte.control, control);
+    pte.paddr = paddr & ENTRYMASK;
+    pte.control = control;
+    pt->set(vaddr, pid, &pte);
+    pt->unlock(pid);
+    return 0;
+}
+
+// Sets MASK in a resident entry
+// Returns -1 if there is no entry or it isn't valid (on its way out to swap)
+static int mark_entry( vaddr_t vaddr, pid_t pid, char mask )
+{
+    struct pt_pte pte;
+
+    vaddr = vaddr & ENTRYMASK;
+    pt->lock(pid);
+    if (pt->get(vaddr, pid, &pte) != 0 || (pte.control & VALIDMASK) == 0)
+    {
+        pt->unlock(pid);
+        return -1;
+    }
+    pte.control |= mask;
+    pt->set(vaddr, pid, &pte);
+    pt->unlock(pid);
+    return 0;
+}
+
+// Records the first write to a clean resident page
+int mark_entry_dirty( vaddr_t vaddr, pid_t pid )
+{
+    return mark_entry(vaddr, pid, DIRTYMASK);
+}
+
+// Gives write access back to a resident page, once mprotect allows it again
+int mark_entry_writable( vaddr_t vaddr, pid_t pid )
+{
+    return mark_entry(vaddr, pid, READWRITE);
+}
+
 void test_pagetable( void )
 {
     return;
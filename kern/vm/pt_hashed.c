@@ -0,0 +1,359 @@
+
+#include <pagetable.h>
+#include <hashlib.h>
+#include <vm.h>
+#include <lib.h>
+
+/*
+    The global hashed page table backend
+
+    One table for every address space, sized at twice the number of frames,
+    keyed by (vaddr, pid); collisions are chained off the table slot.
+   */
+
+#define HASHLENGTH 8
+// Global structs to define
+
+static struct hashed_page_table *hpt = NULL;
+
+// hashtable_size should be initialised in the init function
+static int hashtable_size = 0;
+static const void *emptypointer = NULL;
+
+// chain nodes allocated, for the stats
+static unsigned hpt_chained = 0;
+
+// Prototypes defined to avoid compiler error
+static void construct_key( vaddr_t vaddr, pid_t pid , unsigned char* ptr );
+static struct hpt_entry* get_free_entry( void );
+static struct hpt_entry* get_page( vaddr_t vaddr , pid_t pid );
+static bool is_equal(vaddr_t vaddr ,pid_t pid , struct hpt_entry* current );
+static void store_in_table( vaddr_t vaddr, pid_t pid, paddr_t paddr, char control, struct hpt_entry* hpt_ent );
+static void set_page_zero( struct hpt_entry* current );
+
+/*  Hash algorithm to calculate the value pair for the given key
+    Note the hash's key is the virtual page address and the process id (which is what it acts on)
+    This function should return an integer index into the array of the hash table entries
+*/
+static int hash( vaddr_t vaddr , pid_t pid )
+{
+    KASSERT(vaddr != 0);
+    unsigned char key[HASHLENGTH];
+
+    construct_key(vaddr, pid, key);
+    int index = calculate_hash(key, HASHLENGTH, hashtable_size);
+
+    return index;
+    // return 1;
+}
+
+// this initialises the page table
+static void hpt_bootstrap( void )
+{
+    // no need to lock here
+    ram_size = ram_getsize();
+    KASSERT( ram_size > 0 );
+
+    DEBUG(DB_VM, "RAM SIZE is %d\n", ram_size);
+    // allocate the memory for the hashed_page_table
+    hpt = (struct hashed_page_table *) kmalloc(sizeof(*hpt));
+    KASSERT(hpt != NULL);
+
+    // it should technically be round(ram_size/PAGE_SIZE) which is
+    // if ram_size == 4095 then number_of_frames = 1
+    int number_of_frames = ram_size/PAGE_SIZE;
+
+    // The size of hashtable is only equal to the 2 * number of frames
+    hashtable_size = 2*number_of_frames;
+
+    // Allocate for the hpt_entries array, kmalloc will call ram_stealmem if the vm bootstrap hasnt been complete
+    hpt->hpt_entry = kmalloc(hashtable_size * sizeof(struct hpt_entry));
+    KASSERT(hpt->hpt_entry != NULL);
+
+    DEBUG(DB_VM, "Hash Page Table Initialised...\n");
+    // set all values hpt_entries (vaddr and paddr) to point to global free pointer and others to 0
+    hpt->hpt_lock = kmalloc(sizeof(struct spinlock));
+    // Initialise locks
+    spinlock_init_ticket(hpt->hpt_lock);
+
+    int i = 0;
+    spinlock_acquire(hpt->hpt_lock);
+    for (i = 0; i<hashtable_size; i++)
+    {
+        set_page_zero(&(hpt->hpt_entry[i]));
+    }
+    spinlock_release(hpt->hpt_lock);
+
+#ifdef DEBUGLOAD
+    // set load to zero
+    hpt->load = 0;
+#endif
+    DEBUG(DB_VM, "Number of Page table entries = %d\nHash table Load: %2d\n", hashtable_size, hpt->load);
+
+    DEBUG(DB_VM, "Size of hpt_entry: %2d\n", sizeof(struct hpt_entry));
+    unsigned long size_inbytes_pagetable = hashtable_size * sizeof(struct hpt_entry);
+    DEBUG(DB_VM, "Size of Page table: %2lu\n", size_inbytes_pagetable );
+}
+
+// Nothing per address space, they all share the one table
+static int hpt_as_create( struct addrspace *as )
+{
+    (void)as;
+    return 0;
+}
+
+static void hpt_as_destroy( struct addrspace *as )
+{
+    (void)as;
+}
+
+static void hpt_lock( pid_t pid )
+{
+    (void)pid;
+    spinlock_acquire(hpt->hpt_lock);
+}
+
+static void hpt_unlock( pid_t pid )
+{
+    (void)pid;
+    spinlock_release(hpt->hpt_lock);
+}
+
+// Helper function to construct the key for the hash function
+static void construct_key( vaddr_t vaddr, pid_t pid , unsigned char* ptr )
+{
+    int i;
+    for(i=0;i<8;i++)
+    {
+        if(i<4)
+            ptr[i] = ( vaddr >> (i*8) ) & 0xff;
+        else
+            ptr[i] = ( pid >> ((i-4)*8) ) & 0xff;
+    }
+}
+
+// See if there are collisions with the hash index
+static bool is_colliding( vaddr_t vaddr, pid_t pid )
+{
+    int index = hash(vaddr,pid);
+    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
+
+    if (    (hpt->hpt_entry[index].vaddr == (vaddr_t)emptypointer) &&
+            (hpt->hpt_entry[index].pid == 0) &&
+            (hpt->hpt_entry[index].control == 0) &&
+            (hpt->hpt_entry[index].paddr == (paddr_t) emptypointer)
+       )
+    {
+        return false;
+    }
+    return true;
+}
+
+// WARNING no lock for this function, caller must have lock between this function
+static void store_in_table( vaddr_t vaddr, pid_t pid, paddr_t paddr, char control, struct hpt_entry* hpt_ent )
+{
+    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
+    hpt_ent->vaddr = vaddr;
+    hpt_ent->paddr = paddr;
+    hpt_ent->control = control;
+    hpt_ent->pid = pid;
+    hpt_ent->next = NULL;
+}
+
+// WARNING no lock for this function, caller must have lock between this function
+static void set_page_zero( struct hpt_entry* current )
+{
+    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
+    store_in_table( (vaddr_t) emptypointer, 0 ,(paddr_t) emptypointer, 0, current);
+}
+
+// To store an entry into the page table
+static int hpt_insert( vaddr_t vaddr , pid_t pid, const struct pt_pte *pte )
+{
+    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
+
+    // someone raced us to it, as tl_insert finds too
+    if ( get_page( vaddr, pid ) != NULL )
+    {
+        return -1;
+    }
+
+    int index = hash(vaddr,pid);
+
+    if ( !is_colliding( vaddr , pid ) )
+    {
+        store_in_table(vaddr, pid, pte->paddr, pte->control, &(hpt->hpt_entry[index]) );
+    }
+    else
+    {
+        // index pointer
+        struct hpt_entry *current = &(hpt->hpt_entry[index]);
+        // The chained pointer
+        struct hpt_entry *nextchained = hpt->hpt_entry[index].next;
+
+        // Get free entry from pool
+        struct hpt_entry *free = get_free_entry();
+
+        // When there are no more free nodes
+        if ( free == NULL )
+        {
+            return -1;
+        }
+        // Store in table
+        store_in_table( vaddr, pid, pte->paddr, pte->control, free );
+        // link in the next chain
+        current->next = free;
+        // What if free is NULL
+        free->next = nextchained;
+        hpt_chained++;
+    }
+#ifdef DEBUGLOAD
+    hpt->load++;
+#endif
+    return 0;
+}
+
+// Gets an entry from the pool
+static struct hpt_entry* get_free_entry( void )
+{
+    return kmalloc(sizeof(struct hpt_entry));
+}
+
+// Remove an entry from the hash table
+static int hpt_remove( vaddr_t vaddr, pid_t pid, struct pt_pte *old )
+{
+    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
+
+    // Get hash index
+    int index = hash(vaddr, pid);
+    struct hpt_entry *current = &(hpt->hpt_entry[index]);
+    struct hpt_entry *prev;
+
+    // Check if the index matches the vaddr and pid
+    if ( is_equal(vaddr,pid,current) )
+    {
+        old->paddr = current->paddr;
+        old->control = current->control;
+        if (current->next == NULL)
+        {
+            set_page_zero(current);
+        }
+        else
+        {
+            // pull the first chained node up into the table slot
+            struct hpt_entry* chained = current->next;
+            memcpy(current, chained, sizeof(*current));
+            kfree(chained);
+            hpt_chained--;
+        }
+#ifdef DEBUGLOAD
+        hpt->load--;
+#endif
+        return 0;
+    }
+
+    prev = current;
+    current = current->next;
+    while( current != NULL )
+    {
+        // check if the vaddr and pid are the same
+        // if they are then release that node to the free pool
+        if( is_equal(vaddr,pid,current) )
+        {
+            old->paddr = current->paddr;
+            old->control = current->control;
+            // Redirect the pointers
+            prev->next = current->next;
+
+            // Release node into free pool
+            kfree(current);
+            hpt_chained--;
+#ifdef DEBUGLOAD
+            hpt->load--;
+#endif
+            return 0;
+        }
+        prev = current;
+        current = current->next;
+    }
+    return -1;
+}
+
+// Gets the entry for the vaddr and pid, NULL if there is none
+static struct hpt_entry* get_page( vaddr_t vaddr , pid_t pid )
+{
+    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
+    KASSERT(vaddr != (vaddr_t) emptypointer);
+
+    // Get hash index
+    int index = hash(vaddr, pid);
+    struct hpt_entry* current = &(hpt->hpt_entry[index]);
+
+    // Check the index entry, then follow the chain
+    while( current != NULL )
+    {
+        if( is_equal(vaddr,pid,current) )
+        {
+            return current;
+        }
+        current = current->next;
+    }
+    return NULL;
+}
+
+// WARNING this dosent have a lock the caller should have a lock around this!!!
+static bool is_equal(vaddr_t vaddr ,pid_t pid , struct hpt_entry* current )
+{
+    KASSERT(current != NULL);
+    KASSERT(spinlock_do_i_hold(hpt->hpt_lock));
+    // Fixed as vaddr is only the top 20 bits now
+    return ((vaddr == current->vaddr) && (pid == current->pid) && pid != 0);
+}
+
+static int hpt_get( vaddr_t vaddr, pid_t pid, struct pt_pte *pte )
+{
+    struct hpt_entry *ent = get_page(vaddr, pid);
+    if (ent == NULL)
+    {
+        return -1;
+    }
+    pte->paddr = ent->paddr;
+    pte->control = ent->control;
+    return 0;
+}
+
+static int hpt_set( vaddr_t vaddr, pid_t pid, const struct pt_pte *pte )
+{
+    struct hpt_entry *ent = get_page(vaddr, pid);
+    if (ent == NULL)
+    {
+        return -1;
+    }
+    ent->paddr = pte->paddr;
+    ent->control = pte->control;
+    return 0;
+}
+
+static void hpt_stats( struct pt_stats *st )
+{
+    spinlock_acquire(hpt->hpt_lock);
+    st->entries = hpt->load;
+    st->tables = hpt_chained;
+    st->bytes = sizeof(*hpt) + (hashtable_size + hpt_chained) * sizeof(struct hpt_entry);
+    spinlock_release(hpt->hpt_lock);
+}
+
+const struct pt_backend pt_hashed_backend =
+{
+    .name = "hpt",
+    .bootstrap = hpt_bootstrap,
+    .as_create = hpt_as_create,
+    .as_destroy = hpt_as_destroy,
+    .lock = hpt_lock,
+    .unlock = hpt_unlock,
+    .get = hpt_get,
+    .set = hpt_set,
+    .insert = hpt_insert,
+    .remove = hpt_remove,
+    .stats = hpt_stats,
+};
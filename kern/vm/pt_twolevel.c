@@ -0,0 +1,236 @@
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <pagetable.h>
+
+/*
+    The two-level page table backend
+
+    Every address space has its own directory of 1024 leaf pointers, one per 4MB
+    of the address space, and each leaf is a page of 1024 packed entries: the
+    frame (or swap slot) in the upper 20 bits, the control bits in the low byte
+    and PTE_PRESENT to tell an entry with no bits set from no entry at all.
+    Leaves are allocated on first use and only freed with the address space, so
+    a typical process (code, data and stack) costs a directory and three leaves.
+   */
+
+#define PT_DIR_SHIFT   22
+#define PT_LEAF_SHIFT  12
+#define PT_INDEX_MASK  0x3ff
+#define PT_ENTRIES     1024
+
+#define PTE_PRESENT    (1<<11)
+#define PTE_CONTROL    0xff
+
+#define DIR_INDEX(vaddr)  (((vaddr) >> PT_DIR_SHIFT) & PT_INDEX_MASK)
+#define LEAF_INDEX(vaddr) (((vaddr) >> PT_LEAF_SHIFT) & PT_INDEX_MASK)
+
+// Hung off the address space (as->pt_data)
+struct pt_twolevel
+{
+    struct spinlock lock;
+    uint32_t **dir;
+};
+
+// Totals over every address space, for the stats
+static struct spinlock tl_stats_lock = SPINLOCK_INITIALIZER;
+static unsigned tl_entries = 0;
+static unsigned tl_leaves = 0;
+static unsigned tl_tables = 0;
+
+static struct pt_twolevel* get_table( pid_t pid )
+{
+    struct addrspace *as = (struct addrspace *) pid;
+    KASSERT(as != NULL && as->pt_data != NULL);
+    return as->pt_data;
+}
+
+// The entry word for vaddr, or NULL if its leaf doesn't exist yet
+static uint32_t* get_slot( struct pt_twolevel *pt, vaddr_t vaddr )
+{
+    KASSERT(spinlock_do_i_hold(&pt->lock));
+    uint32_t *leaf = pt->dir[DIR_INDEX(vaddr)];
+    if (leaf == NULL)
+    {
+        return NULL;
+    }
+    return &leaf[LEAF_INDEX(vaddr)];
+}
+
+static void tl_count( int entries, int leaves, int tables )
+{
+    spinlock_acquire(&tl_stats_lock);
+    tl_entries += entries;
+    tl_leaves += leaves;
+    tl_tables += tables;
+    spinlock_release(&tl_stats_lock);
+}
+
+static void tl_bootstrap( void )
+{
+    // nothing global, the tables come with the address spaces
+}
+
+static int tl_as_create( struct addrspace *as )
+{
+    struct pt_twolevel *pt = kmalloc(sizeof(*pt));
+    if (pt == NULL)
+    {
+        return ENOMEM;
+    }
+    pt->dir = kmalloc(PT_ENTRIES * sizeof(uint32_t *));
+    if (pt->dir == NULL)
+    {
+        kfree(pt);
+        return ENOMEM;
+    }
+    bzero(pt->dir, PT_ENTRIES * sizeof(uint32_t *));
+    spinlock_init(&pt->lock);
+    as->pt_data = pt;
+    tl_count(0, 0, 1);
+    return 0;
+}
+
+static void tl_as_destroy( struct addrspace *as )
+{
+    struct pt_twolevel *pt = as->pt_data;
+    int leaves = 0;
+    int i = 0;
+
+    KASSERT(pt != NULL);
+    for (i = 0; i < PT_ENTRIES; i++)
+    {
+        if (pt->dir[i] != NULL)
+        {
+            kfree(pt->dir[i]);
+            leaves++;
+        }
+    }
+    spinlock_cleanup(&pt->lock);
+    kfree(pt->dir);
+    kfree(pt);
+    as->pt_data = NULL;
+    tl_count(0, -leaves, -1);
+}
+
+static void tl_lock( pid_t pid )
+{
+    spinlock_acquire(&get_table(pid)->lock);
+}
+
+static void tl_unlock( pid_t pid )
+{
+    spinlock_release(&get_table(pid)->lock);
+}
+
+static int tl_get( vaddr_t vaddr, pid_t pid, struct pt_pte *pte )
+{
+    uint32_t *slot = get_slot(get_table(pid), vaddr);
+    if (slot == NULL || (*slot & PTE_PRESENT) == 0)
+    {
+        return -1;
+    }
+    pte->paddr = *slot & ENTRYMASK;
+    pte->control = *slot & PTE_CONTROL;
+    return 0;
+}
+
+static int tl_set( vaddr_t vaddr, pid_t pid, const struct pt_pte *pte )
+{
+    uint32_t *slot = get_slot(get_table(pid), vaddr);
+    if (slot == NULL || (*slot & PTE_PRESENT) == 0)
+    {
+        return -1;
+    }
+    *slot = (pte->paddr & ENTRYMASK) | PTE_PRESENT | ((uint8_t)pte->control);
+    return 0;
+}
+
+// Called with the lock held; drops it to allocate a missing leaf
+static int tl_insert( vaddr_t vaddr, pid_t pid, const struct pt_pte *pte )
+{
+    struct pt_twolevel *pt = get_table(pid);
+    uint32_t *spare = NULL;
+
+    uint32_t *slot = get_slot(pt, vaddr);
+    if (slot == NULL)
+    {
+        // can't allocate under a spinlock, someone may beat us to it meanwhile
+        spinlock_release(&pt->lock);
+        uint32_t *leaf = kmalloc(PT_ENTRIES * sizeof(uint32_t));
+        spinlock_acquire(&pt->lock);
+        if (leaf == NULL)
+        {
+            return -1;
+        }
+        bzero(leaf, PT_ENTRIES * sizeof(uint32_t));
+        if (pt->dir[DIR_INDEX(vaddr)] == NULL)
+        {
+            pt->dir[DIR_INDEX(vaddr)] = leaf;
+            tl_count(0, 1, 0);
+        }
+        else
+        {
+            spare = leaf;
+        }
+        slot = get_slot(pt, vaddr);
+    }
+    if (*slot & PTE_PRESENT)
+    {
+        KASSERT(spare == NULL);
+        return -1;
+    }
+    *slot = (pte->paddr & ENTRYMASK) | PTE_PRESENT | ((uint8_t)pte->control);
+    tl_count(1, 0, 0);
+
+    if (spare != NULL)
+    {
+        spinlock_release(&pt->lock);
+        kfree(spare);
+        spinlock_acquire(&pt->lock);
+    }
+    return 0;
+}
+
+static int tl_remove( vaddr_t vaddr, pid_t pid, struct pt_pte *old )
+{
+    uint32_t *slot = get_slot(get_table(pid), vaddr);
+    if (slot == NULL || (*slot & PTE_PRESENT) == 0)
+    {
+        return -1;
+    }
+    old->paddr = *slot & ENTRYMASK;
+    old->control = *slot & PTE_CONTROL;
+    *slot = 0;
+    tl_count(-1, 0, 0);
+    return 0;
+}
+
+static void tl_stats( struct pt_stats *st )
+{
+    spinlock_acquire(&tl_stats_lock);
+    st->entries = tl_entries;
+    st->tables = tl_leaves;
+    st->bytes = (unsigned long)tl_tables * (sizeof(struct pt_twolevel) + PT_ENTRIES * sizeof(uint32_t *))
+                + (unsigned long)tl_leaves * PT_ENTRIES * sizeof(uint32_t);
+    spinlock_release(&tl_stats_lock);
+}
+
+const struct pt_backend pt_twolevel_backend =
+{
+    .name = "2level",
+    .bootstrap = tl_bootstrap,
+    .as_create = tl_as_create,
+    .as_destroy = tl_as_destroy,
+    .lock = tl_lock,
+    .unlock = tl_unlock,
+    .get = tl_get,
+    .set = tl_set,
+    .insert = tl_insert,
+    .remove = tl_remove,
+    .stats = tl_stats,
+};
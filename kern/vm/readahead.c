@@ -0,0 +1,309 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coreswap.h>
+#include <readahead.h>
+
+/*
+ * Read-ahead from swap.
+ *
+ * vm_fault tells us about every fault. Per region we remember the
+ * last faulting page and the stride to the one before it; when a
+ * fault keeps to the stride it is a hit and the window doubles, up to
+ * READAHEAD_MAX, and when it doesn't the window collapses and the new
+ * stride is what the next fault is checked against. Negative strides
+ * (a stack, or an array walked backwards) work the same way.
+ *
+ * The pages in the window are handed to a kernel thread, so the
+ * faulting process goes back to work while they are read; by the
+ * time it gets to them they are resident and only cost a TLB refill.
+ * Only swapped out pages are read, everything else in this VM is
+ * either resident already or zero filled on first touch, which needs
+ * no I/O.
+ *
+ * MADV_RANDOM turns this off for a region, MADV_SEQUENTIAL starts it
+ * at the full window with a stride of one page.
+ */
+
+struct readahead_request
+{
+    struct addrspace* as;
+    vaddr_t vaddr;      // first page to read
+    int stride;         // in pages, may be negative
+    unsigned npages;
+};
+
+struct readahead_stats
+{
+    unsigned hits;      // faults that kept to their region's stride
+    unsigned misses;    // ... that broke it
+    unsigned requests;  // requests queued
+    unsigned dropped;   // ... or not, the queue was full
+    unsigned cancelled; // dropped because the address space went away
+    unsigned pages;     // pages read in ahead of use
+    unsigned skipped;   // pages asked for but not in swap, or no memory for them
+};
+
+static struct readahead_stats rastats;
+
+// protects everything below, and rastats
+static struct spinlock ra_lock = SPINLOCK_INITIALIZER;
+static struct wchan* ra_wchan = NULL;      // the thread waits here for work
+static struct wchan* ra_done_wchan = NULL; // readahead_cancel waits here
+static struct readahead_request ra_queue[READAHEAD_QUEUE];
+static unsigned ra_head = 0;
+static unsigned ra_count = 0;
+static struct addrspace* ra_busy = NULL;   // address space of the request being read
+static bool ra_cancel = false;             // ... which is going away, stop
+
+// Read the pages of one request, giving up at the first one there is no memory for
+static void readahead_run(struct readahead_request* req)
+{
+    unsigned done = 0;
+    unsigned skipped = 0;
+    unsigned i = 0;
+
+    for (i = 0; i < req->npages; i++)
+    {
+        spinlock_acquire(&ra_lock);
+        bool stop = ra_cancel;
+        spinlock_release(&ra_lock);
+        if (stop)
+        {
+            break;
+        }
+
+        vaddr_t vaddr = req->vaddr + i * req->stride * PAGE_SIZE;
+        int result = vm_page_prefetch(req->as, vaddr);
+        if (result == 0)
+        {
+            done++;
+        }
+        else if (result == EAGAIN)
+        {
+            skipped++;
+        }
+        else
+        {
+            skipped += req->npages - i;
+            break;
+        }
+    }
+
+    spinlock_acquire(&ra_lock);
+    rastats.pages += done;
+    rastats.skipped += skipped;
+    spinlock_release(&ra_lock);
+}
+
+static void readahead_thread(void* data1, unsigned long data2)
+{
+    (void)data1;
+    (void)data2;
+    struct readahead_request req;
+
+    while (1)
+    {
+        spinlock_acquire(&ra_lock);
+        while (ra_count == 0)
+        {
+            wchan_sleep(ra_wchan, &ra_lock);
+        }
+        req = ra_queue[ra_head];
+        ra_head = (ra_head + 1) % READAHEAD_QUEUE;
+        ra_count--;
+        ra_busy = req.as;
+        ra_cancel = false;
+        spinlock_release(&ra_lock);
+
+        readahead_run(&req);
+
+        spinlock_acquire(&ra_lock);
+        ra_busy = NULL;
+        wchan_wakeall(ra_done_wchan, &ra_lock);
+        spinlock_release(&ra_lock);
+    }
+}
+
+static void readahead_queue(struct addrspace* as, vaddr_t vaddr, int stride, unsigned npages)
+{
+    spinlock_acquire(&ra_lock);
+    if (ra_count == READAHEAD_QUEUE)
+    {
+        rastats.dropped++;
+        spinlock_release(&ra_lock);
+        return;
+    }
+    struct readahead_request* req = &ra_queue[(ra_head + ra_count) % READAHEAD_QUEUE];
+    req->as = as;
+    req->vaddr = vaddr;
+    req->stride = stride;
+    req->npages = npages;
+    ra_count++;
+    rastats.requests++;
+    wchan_wakeone(ra_wchan, &ra_lock);
+    spinlock_release(&ra_lock);
+}
+
+void readahead_fault(struct addrspace* as, struct as_region_metadata* region, vaddr_t vaddr)
+{
+    KASSERT(as != NULL && region != NULL);
+    if (ra_wchan == NULL || region->advice == MADV_RANDOM)
+    {
+        return;
+    }
+
+    int delta = (int32_t)(vaddr - region->ra_last) / PAGE_SIZE;
+    if (region->ra_last != 0 && delta == 0)
+    {
+        // the same page again (a TLB refill after a write, say), tells us nothing
+        return;
+    }
+    bool hit = region->ra_last != 0 && delta == region->ra_stride;
+    if (region->advice == MADV_SEQUENTIAL && delta != -1)
+    {
+        // told to expect it, so anything but a step back counts as going forward
+        hit = true;
+        if (delta != 1)
+        {
+            // jumped, what was queued is behind us or far ahead
+            region->ra_ahead = 0;
+        }
+        region->ra_stride = 1;
+        region->ra_window = READAHEAD_MAX;
+    }
+    else if (hit)
+    {
+        region->ra_window = region->ra_window == 0 ? READAHEAD_MIN : region->ra_window * 2;
+        if (region->ra_window > READAHEAD_MAX)
+        {
+            region->ra_window = READAHEAD_MAX;
+        }
+    }
+    else
+    {
+        region->ra_stride = delta;
+        region->ra_window = 0;
+        region->ra_ahead = 0;
+    }
+    region->ra_last = vaddr;
+
+    spinlock_acquire(&ra_lock);
+    if (hit)
+    {
+        rastats.hits++;
+    }
+    else
+    {
+        rastats.misses++;
+    }
+    spinlock_release(&ra_lock);
+
+    int stride = region->ra_stride;
+    if (!hit || region->ra_window == 0 || stride == 0
+        || stride > READAHEAD_STRIDE_MAX || stride < -READAHEAD_STRIDE_MAX)
+    {
+        return;
+    }
+
+    // this fault used up one of the pages already asked for, ask for the rest of the window
+    if (region->ra_ahead > 0)
+    {
+        region->ra_ahead--;
+    }
+    if (region->ra_ahead >= region->ra_window)
+    {
+        return;
+    }
+
+    // keep inside the region
+    vaddr_t start = vaddr + (region->ra_ahead + 1) * stride * PAGE_SIZE;
+    vaddr_t region_end = region->region_vaddr + region->npages * PAGE_SIZE;
+    unsigned want = region->ra_window - region->ra_ahead;
+    unsigned n = 0;
+    for (n = 0; n < want; n++)
+    {
+        vaddr_t page = start + n * stride * PAGE_SIZE;
+        if (page < region->region_vaddr || page >= region_end)
+        {
+            break;
+        }
+    }
+    region->ra_ahead += n;
+    if (n > 0)
+    {
+        readahead_queue(as, start, stride, n);
+    }
+}
+
+void readahead_cancel(struct addrspace* as)
+{
+    unsigned i = 0;
+    unsigned kept = 0;
+
+    if (ra_wchan == NULL)
+    {
+        return;
+    }
+    spinlock_acquire(&ra_lock);
+    // squeeze the address space's requests out of the queue
+    for (i = 0; i < ra_count; i++)
+    {
+        struct readahead_request* req = &ra_queue[(ra_head + i) % READAHEAD_QUEUE];
+        if (req->as == as)
+        {
+            rastats.cancelled++;
+            continue;
+        }
+        ra_queue[(ra_head + kept) % READAHEAD_QUEUE] = *req;
+        kept++;
+    }
+    ra_count = kept;
+
+    // and wait for the one being read, if it's ours
+    if (ra_busy == as)
+    {
+        ra_cancel = true;
+        while (ra_busy == as)
+        {
+            wchan_sleep(ra_done_wchan, &ra_lock);
+        }
+    }
+    spinlock_release(&ra_lock);
+}
+
+void readahead_printstats(void)
+{
+    struct readahead_stats snap;
+
+    spinlock_acquire(&ra_lock);
+    snap = rastats;
+    spinlock_release(&ra_lock);
+
+    kprintf("    read-ahead hits/misses:  %u/%u\n", snap.hits, snap.misses);
+    kprintf("    read-ahead requests:     %u (dropped %u, cancelled %u)\n",
+            snap.requests, snap.dropped, snap.cancelled);
+    kprintf("    read-ahead pages:        %u (skipped %u)\n", snap.pages, snap.skipped);
+}
+
+// Called from vm_bootstrap
+void readahead_bootstrap(void)
+{
+    ra_wchan = wchan_create("readahead");
+    ra_done_wchan = wchan_create("readahead_done");
+    if (ra_wchan == NULL || ra_done_wchan == NULL)
+    {
+        panic("readahead_bootstrap: out of memory\n");
+    }
+
+    int result = thread_fork("readaheadd", NULL, readahead_thread, NULL, 0);
+    if (result != 0)
+    {
+        panic("readahead_bootstrap: can't start read-ahead thread: %s\n", strerror(result));
+    }
+}
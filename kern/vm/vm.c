@@ -1,5 +1,6 @@
 #include <types.h>
 #include <spl.h>
+#include <cpu.h>
 #include <elf.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -11,31 +12,55 @@
 #include <vm.h>
 #include <machine/tlb.h>
 #include <pagetable.h>
+#include <synch.h>
 /* #include <frametable.h> */
-/* #include <coreswap.h> */
+#include <coreswap.h>
+#include <zswap.h>
+#include <ksm.h>
+#include <readahead.h>
+#include <futex.h>
+#include <uio.h>
+#include <vnode.h>
 
 /* Place your page table functions here */
 
 
+// Counters reported by vm_printstats (the "vmstat" menu command)
+struct vm_stats
+{
+    unsigned shootdown_pages;       // pages invalidated through vm_tlbshootdown_range
+    unsigned shootdown_sent;        // shootdown ipis sent to other cpus
+    unsigned shootdown_received;    // shootdowns handled on this end
+    unsigned shootdown_stale;       // ... that were for an address space no longer loaded
+    unsigned ref_faults;            // TLB loads that set the reference bit
+    unsigned exec_recycled;         // frames exec took straight from the image it replaced
+};
+
+static struct vm_stats vmstats;
+static struct spinlock vmstats_lock = SPINLOCK_INITIALIZER;
 
 struct lock *vm_lock = NULL;
 
 void vm_bootstrap(void)
 {
 
-    /* vm_lock = lock_create("vm_lock"); */
-    /* if (lock == NULL) */
-    /* { */
-    /*     panic("vm lock create failed!\n"); */
-    /*  */
-    /* } */
+    vm_lock = lock_create("vm_lock");
+    if (vm_lock == NULL)
+    {
+        panic("vm lock create failed!\n");
+
+    }
 
-    /* init_coreswap(); */
     DEBUG(DB_VM, "init_frametable ing....\n");
     init_page_table();
     test_pagetable();
     init_frametable();
     DEBUG(DB_VM, "init_frametable finish\n");
+    as_bootstrap_limits(frame_free_count());
+    init_coreswap();
+    readahead_bootstrap();
+    ksm_bootstrap();
+    futex_bootstrap();
     /* vaddr_t p = alloc_kpages(1); */
     /* DEBUG(DB_VM, "alloc 0x%x\n", p); */
     /*  */
@@ -81,9 +106,368 @@ static struct as_region_metadata* get_region(struct addrspace* space, vaddr_t fa
 
 }
 
+// Whether REGION's permissions allow a read (or a write) by the process
+// mprotect leaves the ptes of a PROT_NONE range valid (see as_revoke_range),
+// so anything giving the process access to a page through its pte asks this first
+// Anything goes while load_elf is loading
+static bool vm_region_allows(struct addrspace* as, struct as_region_metadata* region, bool write)
+{
+    if (as->is_loading == 1)
+    {
+        return true;
+    }
+    if (region->rwxflag == 0)
+    {
+        // PROT_NONE, e.g. a guard page
+        return false;
+    }
+    return !write || (region->rwxflag & PF_W);
+}
+
+// Load the pte for vaddr into the TLB
+// Done at splhigh so a shootdown can't get in between reading the pte and writing the TLB
+// The TLB only gets write permission once the page is dirty, so the first write to a
+// clean page comes back as VM_FAULT_READONLY and gets recorded.
+static int vm_load_tlb(struct addrspace* as, vaddr_t vaddr)
+{
+    uint32_t tlb_hi, tlb_lo;
+    paddr_t paddr;
+    char control;
+
+    int spl = splhigh();
+    int ret = get_page_entry(vaddr, (pid_t)as, &paddr, &control);
+    if (ret != 0 || (control & VALIDMASK) == 0)
+    {
+        // evicted since we looked, the access will fault again and page it in
+        splx(spl);
+        return 0;
+    }
+    KASSERT(check_user_frame(paddr & PAGE_FRAME));
+    if ((control & REFMASK) == 0)
+    {
+        // first use since the reference sampler or the victim clock looked at it
+        set_mask(vaddr, (pid_t)as, REFMASK);
+        spinlock_acquire(&vmstats_lock);
+        vmstats.ref_faults++;
+        spinlock_release(&vmstats_lock);
+    }
+
+    tlb_hi = vaddr & ENTRYMASK;
+    tlb_lo = (paddr & ENTRYMASK) | ((control & CONTROLMASK & ~DIRTYMASK) << 8);
+    // while loading, read only segments are dirty too but must only be writable by load_elf
+    if ((control & DIRTYMASK) && ((control & READWRITE) || as->is_loading == 1))
+    {
+        tlb_lo |= TLBLO_DIRTY;
+    }
+    tlb_force_write(tlb_hi, tlb_lo);
+    splx(spl);
+    return 0;
+}
+
+// Bring a swapped out page back in, or wait for one on its way out
+// The swap copy is kept with the frame, so the page stays clean until written
+static int vm_swapin(struct addrspace* as, vaddr_t vaddr, bool dirty)
+{
+    paddr_t paddr;
+    char control;
+    pid_t pid = (pid_t) as;
+
+    // get the frame before vm_lock, waiting for one needs the reclaim daemon
+    paddr_t frame_addr = get_free_frame();
+    if (frame_addr == 0)
+    {
+        return ENOMEM;
+    }
+
+    lock_acquire(vm_lock);
+    int ret = get_page_entry(vaddr, pid, &paddr, &control);
+    if (ret != 0 || (control & SWAPMASK) == 0)
+    {
+        // back in already, or dropped as a zero page; the access is retried
+        lock_release(vm_lock);
+        free_upages(frame_addr);
+        return 0;
+    }
+    unsigned slot = PTE_TO_SWAP_SLOT(paddr);
+    ret = swapin_corepage(frame_addr, slot);
+    if (ret != 0)
+    {
+        lock_release(vm_lock);
+        free_upages(frame_addr);
+        return ret;
+    }
+    control = (control | VALIDMASK) & ~(SWAPMASK | DIRTYMASK);
+    if (dirty)
+    {
+        control |= DIRTYMASK;
+    }
+    int frame_slot = (int)slot;
+    if (SWAP_SLOT_IS_COMPRESSED(slot))
+    {
+        // no point keeping it compressed as well, but now the frame is the only copy
+        free_swap_slot(slot);
+        control |= DIRTYMASK;
+        frame_slot = -1;
+    }
+    update_page_entry(vaddr, pid, frame_addr, control);
+    set_frame_swap_slot(frame_addr, frame_slot);
+    set_frame_owner(frame_addr, as, vaddr);
+    lock_release(vm_lock);
+    return 0;
+}
+
+void vm_count_recycled(void)
+{
+    spinlock_acquire(&vmstats_lock);
+    vmstats.exec_recycled++;
+    spinlock_release(&vmstats_lock);
+}
+
+// Read the page at VADDR of a file backed region into the frame at PADDR
+// Whatever is past the end of the file stays as it was, zero
+static int vm_read_backing(struct as_region_metadata* region, vaddr_t vaddr, paddr_t paddr)
+{
+    struct iovec iov;
+    struct uio ku;
+
+    KASSERT(region->region_vnode != NULL);
+    uio_kinit(&iov, &ku, (void*)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+              region->region_offset + (vaddr - region->region_vaddr), UIO_READ);
+    return VOP_READ(region->region_vnode, &ku);
+}
+
+// Make one page of a region resident, without touching the TLB: a zeroed frame on
+// first touch (or read from the file behind the region), or back in from swap;
+// a write to a clean page marks it dirty
+// Write permission given back by mprotect is picked up here, on the first write
+static int vm_page_in(struct addrspace* as, struct as_region_metadata* region, vaddr_t vaddr, bool dirty)
+{
+    paddr_t paddr;
+    char control;
+    pid_t pid = (pid_t) as;
+
+    int ret = get_page_entry(vaddr, pid, &paddr, &control);
+    if ((ret != 0 || (control & SWAPMASK)) && as_rss_full(as))
+    {
+        // at its resident limit, the process makes room out of its own pages
+        if (reclaim_self(as) != 0)
+        {
+            return ENOMEM;
+        }
+    }
+    if (ret == 0 && (control & SWAPMASK))
+    {
+        ret = vm_swapin(as, vaddr, dirty);
+        if (ret != 0 || !dirty)
+        {
+            return ret;
+        }
+        ret = get_page_entry(vaddr, pid, &paddr, &control);
+        if (ret != 0 || (control & VALIDMASK) == 0)
+        {
+            // gone again already, the access is retried
+            return 0;
+        }
+    }
+    if (dirty && ret == 0 && (control & SHAREDMASK))
+    {
+        // a write to a merged page, it gets a copy of its own
+        ret = ksm_unshare(as, vaddr);
+        if (ret != 0)
+        {
+            return ret;
+        }
+        ret = get_page_entry(vaddr, pid, &paddr, &control);
+        if (ret != 0 || (control & VALIDMASK) == 0 || (control & SHAREDMASK))
+        {
+            return 0;
+        }
+    }
+    if (dirty && ret == 0 && (region->rwxflag & PF_W) && (control & READWRITE) == 0)
+    {
+        // a clean page like this is what reclaimd drops; if it's gone, the access is retried
+        if (mark_entry_writable(vaddr, pid) != 0)
+        {
+            return 0;
+        }
+    }
+    if (ret != 0)
+    {
+        // first touch, give it a zeroed frame
+        bool recycled;
+        paddr_t frame_addr = as_get_frame(as, &recycled);
+        if (frame_addr == 0)
+        {
+            return ENOMEM;
+        }
+        if (recycled)
+        {
+            bzero((void*)PADDR_TO_KVADDR(frame_addr), PAGE_SIZE);
+        }
+        char ctrl = as_region_control(region);
+        if (dirty)
+        {
+            ctrl |= DIRTYMASK;
+        }
+        if (region->region_vnode != NULL)
+        {
+            ret = vm_read_backing(region, vaddr, frame_addr);
+            if (ret != 0)
+            {
+                free_upages(frame_addr);
+                return ret;
+            }
+            // the frame is the only copy now, it mustn't be dropped as a zero page
+            ctrl |= DIRTYMASK;
+        }
+
+        bool result = store_entry (vaddr, pid, frame_addr, ctrl);
+
+        if (!result)
+        {
+            free_upages(frame_addr);
+            return ENOMEM;
+        }
+        set_frame_owner(frame_addr, as, vaddr);
+    }
+    else if (dirty && (control & DIRTYMASK) == 0)
+    {
+        // first write to a clean page; if it is being paged out just retry
+        mark_entry_dirty(vaddr, pid);
+    }
+    return 0;
+}
+
+// Read-ahead: swap a page back in before it is faulted on
+// EAGAIN if it isn't in swap, ENOMEM if it would cost someone else a frame
+int vm_page_prefetch(struct addrspace* as, vaddr_t vaddr)
+{
+    paddr_t paddr;
+    char control;
+
+    int ret = get_page_entry(vaddr, (pid_t) as, &paddr, &control);
+    if (ret != 0 || (control & SWAPMASK) == 0)
+    {
+        return EAGAIN;
+    }
+    if (reclaim_memory_low() || as_rss_full(as))
+    {
+        return ENOMEM;
+    }
+    return vm_swapin(as, vaddr, false);
+}
+
+/*
+ * For copyin/copyout: the kseg0 address of the current process's user
+ * address VADDR, if its page is resident and its region allows the
+ * access, as a TLB entry for it would. The frame is pinned, so it
+ * stays put without vm_lock held over the copy, until
+ * vm_user_page_release is called with that address. False (holding
+ * nothing) means go through the user address and take the fault,
+ * e.g. to page it in or to fail on a read only page.
+ */
+bool vm_user_page_hold(vaddr_t vaddr, bool write, vaddr_t *kvaddr)
+{
+    struct addrspace *as = proc_getas();
+    paddr_t paddr;
+    char control;
+
+    if (as == NULL || vm_lock == NULL || curthread->t_in_interrupt || lock_do_i_hold(vm_lock))
+    {
+        return false;
+    }
+    lock_acquire(vm_lock);
+    // the pte of a PROT_NONE page is still valid, see as_revoke_range
+    struct as_region_metadata* region = get_region(as, vaddr & PAGE_FRAME);
+    if (region == NULL || !vm_region_allows(as, region, write))
+    {
+        lock_release(vm_lock);
+        return false;
+    }
+    int ret = get_page_entry(vaddr, (pid_t)as, &paddr, &control);
+    if (ret != 0 || (control & VALIDMASK) == 0 || (control & (SWAPMASK | SHAREDMASK)))
+    {
+        lock_release(vm_lock);
+        return false;
+    }
+    if (write)
+    {
+        // as in vm_load_tlb; write permission mprotect is giving back is left to the fault
+        if ((control & READWRITE) == 0 && as->is_loading != 1)
+        {
+            lock_release(vm_lock);
+            return false;
+        }
+        if ((control & DIRTYMASK) == 0)
+        {
+            mark_entry_dirty(vaddr, (pid_t)as);
+        }
+    }
+    if ((control & REFMASK) == 0)
+    {
+        set_mask(vaddr, (pid_t)as, REFMASK);
+    }
+    // the clock hands pass a pinned frame over, so it can't be evicted (or cleaned)
+    // or merged while we copy; nothing else moves it but this process itself
+    set_frame_pinned(paddr & ENTRYMASK, true);
+    lock_release(vm_lock);
+    *kvaddr = PADDR_TO_KVADDR(paddr & ENTRYMASK) + (vaddr & ~(vaddr_t)PAGE_FRAME);
+    return true;
+}
+
+void vm_user_page_release(vaddr_t kvaddr)
+{
+    set_frame_pinned(KVADDR_TO_PADDR(kvaddr) & PAGE_FRAME, false);
+}
+
+/*
+ * Copy the contents of the page at VADDR into the frame BOUNCE, wherever
+ * the page is: resident, in swap, or not yet read from the file behind
+ * its region. ENOENT if it has never been touched, so is all zero.
+ */
+int vm_copy_page(struct addrspace* as, struct as_region_metadata* region, vaddr_t vaddr, paddr_t bounce)
+{
+    paddr_t paddr;
+    char control;
+    int ret;
+
+    // under vm_lock the page can't be on its way in or out of swap
+    lock_acquire(vm_lock);
+    ret = get_page_entry(vaddr, (pid_t) as, &paddr, &control);
+    if (ret == 0 && (control & SWAPMASK))
+    {
+        ret = swapin_corepage(bounce, PTE_TO_SWAP_SLOT(paddr));
+        lock_release(vm_lock);
+        return ret;
+    }
+    if (ret == 0)
+    {
+        memcpy((void*)PADDR_TO_KVADDR(bounce), (void*)PADDR_TO_KVADDR(paddr & ENTRYMASK), PAGE_SIZE);
+        lock_release(vm_lock);
+        return 0;
+    }
+    lock_release(vm_lock);
+
+    if (region->region_vnode == NULL)
+    {
+        return ENOENT;
+    }
+    bzero((void*)PADDR_TO_KVADDR(bounce), PAGE_SIZE);
+    return vm_read_backing(region, vaddr, bounce);
+}
+
+// How many pages after a faulting one to bring in as well, from the madvise hint
+static unsigned vm_faultaround(struct as_region_metadata* region)
+{
+    if (region->advice == MADV_SEQUENTIAL)
+    {
+        return FAULTAROUND_SEQUENTIAL;
+    }
+    return 0;
+}
+
 int vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	uint32_t tlb_hi, tlb_lo;
 	struct addrspace *as;
 
 	faultaddress &= PAGE_FRAME;
@@ -112,7 +496,6 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
         return EFAULT;
     }
 	/* DEBUG(DB_VM, "fault: 0x%x, type: %d\n", faultaddress, faulttype); */
-    pid_t pid = (pid_t) as;
 
     struct as_region_metadata* region = get_region(as, faultaddress);
     if (region == NULL)
@@ -120,71 +503,181 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
         DEBUG(DB_VM, "Couldnt find region 0x%x\n", faultaddress);
         return EFAULT;
     }
-    if ( (faulttype == VM_FAULT_READONLY) )
+    if ( !vm_region_allows(as, region, faulttype != VM_FAULT_READ) )
     {
-        KASSERT(!(region->rwxflag & PF_W));
-        DEBUG(DB_VM, "not writable 0x%x\n", faultaddress);
+        DEBUG(DB_VM, "no access 0x%x (fault type %d)\n", faultaddress, faulttype);
         return EFAULT;
     }
-    /* if (!is_valid_virtual(faultaddress, pid)) */
-    /* { */
-    /*     DEBUG(DB_VM, "not in page table 0x%x\n", faultaddress); */
-    /*     return EFAULT; */
-    /* } */
+    // anything written by load_elf has to be written back too, whatever the segment
+    bool writable = (region->rwxflag & PF_W) || as->is_loading == 1;
+    bool dirty = writable && (faulttype != VM_FAULT_READ || as->is_loading == 1);
 
-    // TODO KASSERT frame page is user frame
-    int ret = get_tlb_entry(faultaddress, pid, &tlb_hi, &tlb_lo);
-    /* if (is_valid_virtual(faultaddress, pid)) */
-    if (ret == 0)
+    int ret = vm_page_in(as, region, faultaddress, dirty);
+    if (ret != 0)
     {
-
-        KASSERT(check_user_frame(tlb_lo & PAGE_FRAME));
-        int write_permission = (as->is_loading == 1) ? TLBLO_DIRTY:0;
-
-        tlb_lo |= write_permission;
-        tlb_force_write(tlb_hi, tlb_lo);
+        return ret;
     }
-    else
+    vm_load_tlb(as, faultaddress);
+    readahead_fault(as, region, faultaddress);
+
+    // fault around: map the next few pages too, unless memory is tight
+    // pages out in swap are left to the read-ahead thread rather than waited for here
+    vaddr_t region_end = upper_addr(region->region_vaddr, region->npages);
+    unsigned n = vm_faultaround(region);
+    for (unsigned i = 1; i <= n; i++)
     {
-        paddr_t frame_addr = get_free_frame();
-        if (frame_addr == 0)
+        vaddr_t next = faultaddress + i * PAGE_SIZE;
+        if (next >= region_end || reclaim_memory_low() || as_rss_full(as))
         {
-            return ENOMEM;
+            break;
         }
-        char ctrl = as_region_control(region);
-
-        bool result = store_entry (faultaddress, pid, frame_addr, ctrl);
-
-        if (!result)
+        paddr_t paddr;
+        char control;
+        if (get_page_entry(next, (pid_t) as, &paddr, &control) == 0 && (control & SWAPMASK))
         {
-            free_upages(frame_addr);
-            return ENOMEM;
+            break;
         }
-        ret = get_tlb_entry(faultaddress, pid, &tlb_hi, &tlb_lo);
-        if (ret != 0)
+        if (vm_page_in(as, region, next, false) != 0)
         {
-            panic("what happen in get_tlb_entry");
+            break;
         }
-        KASSERT(check_user_frame(tlb_lo & PAGE_FRAME));
-        /* KASSERT(as->is_loading == 0); */
-        int write_permission = (as->is_loading == 1) ? TLBLO_DIRTY:0;
-
-        tlb_lo |= write_permission;
-        tlb_force_write(tlb_hi, tlb_lo);
-
+        vm_load_tlb(as, next);
     }
     return 0;
 }
 
+// madvise(MADV_WILLNEED): make a range resident now rather than on first touch
+// Only a hint, so stop quietly rather than push other pages out to do it
+void vm_prefault_range(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+    KASSERT(as != NULL);
+    for (unsigned i = 0; i < npages; i++)
+    {
+        vaddr_t page = vaddr + i * PAGE_SIZE;
+        struct as_region_metadata* region = get_region(as, page);
+        KASSERT(region != NULL);
+        if (reclaim_memory_low() || as_rss_full(as)
+            || vm_page_in(as, region, page, false) != 0)
+        {
+            break;
+        }
+    }
+}
+
 /*
+ * SMP-specific functions.
  *
- * SMP-specific functions.  Unused in our configuration.
+ * Whenever a mapping is removed or downgraded, every TLB that might
+ * hold it has to be cleaned before the frame can be reused. The local
+ * TLB is done directly; other cpus are only interrupted if they
+ * currently have the address space loaded (see c_tlbas in cpu.h).
  */
 
+// Called on the target cpu from interprocessor_interrupt, with the ipi lock held
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+    KASSERT(ts != NULL);
+
+    if (ts->ts_as != NULL && ts->ts_as != curcpu->c_tlbas)
+    {
+        // we switched address space (and flushed) since it was sent
+        spinlock_acquire(&vmstats_lock);
+        vmstats.shootdown_stale++;
+        spinlock_release(&vmstats_lock);
+        return;
+    }
+    if (ts->ts_vaddr == TLBSHOOTDOWN_ALL)
+    {
+        tlb_flush();
+    }
+    else
+    {
+        tlb_invalid_by_vaddr(ts->ts_vaddr & PAGE_FRAME);
+    }
+    spinlock_acquire(&vmstats_lock);
+    vmstats.shootdown_received++;
+    spinlock_release(&vmstats_lock);
+}
+
+/*
+ * Invalidate NPAGES pages starting at VADDR in address space AS, on
+ * every cpu. Ranges longer than TLBSHOOTDOWN_MAX are done by flushing
+ * the whole TLB instead. When this returns no TLB maps those pages
+ * any more, so the frames behind them may be freed.
+ */
+void
+vm_tlbshootdown_range(struct addrspace *as, vaddr_t vaddr, unsigned npages)
+{
+    struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+    unsigned num = 0;
+    unsigned i = 0;
+    unsigned sent = 0;
+
+    KASSERT(as != NULL);
+    KASSERT((vaddr & OFFSETMASK) == 0);
+    if (npages == 0)
+    {
+        return;
+    }
+
+    if (npages > TLBSHOOTDOWN_MAX)
+    {
+        ts[0].ts_as = as;
+        ts[0].ts_vaddr = TLBSHOOTDOWN_ALL;
+        num = 1;
+    }
+    else
+    {
+        for (i = 0; i < npages; i++)
+        {
+            ts[i].ts_as = as;
+            ts[i].ts_vaddr = vaddr + i * PAGE_SIZE;
+        }
+        num = npages;
+    }
+
+    // our own TLB first, the ipi path never targets the current cpu
+    int spl = splhigh();
+    if (curcpu->c_tlbas == as)
+    {
+        for (i = 0; i < num; i++)
+        {
+            vm_tlbshootdown(&ts[i]);
+        }
+    }
+    splx(spl);
+
+    sent = ipi_tlbshootdown_as(as, ts, num);
+
+    spinlock_acquire(&vmstats_lock);
+    vmstats.shootdown_sent += sent;
+    vmstats.shootdown_pages += npages;
+    spinlock_release(&vmstats_lock);
+}
+
+void
+vm_printstats(void)
+{
+    struct vm_stats snap;
+    struct pt_stats pts;
+
+    spinlock_acquire(&vmstats_lock);
+    snap = vmstats;
+    spinlock_release(&vmstats_lock);
+    pt_getstats(&pts);
+
+    kprintf("VM statistics:\n");
+    kprintf("    page table:              %s, %u entries, %u tables, %lu bytes\n",
+            pt_name(), pts.entries, pts.tables, pts.bytes);
+    kprintf("    tlb shootdown pages:     %u\n", snap.shootdown_pages);
+    kprintf("    tlb shootdown ipis sent: %u\n", snap.shootdown_sent);
+    kprintf("    tlb shootdowns handled:  %u (stale: %u)\n",
+            snap.shootdown_received, snap.shootdown_stale);
+    kprintf("    reference faults:        %u\n", snap.ref_faults);
+    kprintf("    exec recycled frames:    %u\n", snap.exec_recycled);
+    coreswap_printstats();
+    readahead_printstats();
+    ksm_printstats();
 }
 
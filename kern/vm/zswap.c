@@ -0,0 +1,606 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <coreswap.h>
+#include <zswap.h>
+
+/*
+ * Compressed swap, a tier in front of the swap disk.
+ *
+ * A dirty page being evicted is first compressed into a pool of kernel
+ * pages set aside at boot; it only goes to disk if it doesn't compress
+ * well or there is no disk copy to fall back on. Reading it back is a
+ * decompress rather than a disk read, and the compressed copy is freed
+ * then, so a page is never held both ways.
+ *
+ * The pool is cut into 64 byte chunks and a compressed page is a chain
+ * of them, its first chunk starting with a header naming the owner.
+ * The chain's first chunk is its slot number (ZSWAP_SLOT_BASE up) in
+ * the pte. When the pool is full the oldest pages in it, the ones that
+ * have gone longest without being wanted back, are written to disk
+ * to make room.
+ *
+ * Everything here runs under vm_lock.
+ */
+
+#define ZSWAP_CHUNK           64
+#define ZSWAP_CHUNK_DATA      (ZSWAP_CHUNK - sizeof(uint16_t))
+#define ZSWAP_CHUNKS_PER_PAGE (PAGE_SIZE / ZSWAP_CHUNK)
+#define ZNIL                  0xffff
+
+struct zchunk
+{
+    uint8_t data[ZSWAP_CHUNK_DATA];
+    uint16_t next;      // next chunk of the page, or of the free list
+};
+
+// at the start of a compressed page's first chunk
+struct zhead
+{
+    struct addrspace* owner;
+    vaddr_t vaddr;
+    uint16_t size;      // compressed bytes
+    uint16_t older;     // age list, by first chunk
+    uint16_t newer;
+};
+
+#define ZSWAP_HEAD_DATA (ZSWAP_CHUNK_DATA - sizeof(struct zhead))
+
+// Counters reported by zswap_printstats
+struct zswap_stats
+{
+    unsigned stores;     // pages compressed into the pool
+    unsigned rejected;   // ... that didn't compress enough to be worth it
+    unsigned full;       // ... that found the pool full and nothing to move out
+    unsigned loads;      // pages decompressed back, swap-ins that missed the disk
+    unsigned writebacks; // old pages moved on to disk to make room
+    unsigned stored;     // pages in the pool now
+    unsigned bytes;      // ... and their compressed size
+};
+
+static struct zswap_stats zstats;
+static struct spinlock zstats_lock = SPINLOCK_INITIALIZER;
+
+static struct zchunk** zs_pages = NULL; // the pool, a page at a time
+static unsigned zs_npages = 0;
+static unsigned zs_nchunks = 0;
+static uint16_t zs_free = ZNIL;         // free chunk list
+static unsigned zs_free_count = 0;
+static uint16_t zs_oldest = ZNIL;       // age list of stored pages
+static uint16_t zs_newest = ZNIL;
+
+// a page to compress into, or gather a chain into, and one to decompress into
+static uint8_t* zs_cbuf = NULL;
+static uint8_t* zs_pbuf = NULL;
+
+/*
+ * The compressor: LZ77 with a small hash table of recent positions,
+ * encoded like an LZ4 block. Each sequence is a token (literal count
+ * in the high nibble, match length - 4 in the low one, 15 meaning more
+ * length bytes follow), the literals, then a two byte match offset;
+ * the last sequence is literals only.
+ */
+
+#define LZ_HASH_BITS  10
+#define LZ_MIN_MATCH  4
+
+static uint16_t lz_table[1 << LZ_HASH_BITS];
+
+static uint32_t lz_read32(const uint8_t* p)
+{
+    // byte at a time, p needn't be aligned
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static unsigned lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// the extra length bytes after a nibble of 15
+static bool lz_put_length(uint8_t** op, uint8_t* oend, unsigned len)
+{
+    while (len >= 255)
+    {
+        if (*op >= oend)
+        {
+            return false;
+        }
+        *(*op)++ = 255;
+        len -= 255;
+    }
+    if (*op >= oend)
+    {
+        return false;
+    }
+    *(*op)++ = len;
+    return true;
+}
+
+// One sequence, a match length of 0 is the closing literals
+static bool lz_put_sequence(uint8_t** op, uint8_t* oend, const uint8_t* lit, unsigned nlit,
+                            unsigned offset, unsigned mlen)
+{
+    unsigned lnib = nlit < 15 ? nlit : 15;
+    unsigned mnib = 0;
+    if (mlen > 0)
+    {
+        mnib = mlen - LZ_MIN_MATCH < 15 ? mlen - LZ_MIN_MATCH : 15;
+    }
+
+    if (*op >= oend)
+    {
+        return false;
+    }
+    *(*op)++ = (lnib << 4) | mnib;
+    if (lnib == 15 && !lz_put_length(op, oend, nlit - 15))
+    {
+        return false;
+    }
+    if ((unsigned)(oend - *op) < nlit)
+    {
+        return false;
+    }
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+
+    if (mlen == 0)
+    {
+        return true;
+    }
+    if (oend - *op < 2)
+    {
+        return false;
+    }
+    *(*op)++ = offset & 0xff;
+    *(*op)++ = offset >> 8;
+    if (mnib == 15 && !lz_put_length(op, oend, mlen - LZ_MIN_MATCH - 15))
+    {
+        return false;
+    }
+    return true;
+}
+
+// Compress LEN bytes of SRC into at most MAX bytes of DST; 0 if it doesn't fit
+static unsigned lz_compress(const uint8_t* src, unsigned len, uint8_t* dst, unsigned max)
+{
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + max;
+
+    bzero(lz_table, sizeof(lz_table));
+    while (ip + LZ_MIN_MATCH <= iend)
+    {
+        uint32_t v = lz_read32(ip);
+        unsigned h = lz_hash(v);
+        const uint8_t* ref = src + lz_table[h];
+        lz_table[h] = ip - src;
+
+        if (ref >= ip || lz_read32(ref) != v)
+        {
+            ip++;
+            continue;
+        }
+        unsigned mlen = LZ_MIN_MATCH;
+        while (ip + mlen < iend && ref[mlen] == ip[mlen])
+        {
+            mlen++;
+        }
+        if (!lz_put_sequence(&op, oend, anchor, ip - anchor, ip - ref, mlen))
+        {
+            return 0;
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+    if (!lz_put_sequence(&op, oend, anchor, iend - anchor, 0, 0))
+    {
+        return 0;
+    }
+    return op - dst;
+}
+
+static bool lz_get_length(const uint8_t** ip, const uint8_t* iend, unsigned* len)
+{
+    unsigned b = 0;
+    do
+    {
+        if (*ip >= iend)
+        {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompress LEN bytes of SRC, which must come to exactly DSTLEN bytes
+static int lz_decompress(const uint8_t* src, unsigned len, uint8_t* dst, unsigned dstlen)
+{
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dstlen;
+
+    while (ip < iend)
+    {
+        unsigned token = *ip++;
+        unsigned nlit = token >> 4;
+        if (nlit == 15 && !lz_get_length(&ip, iend, &nlit))
+        {
+            return EINVAL;
+        }
+        if ((unsigned)(iend - ip) < nlit || (unsigned)(oend - op) < nlit)
+        {
+            return EINVAL;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip == iend)
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return EINVAL;
+        }
+        unsigned offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        unsigned mlen = token & 15;
+        if (mlen == 15 && !lz_get_length(&ip, iend, &mlen))
+        {
+            return EINVAL;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (unsigned)(op - dst) || (unsigned)(oend - op) < mlen)
+        {
+            return EINVAL;
+        }
+        // a byte at a time, the match may overlap what it is making
+        const uint8_t* ref = op - offset;
+        while (mlen-- > 0)
+        {
+            *op++ = *ref++;
+        }
+    }
+    return op == oend ? 0 : EINVAL;
+}
+
+/*
+ * The pool.
+ */
+
+static struct zchunk* get_chunk(uint16_t idx)
+{
+    KASSERT(idx < zs_nchunks);
+    return &zs_pages[idx / ZSWAP_CHUNKS_PER_PAGE][idx % ZSWAP_CHUNKS_PER_PAGE];
+}
+
+static struct zhead* get_head(uint16_t idx)
+{
+    return (struct zhead*)get_chunk(idx)->data;
+}
+
+static unsigned chunks_for(unsigned size)
+{
+    if (size <= ZSWAP_HEAD_DATA)
+    {
+        return 1;
+    }
+    return 1 + DIVROUNDUP(size - ZSWAP_HEAD_DATA, ZSWAP_CHUNK_DATA);
+}
+
+static uint16_t slot_to_chunk(unsigned slot)
+{
+    KASSERT(SWAP_SLOT_IS_COMPRESSED(slot));
+    KASSERT(slot - ZSWAP_SLOT_BASE < zs_nchunks);
+    return slot - ZSWAP_SLOT_BASE;
+}
+
+// Copy a stored page's compressed bytes out of its chain into zs_cbuf
+static void gather(uint16_t first)
+{
+    struct zhead* head = get_head(first);
+    unsigned size = head->size;
+    unsigned done = 0;
+
+    unsigned n = size < ZSWAP_HEAD_DATA ? size : ZSWAP_HEAD_DATA;
+    memcpy(zs_cbuf, get_chunk(first)->data + sizeof(struct zhead), n);
+    done = n;
+    uint16_t idx = get_chunk(first)->next;
+    while (done < size)
+    {
+        KASSERT(idx != ZNIL);
+        struct zchunk* chunk = get_chunk(idx);
+        n = size - done < ZSWAP_CHUNK_DATA ? size - done : ZSWAP_CHUNK_DATA;
+        memcpy(zs_cbuf + done, chunk->data, n);
+        done += n;
+        idx = chunk->next;
+    }
+}
+
+// Take a stored page off the age list and give its chunks back
+static void release(uint16_t first)
+{
+    struct zhead* head = get_head(first);
+
+    if (head->older != ZNIL)
+    {
+        get_head(head->older)->newer = head->newer;
+    }
+    else
+    {
+        zs_oldest = head->newer;
+    }
+    if (head->newer != ZNIL)
+    {
+        get_head(head->newer)->older = head->older;
+    }
+    else
+    {
+        zs_newest = head->older;
+    }
+
+    spinlock_acquire(&zstats_lock);
+    zstats.stored--;
+    zstats.bytes -= head->size;
+    spinlock_release(&zstats_lock);
+
+    uint16_t idx = first;
+    while (idx != ZNIL)
+    {
+        struct zchunk* chunk = get_chunk(idx);
+        uint16_t next = chunk->next;
+        chunk->next = zs_free;
+        zs_free = idx;
+        zs_free_count++;
+        idx = next;
+    }
+}
+
+// Move the oldest page in the pool on to disk, repointing its pte at the disk slot
+static int writeback_oldest(void)
+{
+    paddr_t paddr;
+    char control;
+    unsigned disk_slot;
+
+    uint16_t first = zs_oldest;
+    if (first == ZNIL)
+    {
+        return ENOSPC;
+    }
+    struct zhead* head = get_head(first);
+    pid_t pid = (pid_t)head->owner;
+    vaddr_t vaddr = head->vaddr;
+
+    gather(first);
+    if (lz_decompress(zs_cbuf, head->size, zs_pbuf, PAGE_SIZE) != 0)
+    {
+        panic("zswap: page 0x%x of %p is corrupt\n", vaddr, head->owner);
+    }
+    int result = swap_write_page(zs_pbuf, &disk_slot);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    result = get_page_entry(vaddr, pid, &paddr, &control);
+    KASSERT(result == 0 && (control & SWAPMASK));
+    KASSERT(PTE_TO_SWAP_SLOT(paddr) == ZSWAP_SLOT_BASE + first);
+    update_page_entry(vaddr, pid, SWAP_SLOT_TO_PTE(disk_slot), control);
+    release(first);
+
+    spinlock_acquire(&zstats_lock);
+    zstats.writebacks++;
+    spinlock_release(&zstats_lock);
+    return 0;
+}
+
+/**
+ * @brief: compress the page in frame PADDR into the pool
+ *
+ * room for the worst case is made first, by moving the oldest pages on
+ * to disk, so the scratch buffers are free again by the time we compress.
+ *
+ * @param as, vaddr: the page's owner, to find its pte again for the writeback
+ * @param slot: set to the (compressed) swap slot for the pte
+ *
+ * @return: 0 on success, EFBIG if it doesn't compress well enough, ENOSPC if
+ *          the pool is full and can't be emptied; the page must go to disk
+ */
+int zswap_store(paddr_t paddr, struct addrspace* as, vaddr_t vaddr, unsigned* slot)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    if (zs_npages == 0)
+    {
+        return ENOSPC;
+    }
+
+    while (zs_free_count < chunks_for(ZSWAP_MAX_SIZE))
+    {
+        if (writeback_oldest() != 0)
+        {
+            spinlock_acquire(&zstats_lock);
+            zstats.full++;
+            spinlock_release(&zstats_lock);
+            return ENOSPC;
+        }
+    }
+
+    unsigned size = lz_compress((const uint8_t*)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+                                zs_cbuf, ZSWAP_MAX_SIZE);
+    if (size == 0)
+    {
+        spinlock_acquire(&zstats_lock);
+        zstats.rejected++;
+        spinlock_release(&zstats_lock);
+        return EFBIG;
+    }
+
+    // take the chunks off the free list, they stay chained in the order taken
+    unsigned need = chunks_for(size);
+    uint16_t first = zs_free;
+    uint16_t last = first;
+    for (unsigned i = 1; i < need; i++)
+    {
+        last = get_chunk(last)->next;
+    }
+    zs_free = get_chunk(last)->next;
+    zs_free_count -= need;
+    get_chunk(last)->next = ZNIL;
+
+    struct zhead* head = get_head(first);
+    head->owner = as;
+    head->vaddr = vaddr;
+    head->size = size;
+    head->older = zs_newest;
+    head->newer = ZNIL;
+    if (zs_newest != ZNIL)
+    {
+        get_head(zs_newest)->newer = first;
+    }
+    else
+    {
+        zs_oldest = first;
+    }
+    zs_newest = first;
+
+    unsigned n = size < ZSWAP_HEAD_DATA ? size : ZSWAP_HEAD_DATA;
+    memcpy(get_chunk(first)->data + sizeof(struct zhead), zs_cbuf, n);
+    unsigned done = n;
+    uint16_t idx = get_chunk(first)->next;
+    while (done < size)
+    {
+        struct zchunk* chunk = get_chunk(idx);
+        n = size - done < ZSWAP_CHUNK_DATA ? size - done : ZSWAP_CHUNK_DATA;
+        memcpy(chunk->data, zs_cbuf + done, n);
+        done += n;
+        idx = chunk->next;
+    }
+
+    spinlock_acquire(&zstats_lock);
+    zstats.stores++;
+    zstats.stored++;
+    zstats.bytes += size;
+    spinlock_release(&zstats_lock);
+
+    *slot = ZSWAP_SLOT_BASE + first;
+    return 0;
+}
+
+// Decompress a stored page into frame PADDR, the stored copy is kept (fork reads it too)
+int zswap_load(paddr_t paddr, unsigned slot)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    uint16_t first = slot_to_chunk(slot);
+
+    gather(first);
+    int result = lz_decompress(zs_cbuf, get_head(first)->size,
+                               (uint8_t*)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+    if (result != 0)
+    {
+        panic("zswap: page 0x%x of %p is corrupt\n", get_head(first)->vaddr, get_head(first)->owner);
+    }
+
+    spinlock_acquire(&zstats_lock);
+    zstats.loads++;
+    spinlock_release(&zstats_lock);
+    return 0;
+}
+
+void zswap_free(unsigned slot)
+{
+    KASSERT(lock_do_i_hold(vm_lock));
+    release(slot_to_chunk(slot));
+}
+
+void zswap_printstats(unsigned disk_pageins)
+{
+    struct zswap_stats snap;
+
+    spinlock_acquire(&zstats_lock);
+    snap = zstats;
+    spinlock_release(&zstats_lock);
+
+    // compression ratio in hundredths, original size over compressed
+    unsigned ratio = 0;
+    if (snap.bytes > 0)
+    {
+        ratio = (unsigned)((unsigned long long)snap.stored * PAGE_SIZE * 100 / snap.bytes);
+    }
+    unsigned swapins = snap.loads + disk_pageins;
+    unsigned hitrate = swapins > 0 ? snap.loads * 100 / swapins : 0;
+
+    kprintf("    compressed pool:         %u pages, %u/%u chunks free\n",
+            zs_npages, zs_free_count, zs_nchunks);
+    kprintf("    compressed pages:        %u, %u bytes (ratio %u.%02u)\n",
+            snap.stored, snap.bytes, ratio / 100, ratio % 100);
+    kprintf("    compressed stores:       %u (incompressible %u, pool full %u)\n",
+            snap.stores, snap.rejected, snap.full);
+    kprintf("    compressed hits:         %u of %u swap-ins (%u%%)\n",
+            snap.loads, swapins, hitrate);
+    kprintf("    compressed writebacks:   %u\n", snap.writebacks);
+}
+
+// Called from init_coreswap, sets aside the pool out of NFRAMES free frames
+void zswap_bootstrap(unsigned nframes)
+{
+    COMPILE_ASSERT(sizeof(struct zchunk) == ZSWAP_CHUNK);
+    COMPILE_ASSERT(sizeof(struct zhead) <= ZSWAP_CHUNK_DATA);
+
+    unsigned npages = nframes / ZSWAP_POOL_DIVISOR;
+    if (npages > ZSWAP_POOL_MAX)
+    {
+        npages = ZSWAP_POOL_MAX;
+    }
+
+    zs_cbuf = (uint8_t*)alloc_kpages(1);
+    zs_pbuf = (uint8_t*)alloc_kpages(1);
+    zs_pages = kmalloc(ZSWAP_POOL_MAX * sizeof(struct zchunk*));
+    if (zs_cbuf == NULL || zs_pbuf == NULL || zs_pages == NULL)
+    {
+        panic("zswap_bootstrap: out of memory\n");
+    }
+
+    for (zs_npages = 0; zs_npages < npages; zs_npages++)
+    {
+        struct zchunk* page = (struct zchunk*)alloc_kpages(1);
+        if (page == NULL)
+        {
+            break;
+        }
+        zs_pages[zs_npages] = page;
+    }
+    zs_nchunks = zs_npages * ZSWAP_CHUNKS_PER_PAGE;
+
+    // a pool too small for the worst case page would only ever move pages on to disk
+    if (zs_nchunks < 2 * chunks_for(ZSWAP_MAX_SIZE))
+    {
+        while (zs_npages > 0)
+        {
+            free_kpages((vaddr_t)zs_pages[--zs_npages]);
+        }
+        zs_nchunks = 0;
+        kprintf("zswap: not enough memory for a compressed pool\n");
+        return;
+    }
+
+    for (unsigned i = zs_nchunks; i > 0; i--)
+    {
+        get_chunk(i - 1)->next = zs_free;
+        zs_free = i - 1;
+    }
+    zs_free_count = zs_nchunks;
+    kprintf("zswap: %u pages of compressed swap\n", zs_npages);
+}
@@ -43,6 +43,7 @@
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
+#include <kern/resource.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
 
@@ -147,6 +148,7 @@ ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 ssize_t __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
@@ -164,10 +166,41 @@ time_t time(time_t *seconds);			/* calls __time */
  * You should implement this version as this is what we expect to test.
  */
 
-#define PROT_READ 1
-#define PROT_WRITE 2
+/* PROT_* are in <kern/unistd.h> */
 
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
 
+/* Advice (MADV_*) about how a range of memory will be used. */
+int madvise(void *addr, size_t len, int advice);
+
+/* Change the protection (PROT_*) of a range of pages. */
+int mprotect(void *addr, size_t len, int prot);
+
+/*
+ * Futexes. futex_wait sleeps until a futex_wake on ADDR, unless *ADDR
+ * isn't VAL (then it fails with EAGAIN); futex_wake wakes up to NWAKE
+ * of the sleepers and returns how many it woke.
+ */
+int futex_wait(int *addr, int val);
+int futex_wake(int *addr, int nwake);
+
+/*
+ * Save the calling process (memory, registers, open files) to a file,
+ * and later replace the calling process with a saved one. checkpoint
+ * returns 0; after a restore the saved process carries on from its
+ * checkpoint call, which then returns 1.
+ */
+int checkpoint(const char *path);
+int restore(const char *path);
+
+/*
+ * Nice value (PRIO_MIN..PRIO_MAX, higher runs less) of a process. Only
+ * PRIO_PROCESS, for the calling process (who is 0 or its pid), is
+ * supported. getpriority can return -1 without failing; clear errno
+ * first to tell.
+ */
+int getpriority(int which, pid_t who);
+int setpriority(int which, pid_t who, int prio);
+
 #endif /* _UNISTD_H_ */
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * ckpttest - exercise checkpoint() and restore().
+ *
+ * Fills part of a BSS buffer, leaving the rest untouched, moves a
+ * file offset, and checkpoints. Then scribbles over all of it and
+ * restores; the restored process has to find everything as it was
+ * at the checkpoint, including the stack and the untouched (zero)
+ * pages.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define PAGESIZE  4096
+#define NPAGES    24
+#define NFILLED   16
+#define CKPTFILE  "ckpttest.img"
+#define DATAFILE  "ckpttest.dat"
+#define DATAOFF   123
+
+static char buffer[NPAGES * PAGESIZE];
+
+static
+void
+fill(char seed, unsigned npages)
+{
+	unsigned i;
+
+	for (i=0; i<npages * PAGESIZE; i++) {
+		buffer[i] = (char)(seed + i / PAGESIZE + i % 7);
+	}
+}
+
+static
+void
+check(char seed)
+{
+	unsigned i;
+	char want;
+
+	for (i=0; i<NPAGES * PAGESIZE; i++) {
+		want = i < NFILLED * PAGESIZE ?
+			(char)(seed + i / PAGESIZE + i % 7) : 0;
+		if (buffer[i] != want) {
+			errx(1, "page %u offset %u: got %d, expected %d",
+			     i / PAGESIZE, i % PAGESIZE, buffer[i], want);
+		}
+	}
+}
+
+int
+main(void)
+{
+	volatile int onstack = 0x5eed;
+	char junk[DATAOFF];
+	off_t pos;
+	int fd, r;
+
+	fd = open(DATAFILE, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", DATAFILE);
+	}
+	memset(junk, 'x', sizeof(junk));
+	if (write(fd, junk, sizeof(junk)) != (ssize_t)sizeof(junk)) {
+		err(1, "%s: write", DATAFILE);
+	}
+
+	fill(1, NFILLED);
+
+	r = checkpoint(CKPTFILE);
+	if (r < 0) {
+		err(1, "checkpoint");
+	}
+	if (r == 1) {
+		printf("ckpttest: restored, checking...\n");
+		check(1);
+		if (onstack != 0x5eed) {
+			errx(1, "stack variable: got %d", onstack);
+		}
+		pos = lseek(fd, 0, SEEK_CUR);
+		if (pos != DATAOFF) {
+			errx(1, "file offset: got %ld, expected %d",
+			     (long)pos, DATAOFF);
+		}
+		close(fd);
+		remove(DATAFILE);
+		remove(CKPTFILE);
+		printf("ckpttest: passed\n");
+		return 0;
+	}
+
+	printf("ckpttest: checkpointed, scribbling...\n");
+	fill(77, NPAGES);
+	onstack = 0;
+	lseek(fd, 0, SEEK_SET);
+
+	restore(CKPTFILE);
+	err(1, "restore");
+}
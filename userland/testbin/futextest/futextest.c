@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * futextest - exercise futex_wait and futex_wake.
+ *
+ * Checks the argument checking, that a wait on a word that has
+ * changed doesn't sleep, and that a wake with no one waiting wakes no
+ * one. Then times a lock that only makes system calls when contended
+ * against a semfs semaphore, which makes two per lock and unlock.
+ *
+ * Processes share no memory, so a process can't sleep on a futex that
+ * another one will wake; that isn't tested here.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define LOOPS 2000
+
+static int word;
+static int lockword;	/* 0 free, 1 held, 2 held with waiters */
+
+static
+long
+now_msec(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (long)secs * 1000 + nsecs / 1000000;
+}
+
+static
+void
+badcalls(void)
+{
+	char *p = (char *)&word;
+
+	if (futex_wait((int *)(p + 1), 0) != -1 || errno != EINVAL) {
+		errx(1, "futex_wait on a misaligned word didn't fail");
+	}
+	if (futex_wake((int *)(p + 1), 1) != -1 || errno != EINVAL) {
+		errx(1, "futex_wake on a misaligned word didn't fail");
+	}
+	if (futex_wait(NULL, 0) != -1 || errno != EFAULT) {
+		errx(1, "futex_wait on NULL didn't fail");
+	}
+	if (futex_wake((int *)0x40000000, 1) != -1 || errno != EFAULT) {
+		errx(1, "futex_wake on an unmapped address didn't fail");
+	}
+	if (futex_wake(&word, -1) != -1 || errno != EINVAL) {
+		errx(1, "futex_wake of -1 threads didn't fail");
+	}
+	printf("Bad calls refused\n");
+}
+
+static
+void
+nowait(void)
+{
+	int n;
+
+	word = 5;
+	if (futex_wait(&word, 4) != -1 || errno != EAGAIN) {
+		errx(1, "futex_wait on a changed word didn't fail "
+		     "with EAGAIN");
+	}
+	n = futex_wake(&word, 10);
+	if (n < 0) {
+		err(1, "futex_wake");
+	}
+	if (n != 0) {
+		errx(1, "futex_wake woke %d, but no one was waiting", n);
+	}
+	printf("Changed word and empty wake ok\n");
+}
+
+/*
+ * A futex lock. There's only one thread, so the lock is never
+ * contended and the fast path is all that runs; it's still written as
+ * it would be with threads, apart from the atomic operations.
+ */
+static
+void
+flock_acquire(int *lock)
+{
+	while (*lock != 0) {
+		*lock = 2;
+		if (futex_wait(lock, 2) < 0 && errno != EAGAIN) {
+			err(1, "futex_wait");
+		}
+	}
+	*lock = 1;
+}
+
+static
+void
+flock_release(int *lock)
+{
+	int old = *lock;
+
+	*lock = 0;
+	if (old == 2 && futex_wake(lock, 1) < 0) {
+		err(1, "futex_wake");
+	}
+}
+
+static
+void
+timing(void)
+{
+	const char *name = "sem:futextest";
+	long start, futexms, semms;
+	char c;
+	int fd, i;
+
+	start = now_msec();
+	for (i=0; i<LOOPS; i++) {
+		flock_acquire(&lockword);
+		flock_release(&lockword);
+	}
+	futexms = now_msec() - start;
+
+	fd = open(name, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	c = 0;
+	if (write(fd, &c, 1) < 0) {
+		err(1, "%s: V", name);
+	}
+	start = now_msec();
+	for (i=0; i<LOOPS; i++) {
+		if (read(fd, &c, 1) < 0) {
+			err(1, "%s: P", name);
+		}
+		if (write(fd, &c, 1) < 0) {
+			err(1, "%s: V", name);
+		}
+	}
+	semms = now_msec() - start;
+	close(fd);
+	remove(name);
+
+	printf("%d uncontended lock/unlocks: futex %ld ms, semfs %ld ms\n",
+	       LOOPS, futexms, semms);
+}
+
+int
+main(void)
+{
+	badcalls();
+	nowait();
+	timing();
+	printf("Passed futextest.\n");
+	return 0;
+}
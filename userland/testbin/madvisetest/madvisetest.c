@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * madvisetest - exercise the madvise() access hints.
+ *
+ * Walks a buffer in the BSS under each kind of advice and checks the
+ * contents survive, then checks that MADV_DONTNEED hands back zero
+ * filled pages and that bad arguments are rejected.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGESIZE 4096
+#define NPAGES   64
+
+static char buffer[(NPAGES + 1) * PAGESIZE];
+
+static
+char *
+pagealign(char *p)
+{
+	uintptr_t x = (uintptr_t)p;
+
+	return (char *)((x + PAGESIZE - 1) & ~(uintptr_t)(PAGESIZE - 1));
+}
+
+static
+void
+fill(char *base, unsigned npages, char seed)
+{
+	unsigned i;
+
+	for (i=0; i<npages; i++) {
+		memset(base + i * PAGESIZE, seed + i, PAGESIZE);
+	}
+}
+
+static
+void
+check(char *base, unsigned npages, char seed, const char *what)
+{
+	unsigned i, j;
+
+	for (i=0; i<npages; i++) {
+		for (j=0; j<PAGESIZE; j++) {
+			if (base[i * PAGESIZE + j] != (char)(seed + i)) {
+				errx(1, "%s: page %u offset %u: got %d, "
+				     "expected %d", what, i, j,
+				     base[i * PAGESIZE + j],
+				     (char)(seed + i));
+			}
+		}
+	}
+}
+
+static
+void
+advise(char *base, unsigned npages, int advice, const char *what)
+{
+	if (madvise(base, npages * PAGESIZE, advice) < 0) {
+		err(1, "madvise %s", what);
+	}
+}
+
+static
+void
+expect_error(void *addr, size_t len, int advice, int code,
+	     const char *what)
+{
+	if (madvise(addr, len, advice) == 0) {
+		errx(1, "%s: madvise succeeded", what);
+	}
+	if (errno != code) {
+		err(1, "%s: wrong error", what);
+	}
+}
+
+int
+main(void)
+{
+	char *base;
+	unsigned i;
+
+	base = pagealign(buffer);
+
+	printf("Sequential walk...\n");
+	advise(base, NPAGES, MADV_SEQUENTIAL, "MADV_SEQUENTIAL");
+	fill(base, NPAGES, 'a');
+	check(base, NPAGES, 'a', "sequential");
+
+	printf("Random walk...\n");
+	advise(base, NPAGES, MADV_RANDOM, "MADV_RANDOM");
+	for (i=0; i<NPAGES; i++) {
+		base[((i * 37) % NPAGES) * PAGESIZE] = 'a' + ((i * 37) % NPAGES);
+	}
+	check(base, NPAGES, 'a', "random");
+
+	printf("Advice on part of a region...\n");
+	advise(base + 8 * PAGESIZE, 8, MADV_SEQUENTIAL, "split");
+	advise(base, NPAGES, MADV_NORMAL, "MADV_NORMAL");
+	check(base, NPAGES, 'a', "split");
+
+	printf("Prefetch...\n");
+	advise(base, NPAGES, MADV_WILLNEED, "MADV_WILLNEED");
+	check(base, NPAGES, 'a', "willneed");
+
+	printf("Discard...\n");
+	advise(base + 16 * PAGESIZE, 16, MADV_DONTNEED, "MADV_DONTNEED");
+	check(base, 16, 'a', "below discard");
+	for (i=0; i<16 * PAGESIZE; i++) {
+		if (base[16 * PAGESIZE + i] != 0) {
+			errx(1, "discarded: byte %u is %d, expected 0",
+			     i, base[16 * PAGESIZE + i]);
+		}
+	}
+	check(base + 32 * PAGESIZE, NPAGES - 32, 'a' + 32, "above discard");
+
+	printf("Bad arguments...\n");
+	expect_error(base + 1, PAGESIZE, MADV_NORMAL, EINVAL, "unaligned");
+	expect_error(base, PAGESIZE, 12345, EINVAL, "bad advice");
+	expect_error((void *)0x7ff00000, PAGESIZE, MADV_NORMAL, ENOMEM,
+		     "unmapped");
+
+	printf("Passed madvisetest.\n");
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mprotecttest - exercise mprotect().
+ *
+ * Makes part of a BSS buffer read only and then inaccessible, checks
+ * that a child touching it gets killed while the parent still can
+ * read what it should, then gives the access back and checks the
+ * contents survived.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/wait.h>
+
+#define PAGESIZE 4096
+#define NPAGES   16
+
+static char buffer[(NPAGES + 1) * PAGESIZE];
+
+static
+char *
+pagealign(char *p)
+{
+	uintptr_t x = (uintptr_t)p;
+
+	return (char *)((x + PAGESIZE - 1) & ~(uintptr_t)(PAGESIZE - 1));
+}
+
+static
+void
+protect(char *base, unsigned npages, int prot, const char *what)
+{
+	if (mprotect(base, npages * PAGESIZE, prot) < 0) {
+		err(1, "mprotect %s", what);
+	}
+}
+
+static
+void
+check(char *base, unsigned npages, char seed, const char *what)
+{
+	unsigned i, j;
+
+	for (i=0; i<npages; i++) {
+		for (j=0; j<PAGESIZE; j += 512) {
+			if (base[i * PAGESIZE + j] != (char)(seed + i)) {
+				errx(1, "%s: page %u offset %u: got %d, "
+				     "expected %d", what, i, j,
+				     base[i * PAGESIZE + j],
+				     (char)(seed + i));
+			}
+		}
+	}
+}
+
+/*
+ * Fork a child that writes (or reads) P and make sure it gets killed
+ * for it.
+ */
+static
+void
+expect_fault(volatile char *p, int write, const char *what)
+{
+	pid_t pid;
+	int status;
+	char c;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		if (write) {
+			*p = 'x';
+		}
+		else {
+			c = *p;
+			(void)c;
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFSIGNALED(status)) {
+		errx(1, "%s: child was not killed", what);
+	}
+}
+
+int
+main(void)
+{
+	char *base;
+	unsigned i;
+
+	base = pagealign(buffer);
+	for (i=0; i<NPAGES; i++) {
+		memset(base + i * PAGESIZE, 'a' + i, PAGESIZE);
+	}
+
+	printf("Read only...\n");
+	protect(base + 4 * PAGESIZE, 4, PROT_READ, "PROT_READ");
+	check(base, NPAGES, 'a', "read only");
+	expect_fault(base + 5 * PAGESIZE, 1, "write to read only page");
+	base[3 * PAGESIZE] = 'a' + 3;
+	base[8 * PAGESIZE] = 'a' + 8;
+
+	printf("Guard page...\n");
+	protect(base + 12 * PAGESIZE, 1, PROT_NONE, "PROT_NONE");
+	expect_fault(base + 12 * PAGESIZE, 0, "read of guard page");
+	check(base, 12, 'a', "below guard");
+	check(base + 13 * PAGESIZE, NPAGES - 13, 'a' + 13, "above guard");
+
+	printf("Write again...\n");
+	protect(base, NPAGES, PROT_READ | PROT_WRITE, "PROT_READ|PROT_WRITE");
+	check(base, NPAGES, 'a', "restored");
+	for (i=0; i<NPAGES; i++) {
+		base[i * PAGESIZE + 1] = 'a' + i;
+	}
+	check(base, NPAGES, 'a', "rewritten");
+
+	printf("Bad arguments...\n");
+	if (mprotect(base + 1, PAGESIZE, PROT_READ) == 0 || errno != EINVAL) {
+		errx(1, "unaligned address not rejected");
+	}
+	if (mprotect(base, PAGESIZE, 0x100) == 0 || errno != EINVAL) {
+		errx(1, "bad protection not rejected");
+	}
+	if (mprotect((void *)0x7ff00000, PAGESIZE, PROT_READ) == 0 ||
+	    errno != ENOMEM) {
+		errx(1, "unmapped range not rejected");
+	}
+
+	printf("Passed mprotecttest.\n");
+	return 0;
+}
@@ -45,6 +45,9 @@
 
 struct usem startsem;
 
+/* nice value for the thinkers and grinders */
+static int hognice;
+
 /*
  * Task hook function that does nothing.
  */
@@ -142,6 +145,9 @@ runtaskgroup(unsigned count,
  * for the different collections of task processes independently and
  * get timing results even on kernels that don't support waitpid with
  * WNOHANG.
+ *
+ * If NICE isn't 0 the group is run at that nice value; the task
+ * processes inherit it.
  */
 static
 void
@@ -149,7 +155,7 @@ forkem(unsigned count,
        void (*prep)(unsigned, unsigned),
        void (*task)(unsigned, unsigned),
        void (*cleanup)(unsigned, unsigned),
-       unsigned groupid,
+       unsigned groupid, int nice,
        pid_t *retpid)
 {
 	*retpid = fork();
@@ -158,6 +164,9 @@ forkem(unsigned count,
 	}
 	if (*retpid == 0) {
 		/* child */
+		if (nice != 0 && setpriority(PRIO_PROCESS, 0, nice) < 0) {
+			err(1, "setpriority");
+		}
 		runtaskgroup(count, prep, task, cleanup, groupid);
 	}
 	/* parent -- just return */
@@ -235,10 +244,10 @@ runit(unsigned numthinkers, unsigned numgrinders,
 
 	usem_init(&startsem, STARTSEM);
 	createresultsfile();
-	forkem(numthinkers, nop, think, nop, 0, &pids[0]);
-	forkem(numgrinders, nop, grind, nop, 1, &pids[1]);
+	forkem(numthinkers, nop, think, nop, 0, hognice, &pids[0]);
+	forkem(numgrinders, nop, grind, nop, 1, hognice, &pids[1]);
 	for (i=0; i<numponggroups; i++) {
-		forkem(ponggroupsize, pong_prep, pong, pong_cleanup, i+2,
+		forkem(ponggroupsize, pong_prep, pong, pong_cleanup, i+2, 0,
 		       &pids[i+2]);
 	}
 	usem_open(&startsem);
@@ -281,6 +290,7 @@ usage(const char *av0)
 	warnx("  [-g grinders]         set number of grinders (default 0)");
 	warnx("  [-p ponggroups]       set number of pong groups (default 1)");
 	warnx("  [-s ponggroupsize]    set pong group size (default 6)");
+	warnx("  [-n nice]             nice thinkers and grinders (default 0)");
 	warnx("Thinkers are CPU bound; grinders are memory-bound;");
 	warnx("pong groups are I/O bound.");
 	exit(1);
@@ -309,6 +319,9 @@ main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "-s")) {
 			ponggroupsize = atoi(argv[++i]);
 		}
+		else if (!strcmp(argv[i], "-n")) {
+			hognice = atoi(argv[++i]);
+		}
 		else {
 			usage(argv[0]);
 		}
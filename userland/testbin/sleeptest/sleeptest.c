@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2016
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * sleeptest - exercise nanosleep().
+ *
+ * Checks that bad requests are refused, then times sleeps of various
+ * lengths: each has to last at least as long as asked, and not much
+ * longer than that plus a clock tick or two. Last, forks children
+ * that sleep for different times at once and checks each wakes up
+ * when its own time is up.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <sys/wait.h>
+
+#define NSEC_PER_MSEC	1000000
+#define SLACK_MSEC	100	/* allowed oversleep */
+#define NKIDS		4
+
+static
+long
+now_msec(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (long)secs * 1000 + nsecs / NSEC_PER_MSEC;
+}
+
+static
+void
+msleep(long msecs)
+{
+	struct timespec req, rem;
+
+	req.tv_sec = msecs / 1000;
+	req.tv_nsec = (msecs % 1000) * NSEC_PER_MSEC;
+	if (nanosleep(&req, &rem) < 0) {
+		err(1, "nanosleep %ld ms", msecs);
+	}
+	if (rem.tv_sec != 0 || rem.tv_nsec != 0) {
+		errx(1, "nanosleep %ld ms: time left over", msecs);
+	}
+}
+
+static
+void
+badcalls(void)
+{
+	struct timespec req;
+
+	req.tv_sec = 0;
+	req.tv_nsec = 1000000000;
+	if (nanosleep(&req, NULL) != -1 || errno != EINVAL) {
+		errx(1, "nanosleep with tv_nsec too big didn't fail");
+	}
+	req.tv_sec = -1;
+	req.tv_nsec = 0;
+	if (nanosleep(&req, NULL) != -1 || errno != EINVAL) {
+		errx(1, "nanosleep with negative time didn't fail");
+	}
+	if (nanosleep(NULL, NULL) != -1 || errno != EFAULT) {
+		errx(1, "nanosleep with null request didn't fail");
+	}
+	req.tv_sec = 0;
+	req.tv_nsec = 0;
+	if (nanosleep(&req, NULL) < 0) {
+		err(1, "nanosleep for no time");
+	}
+	printf("Bad requests refused\n");
+}
+
+static
+void
+timed(long msecs)
+{
+	long start, took;
+
+	start = now_msec();
+	msleep(msecs);
+	took = now_msec() - start;
+	printf("Asked for %ld ms, slept %ld ms\n", msecs, took);
+	if (took < msecs) {
+		errx(1, "woke up %ld ms early", msecs - took);
+	}
+	if (took > msecs + SLACK_MSEC) {
+		errx(1, "woke up %ld ms late", took - msecs - SLACK_MSEC);
+	}
+}
+
+static
+void
+concurrent(void)
+{
+	pid_t pids[NKIDS];
+	long start, took;
+	int i, status;
+
+	start = now_msec();
+	/* fork the longest sleeper first */
+	for (i=NKIDS-1; i>=0; i--) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			msleep(200 * (i + 1));
+			took = now_msec() - start;
+			if (took < 200 * (i + 1) ||
+			    took > 200 * (i + 1) + SLACK_MSEC) {
+				warnx("sleeper %d woke up after %ld ms",
+				      i, took);
+				_exit(1);
+			}
+			_exit(0);
+		}
+	}
+
+	for (i=0; i<NKIDS; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (status != 0) {
+			errx(1, "sleeper %d failed", i);
+		}
+	}
+	printf("%d sleepers woke up on time\n", NKIDS);
+}
+
+int
+main(void)
+{
+	badcalls();
+	timed(1);
+	timed(10);
+	timed(55);
+	timed(500);
+	timed(1250);
+	concurrent();
+	printf("Passed sleeptest.\n");
+	return 0;
+}